@@ -0,0 +1,47 @@
+#pragma once
+
+#include "vec3.h"
+
+#include <math.h>
+
+/*
+** An axis aligned bounding box.
+*/
+struct aabb
+{
+    struct vec3 min;
+    struct vec3 max;
+};
+
+// an empty box, which becomes valid once extended with a point
+static inline void aabb_init(struct aabb *box)
+{
+    box->min = (struct vec3){INFINITY, INFINITY, INFINITY};
+    box->max = (struct vec3){-INFINITY, -INFINITY, -INFINITY};
+}
+
+static inline void aabb_extend_point(struct aabb *box, const struct vec3 *p)
+{
+    vec3_update_min_components(&box->min, p);
+    vec3_update_max_components(&box->max, p);
+}
+
+static inline void aabb_extend(struct aabb *box, const struct aabb *o)
+{
+    vec3_update_min_components(&box->min, &o->min);
+    vec3_update_max_components(&box->max, &o->max);
+}
+
+static inline struct vec3 aabb_center(const struct aabb *box)
+{
+    struct vec3 sum = vec3_add(&box->min, &box->max);
+    return vec3_mul(&sum, 0.5);
+}
+
+static inline double aabb_half_area(const struct aabb *box)
+{
+    struct vec3 d = vec3_sub(&box->max, &box->min);
+    if (d.x < 0 || d.y < 0 || d.z < 0)
+        return 0;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "aabb.h"
+#include "ray.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// the maximum number of primitives in a leaf
+#define BVH_MAX_LEAF_SIZE 8
+
+// the maximum depth of a tree, which bounds the traversal stack size
+#define BVH_MAX_DEPTH 64
+
+// how much more expensive to traverse than when it was built a tree can
+// become through refitting, before it needs to be rebuilt
+#define BVH_REFIT_MAX_DEGRADATION 1.5
+
+/*
+** A node of a bounding volume hierarchy.
+** Inner nodes always have two children, which are stored next to each other
+** in the node array: offset is the index of the first child.
+** Leaves reference a range of the primitive index array.
+** Children are always stored after their parent.
+*/
+struct bvh_node
+{
+    float min[3];
+    // the first child for inner nodes, the first primitive for leaves
+    uint32_t offset;
+    float max[3];
+    // the number of primitives in a leaf, 0 for inner nodes
+    uint32_t count;
+};
+
+/*
+** A bounding volume hierarchy over some primitives.
+** The hierarchy knows nothing of the primitives themselves: it is built
+** from their bounding boxes, and leaves contain primitive indices.
+*/
+struct bvh
+{
+    size_t node_count;
+    struct bvh_node *nodes;
+
+    // the primitive indices referenced by leaves
+    size_t prim_count;
+    uint32_t *prims;
+
+    // the cost of the tree right after it was built
+    double build_cost;
+
+    // when the tree was loaded from a cache file, the nodes and primitives
+    // live in this private file mapping instead of being allocated
+    void *mapping;
+    size_t mapping_size;
+};
+
+// computes the bounds of primitive number prim of some container
+typedef void (*bvh_prim_bounds_f)(struct aabb *box, const void *ctx,
+                                  uint32_t prim);
+
+/*
+** Computes the bounds of the parts of a primitive on each side of an axis
+** aligned plane. Either side may be left empty.
+*/
+typedef void (*bvh_prim_split_f)(struct aabb *left, struct aabb *right,
+                                 const void *ctx, uint32_t prim, int axis,
+                                 double pos);
+
+struct bvh_params
+{
+    // spatial splits can reference a primitive from multiple leaves, which
+    // makes building slower but reduces overlap between nodes
+    bool spatial_splits;
+    // the maximum number of references spatial splits can add,
+    // relative to the number of primitives
+    double spatial_budget;
+    // trees over at least this many primitives are compressed after they
+    // are built, trading some traversal speed for memory
+    size_t compress_threshold;
+};
+
+#define BVH_PARAMS_DEFAULT                                                     \
+    {                                                                          \
+        .spatial_splits = false, .spatial_budget = 0.3,                        \
+        .compress_threshold = (size_t)1 << 20                                  \
+    }
+
+static inline void bvh_init(struct bvh *bvh)
+{
+    bvh->node_count = 0;
+    bvh->nodes = NULL;
+    bvh->prim_count = 0;
+    bvh->prims = NULL;
+    bvh->build_cost = 0;
+    bvh->mapping = NULL;
+    bvh->mapping_size = 0;
+}
+
+/*
+** Builds the hierarchy using the surface area heuristic.
+** Any previous content of the bvh is released.
+*/
+void bvh_build(struct bvh *bvh, const struct aabb *prim_bounds, size_t count);
+
+/*
+** Builds the hierarchy, using spatial splits if enabled by params.
+** As primitives straddling split planes end up referenced by both
+** children, leaves may reference the same primitive.
+*/
+void bvh_build_spatial(struct bvh *bvh, const struct aabb *prim_bounds,
+                       size_t count, const struct bvh_params *params,
+                       bvh_prim_split_f prim_split, const void *ctx);
+
+void bvh_destroy(struct bvh *bvh);
+
+/*
+** Releases the nodes of the tree, but keeps its primitive indices.
+** This is used once the tree was converted to another node format.
+** Nodes of mapped trees are left in place.
+*/
+void bvh_drop_nodes(struct bvh *bvh);
+
+/*
+** The expected cost of tracing a ray through the tree, according to the
+** surface area heuristic. It's relative to the area of the root, so that
+** costs of a moving tree can be compared.
+*/
+double bvh_cost(const struct bvh *bvh);
+
+/*
+** Updates the bounds of all nodes bottom-up from the current bounds of the
+** primitives, keeping the topology of the tree. This is much cheaper than
+** a rebuild when primitives move a little. Leaves made by spatial splits
+** get the bounds of whole primitives, which is correct but looser.
+** Returns the cost of the refitted tree relative to its cost when it was
+** built: once it exceeds BVH_REFIT_MAX_DEGRADATION, it should be rebuilt.
+*/
+double bvh_refit(struct bvh *bvh, bvh_prim_bounds_f prim_bounds,
+                 const void *ctx);
+
+// stores a double precision box into a node, rounding outwards
+void bvh_node_set_bounds(struct bvh_node *node, const struct aabb *box);
+
+static inline void bvh_node_get_bounds(struct aabb *box,
+                                       const struct bvh_node *node)
+{
+    box->min = (struct vec3){node->min[0], node->min[1], node->min[2]};
+    box->max = (struct vec3){node->max[0], node->max[1], node->max[2]};
+}
+
+/*
+** A ray, in a form suited for fast box intersection tests.
+*/
+struct bvh_ray
+{
+    double tmin;
+    double source[3];
+    double inv_dir[3];
+    // whether each direction component is negative
+    int dir_neg[3];
+};
+
+static inline void bvh_ray_init(struct bvh_ray *bray, const struct ray *ray)
+{
+    const double dir[3] = {ray->direction.x, ray->direction.y,
+                           ray->direction.z};
+    bray->tmin = ray->tmin;
+    bray->source[0] = ray->source.x;
+    bray->source[1] = ray->source.y;
+    bray->source[2] = ray->source.z;
+    for (size_t i = 0; i < 3; i++)
+    {
+        bray->inv_dir[i] = 1. / dir[i];
+        bray->dir_neg[i] = dir[i] < 0;
+    }
+}
+
+/*
+** Returns the distance at which the ray enters the node, or INFINITY if the
+** ray misses the node, or only overlaps it before its tmin or after max_dist.
+*/
+static inline double bvh_node_intersect(const struct bvh_node *node,
+                                        const struct bvh_ray *bray,
+                                        double max_dist)
+{
+    double t_near = bray->tmin;
+    double t_far = max_dist;
+    for (size_t i = 0; i < 3; i++)
+    {
+        double t0 = (node->min[i] - bray->source[i]) * bray->inv_dir[i];
+        double t1 = (node->max[i] - bray->source[i]) * bray->inv_dir[i];
+        if (bray->dir_neg[i])
+        {
+            double tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+
+        // comparisons are written so that NaNs are ignored
+        if (t0 > t_near)
+            t_near = t0;
+        if (t1 < t_far)
+            t_far = t1;
+    }
+
+    if (t_near > t_far)
+        return INFINITY;
+    return t_near;
+}
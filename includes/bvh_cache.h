@@ -0,0 +1,43 @@
+#pragma once
+
+#include "bvh.h"
+#include "qbvh.h"
+
+#include <stdint.h>
+
+/*
+** Acceleration structures can be saved to disk, and mapped back into memory
+** instead of being rebuilt. Cache files are tagged with a key, which must
+** identify both the primitives and how the tree was built: a cache file
+** with another key is considered stale.
+** Files hold trees in their final state: primitives may have been renumbered
+** to follow the layout of the tree, and the tree may have been compressed.
+*/
+
+/*
+** Maps a cached tree over count primitives into memory, along with its
+** compressed nodes unless qbvh is NULL. new_ids is set to how primitives
+** were renumbered: primitive i became primitive new_ids[i], which is what
+** the tree references. The renumbering lives in the mapping of the bvh.
+** Returns -1 if there's no cache file, if it doesn't match the key or the
+** compression, or if it is corrupted, in which case nothing is touched.
+*/
+int bvh_cache_load(struct bvh *bvh, struct qbvh *qbvh,
+                   const uint32_t **new_ids, const char *path, uint64_t key,
+                   size_t count);
+
+/*
+** Saves a tree over count primitives to a cache file, atomically replacing
+** any previous one. qbvh holds its compressed nodes, or is NULL.
+*/
+int bvh_cache_store(const struct bvh *bvh, const struct qbvh *qbvh,
+                    const uint32_t *new_ids, size_t count, const char *path,
+                    uint64_t key);
+
+/*
+** Returns the path of the cache file for some key. With a cache directory,
+** the key names the file. Otherwise, the cache lives next to the source file.
+** The result must be freed.
+*/
+char *bvh_cache_path(const char *cache_dir, const char *source_path,
+                     uint64_t key);
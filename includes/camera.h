@@ -1,8 +1,22 @@
 #pragma once
 
+#include "aabb.h"
 #include "ray.h"
 #include "vec3.h"
+
 #include <math.h>
+#include <stdbool.h>
+
+/*
+** Perspective cameras cast rays from a vantage point behind the image plane,
+** through the image plane. Orthographic cameras cast parallel rays from the
+** image plane, along the forward direction.
+*/
+enum camera_projection
+{
+    CAMERA_PERSPECTIVE,
+    CAMERA_ORTHOGRAPHIC,
+};
 
 struct camera
 {
@@ -14,6 +28,7 @@ struct camera
     double height;
 
     double focal_distance;
+    enum camera_projection projection;
 };
 
 static inline double focal_distance_from_fov(double width, double fov_deg)
@@ -50,3 +65,70 @@ static inline double focal_distance_from_fov(double width, double fov_deg)
 */
 void camera_cast_ray(struct ray *ray, const struct camera *camera, double cam_x,
                      double cam_y);
+
+/*
+** What casting rays needs to know about a camera, computed once per frame
+** rather than for every ray.
+*/
+struct camera_basis
+{
+    enum camera_projection projection;
+    // the center of the image plane
+    struct vec3 center;
+    // the offsets from one side of the image plane to the other
+    struct vec3 right;
+    struct vec3 up;
+    // the offset from the vantage point to the center of the image plane
+    struct vec3 forward;
+};
+
+void camera_basis_init(struct camera_basis *basis, const struct camera *camera);
+
+// casts a single ray, the same way camera_cast_batch does
+void camera_basis_cast_ray(struct ray *ray, const struct camera_basis *basis,
+                           double cam_x, double cam_y);
+
+/*
+** Finds the position on the image plane of the ray which goes through
+** point, and how far along this ray the point is. Returns false if no ray
+** goes through the point, as it's behind the image plane.
+*/
+bool camera_basis_project(double *cam_x, double *cam_y, double *dist,
+                          const struct camera_basis *basis,
+                          const struct vec3 *point);
+
+/*
+** Casts a batch of rays, given their position on the image plane as arrays
+** of count coordinates, such as all the samples of an image tile. Rays are
+** generated a few at a time using SIMD, with code specialized for each
+** projection.
+*/
+void camera_cast_batch(struct ray_batch *batch,
+                       const struct camera_basis *basis, const double *cam_x,
+                       const double *cam_y, size_t count);
+
+/*
+** The planes bounding the rays cast through a rectangle of the image plane:
+** its four sides, and the image plane itself, which rays start from.
+** Points p inside all planes have dot(normal, p) >= offset.
+*/
+struct camera_frustum
+{
+    struct vec3 normal[5];
+    double offset[5];
+};
+
+/*
+** Computes the frustum of the rays cast through the rectangle of the image
+** plane from (x_min, y_min) to (x_max, y_max).
+*/
+void camera_frustum_init(struct camera_frustum *frustum,
+                         const struct camera_basis *basis, double x_min,
+                         double y_min, double x_max, double y_max);
+
+/*
+** Whether a box may overlap the frustum. It's conservative: some boxes
+** outside of the frustum, near its edges, aren't rejected.
+*/
+bool camera_frustum_overlaps(const struct camera_frustum *frustum,
+                             const struct aabb *box);
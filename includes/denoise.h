@@ -0,0 +1,21 @@
+#pragma once
+
+#include "hdr_image.h"
+
+#include <stddef.h>
+
+// the number of filtering passes denoise does by default
+#define DENOISE_ITERATIONS 5
+
+/*
+** Removes noise from a render using an edge-avoiding à-trous wavelet filter
+** (Dammertz et al., 2010). A 5x5 blur is applied iterations times, with its
+** taps spread twice as far apart each time. Taps whose normal, depth or
+** color differ from those of the filtered pixel are weighted down, so that
+** edges stay sharp.
+** normal and depth are the normal and depth passes of the same render, as
+** the renderer encodes them: normals are mapped to [0, 1], and depths are
+** stored as 1 / (distance + 1), zero being the background.
+*/
+void denoise(struct hdr_image *color, const struct hdr_image *normal,
+             const struct hdr_image *depth, size_t iterations);
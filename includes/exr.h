@@ -0,0 +1,14 @@
+#pragma once
+
+#include "hdr_image.h"
+
+#include <stdio.h>
+
+// the size of the square tiles written to exr files
+#define EXR_TILE_SIZE 32
+
+/*
+** Writes a linear color image to an uncompressed, tiled OpenEXR file,
+** using half floats for all three channels.
+*/
+int exr_write(const struct hdr_image *image, FILE *file);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "scene.h"
+
+/*
+** Loads a binary glTF 2.0 file. Each glTF mesh becomes a mesh, placed in
+** the scene by an instance per node referencing it, with the transform of
+** the node. Triangle primitives are loaded, along with the base color and
+** metallic factors of their materials. Other primitives, textures and
+** external buffers aren't supported.
+** The file is mapped into memory: positions and indices stored as packed
+** floats and 32 bit integers are used in place instead of being copied.
+*/
+int load_glb(struct scene *scene, const char *filename);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "aabb.h"
+#include "ray.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** A uniform grid over some primitives.
+** Like the bvh, the grid knows nothing of the primitives themselves:
+** it is built from their bounding boxes, and each cell references the
+** primitives overlapping it. It builds in linear time, and is well suited
+** to many primitives of similar size spread over the scene.
+*/
+struct grid
+{
+    struct aabb box;
+    // the number of cells along each axis
+    size_t res[3];
+    double cell_size[3];
+    double inv_cell_size[3];
+
+    // the primitives of cell i are prims[cells[i]] to prims[cells[i + 1]],
+    // where cells are indexed x first
+    uint32_t *cells;
+    size_t prim_count;
+    uint32_t *prims;
+};
+
+static inline void grid_init(struct grid *grid)
+{
+    aabb_init(&grid->box);
+    for (size_t i = 0; i < 3; i++)
+    {
+        grid->res[i] = 0;
+        grid->cell_size[i] = 0;
+        grid->inv_cell_size[i] = 0;
+    }
+    grid->cells = NULL;
+    grid->prim_count = 0;
+    grid->prims = NULL;
+}
+
+/*
+** Whether primitives with these bounds are similar enough in size and
+** spread evenly enough for a grid to beat a bvh.
+*/
+bool grid_suits(const struct aabb *prim_bounds, size_t count);
+
+/*
+** Builds the grid in parallel using a counting sort of primitive references
+** into cells. Any previous content of the grid is released.
+*/
+void grid_build(struct grid *grid, const struct aabb *prim_bounds,
+                size_t count);
+
+void grid_destroy(struct grid *grid);
+
+static inline size_t grid_cell_index(const struct grid *grid,
+                                     const size_t cell[3])
+{
+    return (cell[2] * grid->res[1] + cell[1]) * grid->res[0] + cell[0];
+}
+
+// the cell containing coordinate pos along some axis, clamped to the grid
+static inline size_t grid_cell_coord(const struct grid *grid, int axis,
+                                     double pos)
+{
+    double min = vec3_axis(&grid->box.min, axis);
+    double coord = (pos - min) * grid->inv_cell_size[axis];
+    if (!(coord > 0))
+        return 0;
+    if (coord >= grid->res[axis])
+        return grid->res[axis] - 1;
+    return coord;
+}
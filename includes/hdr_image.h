@@ -0,0 +1,55 @@
+#pragma once
+
+#include "image.h"
+#include "utils/alloc.h"
+#include "vec3.h"
+
+#include <stddef.h>
+
+/*
+** A linear, unclamped light value, as accumulated by the renderer.
+** Three packed floats, so that a whole image can be handed to float
+** image formats without any conversion.
+*/
+struct hdr_pixel
+{
+    float r;
+    float g;
+    float b;
+};
+
+/*
+** A floating point frame buffer. Lines are stored from the bottom up,
+** just like rgb_image.
+*/
+struct hdr_image
+{
+    size_t width;
+    size_t height;
+    struct hdr_pixel data[];
+};
+
+struct hdr_image *hdr_image_alloc(size_t width, size_t height);
+void hdr_image_clear(struct hdr_image *image, const struct vec3 *light);
+
+/*
+** Gamma encodes and clamps the whole image to 24 bit rgb.
+** Both images must have the same dimensions.
+*/
+void hdr_image_quantize(struct rgb_image *dst, const struct hdr_image *src);
+
+static inline void hdr_image_set(struct hdr_image *image, size_t x, size_t y,
+                                 const struct vec3 *light)
+{
+    struct hdr_pixel *pix = &image->data[image->width * y + x];
+    pix->r = light->x;
+    pix->g = light->y;
+    pix->b = light->z;
+}
+
+static inline struct vec3 hdr_image_get(const struct hdr_image *image,
+                                        size_t x, size_t y)
+{
+    const struct hdr_pixel *pix = &image->data[image->width * y + x];
+    return (struct vec3){pix->r, pix->g, pix->b};
+}
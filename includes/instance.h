@@ -0,0 +1,45 @@
+#pragma once
+
+#include "mesh.h"
+#include "object.h"
+#include "transform.h"
+
+/*
+** A placement of a mesh in the scene.
+** Many instances can share the same mesh, with different transformations:
+** the geometry and its acceleration structure are stored only once.
+*/
+struct instance
+{
+    struct object base;
+
+    struct mesh *mesh;
+    // from the mesh space to the world space
+    struct transform to_world;
+    // from the world space to the mesh space
+    struct transform to_mesh;
+};
+
+double object_instance_ray_intersect(struct object_hit *hit,
+                                     const struct object *obj,
+                                     const struct ray *ray);
+
+void instance_finalize_hit(struct object_intersection *inter,
+                           const struct object_hit *hit,
+                           const struct ray *ray, double dist);
+
+void instance_bounds(struct aabb *box, const struct object *obj);
+
+void instance_free(struct object *obj);
+
+static inline bool object_is_instance(const struct object *obj)
+{
+    return obj->intersect == object_instance_ray_intersect;
+}
+
+/*
+** Creates an instance of a mesh. The instance takes a new reference
+** to the mesh. Returns NULL if the transformation can't be inverted.
+*/
+struct instance *instance_create(struct mesh *mesh,
+                                 const struct transform *to_world);
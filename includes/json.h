@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum json_type
+{
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT,
+};
+
+/*
+** A parsed JSON document, as a tree of values.
+*/
+struct json_value
+{
+    enum json_type type;
+    bool boolean;
+    double number;
+    // NUL terminated, with escapes decoded
+    char *string;
+
+    // the items of arrays, or the values of the members of objects
+    size_t count;
+    struct json_value *items;
+    // the keys of the members of objects
+    char **keys;
+};
+
+/*
+** Parses a JSON document, which doesn't have to be NUL terminated.
+** Returns NULL if it's invalid. The result must be freed using json_free.
+*/
+struct json_value *json_parse(const char *text, size_t size);
+
+void json_free(struct json_value *value);
+
+/*
+** Returns the value of a member of an object, or NULL if value isn't an
+** object or doesn't have such a member.
+*/
+const struct json_value *json_get(const struct json_value *value,
+                                  const char *key);
+
+/*
+** Returns an item of an array, or NULL if value isn't an array or is too
+** short.
+*/
+const struct json_value *json_at(const struct json_value *value, size_t i);
+
+// the number held by value, or def if value isn't a number
+double json_number(const struct json_value *value, double def);
+
+/*
+** Reads a number which must be a non negative integer, such as an index.
+** Returns false if it's something else.
+*/
+bool json_index(size_t *res, const struct json_value *value);
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "bvh.h"
+#include "object.h"
+#include "qbvh.h"
+#include "triangle.h"
+#include "utils/refcnt.h"
+#include "vec3.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** A triangle mesh, with its own acceleration structure.
+** Meshes aren't objects: they are only placed in the scene through
+** instances, which can share the same mesh. Meshes are reference counted.
+**
+** The facing side of each triangle is the one where the points appear
+** in counter clockwise order. Back sides aren't hit by default, which can
+** be changed using the cull mode.
+*/
+struct mesh
+{
+    // a reference counter. should be the first field!
+    struct refcnt refcnt;
+
+    // three floats per vertex
+    size_t vertex_count;
+    float *vertices;
+    // when vertices were renumbered after loading, such as by mesh_optimize,
+    // loaded vertex i became vertex vertex_remap[i], or was dropped if
+    // UINT32_MAX. NULL if vertices are still in the order they were loaded
+    size_t loaded_vertex_count;
+    uint32_t *vertex_remap;
+
+    // three vertex indices per face
+    size_t face_count;
+    uint32_t *faces;
+    // an index into the material table for each face
+    uint32_t *face_materials;
+
+    // when the geometry was loaded from a private file mapping, vertices
+    // and faces may point into it instead of being allocated
+    void *mapping;
+    size_t mapping_size;
+
+    size_t material_count;
+    struct material **materials;
+
+    // which side of faces rays can't hit
+    enum cull_mode cull;
+
+    struct bvh bvh;
+    // large meshes get their tree compressed once built: the nodes of bvh
+    // are then released, and only its primitive indices are kept
+    bool compressed;
+    struct qbvh qbvh;
+    // how the acceleration structure is built
+    struct bvh_params bvh_params;
+};
+
+struct mesh *mesh_create(void);
+
+/*
+** Takes ownership of the vertex and face arrays.
+*/
+void mesh_set_geometry(struct mesh *mesh, float *vertices, size_t vertex_count,
+                       uint32_t *faces, uint32_t *face_materials,
+                       size_t face_count);
+
+/*
+** Hands a private file mapping over to the mesh, which unmaps it once
+** released. Geometry arrays passed to mesh_set_geometry may then point into
+** the mapping: they aren't freed.
+*/
+void mesh_set_mapping(struct mesh *mesh, void *mapping, size_t mapping_size);
+
+/*
+** Adds a material to the mesh material table, and returns its index.
+** The mesh takes a new reference to the material.
+*/
+uint32_t mesh_add_material(struct mesh *mesh, struct material *mat);
+
+/*
+** (Re)builds the acceleration structure of the mesh. This has to be done
+** once the geometry is set, before the mesh is used.
+** Faces are renumbered to follow the layout of the tree.
+*/
+void mesh_build(struct mesh *mesh);
+
+/*
+** Computes a key identifying the geometry of the mesh, and how its
+** acceleration structure is built.
+*/
+uint64_t mesh_cache_key(const struct mesh *mesh);
+
+/*
+** Maps the acceleration structure from a cache file if it matches the key,
+** or builds it and stores it in the cache file. Cached trees are stored
+** compressed and over renumbered faces, when they are: loading one only
+** renumbers the faces of the mesh.
+*/
+void mesh_build_cached(struct mesh *mesh, uint64_t key, const char *path);
+
+/*
+** Records that vertices were renumbered: of the count vertices from before,
+** vertex i became vertex remap[i], or was dropped if UINT32_MAX.
+** Takes ownership of remap.
+*/
+void mesh_remap_vertices(struct mesh *mesh, uint32_t *remap, size_t count);
+
+// the number of vertices the mesh was loaded with
+static inline size_t mesh_loaded_vertex_count(const struct mesh *mesh)
+{
+    return mesh->vertex_remap ? mesh->loaded_vertex_count : mesh->vertex_count;
+}
+
+/*
+** Replaces the position of all vertices, for animated meshes whose topology
+** doesn't change. vertices holds three floats per vertex, in the order they
+** were loaded in, even if they were renumbered since. It is copied.
+** Loaded vertices which were welded together take the position of the last
+** one, and dropped vertices are ignored.
+** The acceleration structure has to be updated using mesh_refit.
+*/
+void mesh_set_vertices(struct mesh *mesh, const float *vertices);
+
+/*
+** Copies the position of all vertices, in the order mesh_set_vertices
+** expects them. Dropped vertices are set to the origin.
+*/
+void mesh_get_vertices(const struct mesh *mesh, float *vertices);
+
+/*
+** Updates the acceleration structure after vertices moved.
+** The bounds of the tree are refitted, unless the tree has degraded too much,
+** in which case it is rebuilt. Compressed trees are always rebuilt.
+** Returns true if the tree was rebuilt.
+*/
+bool mesh_refit(struct mesh *mesh);
+
+void mesh_bounds(struct aabb *box, const struct mesh *mesh);
+
+/*
+** Intersects a ray, in the space of the mesh, with the mesh. The face hit
+** is stored as the primitive of the hit.
+*/
+double mesh_intersect(struct object_hit *hit, const struct mesh *mesh,
+                      const struct ray *ray);
+
+/*
+** Fills the normal, in the space of the mesh, and the material of a hit
+** found by mesh_intersect. The point is left to the caller.
+*/
+void mesh_finalize_hit(struct object_intersection *inter,
+                       const struct mesh *mesh, const struct object_hit *hit);
+
+static inline struct vec3 mesh_vertex(const struct mesh *mesh, uint32_t i)
+{
+    const float *v = &mesh->vertices[3 * (size_t)i];
+    return (struct vec3){v[0], v[1], v[2]};
+}
+
+// increases the mesh reference counter
+static inline struct mesh *mesh_get(struct mesh *mesh)
+{
+    ref_get(&mesh->refcnt);
+    return mesh;
+}
+
+// decreases the mesh reference counter
+static inline void mesh_put(struct mesh *mesh)
+{
+    ref_put(&mesh->refcnt);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "mesh.h"
+#include "object.h"
+#include "scene.h"
+#include "transform.h"
+
+/*
+** What the loaders of mesh files have in common.
+*/
+
+/*
+** Creates the phong material loaders give surfaces, from their diffuse
+** color, and adds it to the scene. The caller owns the only reference to
+** the material.
+*/
+struct material *mesh_loader_material(struct scene *scene,
+                                      const float diffuse[3]);
+
+/*
+** Builds the acceleration structure of a freshly loaded mesh, as configured
+** by the scene, optimizing its geometry first if the scene asks for it.
+** filename is the file the mesh comes from, next to which its tree is
+** cached.
+*/
+void mesh_loader_build(struct scene *scene, struct mesh *mesh,
+                       const char *filename);
+
+/*
+** Places a built mesh in the scene. The instance takes its own reference to
+** the mesh. Returns -1 if the transformation can't be inverted.
+*/
+int mesh_loader_add_instance(struct scene *scene, struct mesh *mesh,
+                             const struct transform *to_world);
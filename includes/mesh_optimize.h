@@ -0,0 +1,31 @@
+#pragma once
+
+#include "mesh.h"
+
+#include <stddef.h>
+
+/*
+** What mesh_optimize removed from a mesh.
+*/
+struct mesh_optimize_stats
+{
+    // vertices merged with another one at the same position
+    size_t welded_vertices;
+    // vertices no face references anymore
+    size_t unused_vertices;
+    // faces with repeated vertices, or no area
+    size_t degenerate_faces;
+    // faces with the same vertices, in the same order, as an earlier face
+    size_t duplicate_faces;
+};
+
+/*
+** Cleans up the geometry of a mesh before its acceleration structure is
+** built. Vertices at the exact same position are welded, and degenerate
+** and duplicate faces are removed. Faces are then sorted along a Morton
+** curve through their centers, and vertices numbered in the order faces
+** first use them, so that neighboring triangles are close in memory.
+** The mesh remembers where vertices went, so that mesh_set_vertices still
+** takes them in the order they were loaded in.
+*/
+void mesh_optimize(struct mesh *mesh, struct mesh_optimize_stats *stats);
@@ -2,4 +2,10 @@
 
 #include "scene.h"
 
+/*
+** Loads an OBJ file as a single mesh, along with the materials of its mtl
+** library. The file is parsed as it is read, straight into the arrays of
+** the mesh. Polygons are split into triangles, and faces without a known
+** material get a default one.
+*/
 int load_obj(struct scene *scene, const char *filename);
@@ -1,9 +1,13 @@
 #pragma once
 
+#include "aabb.h"
 #include "ray.h"
 #include "utils/refcnt.h"
 #include "vec3.h"
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /*
 ** The location and normal of an intersection.
 */
@@ -39,6 +43,15 @@ struct material
 
     // a shading function
     material_shader_f shade;
+
+    // how much light is reflected in the mirror direction, per channel.
+    // reflection rays are only traced for materials which reflect
+    struct vec3 reflectance;
+
+    // the index of the material among all the materials of the scene, given
+    // by scene_add_material. materials shared by several objects keep a
+    // single identifier
+    uint32_t id;
 };
 
 typedef void (*material_free_f)(struct material *mat);
@@ -49,6 +62,8 @@ static inline void material_init(struct material *mat, material_free_f mat_free,
     // this cast is safe as refcnt is the first field of material
     ref_init(&mat->refcnt, (refcnt_free_f)mat_free);
     mat->shade = mat_shader;
+    mat->reflectance = (struct vec3){0, 0, 0};
+    mat->id = 0;
 }
 
 #define MATERIAL_STATIC_INIT(Shader)                                           \
@@ -56,6 +71,12 @@ static inline void material_init(struct material *mat, material_free_f mat_free,
         .refcnt = REFCNT_STATIC_INIT, .shade = (Shader)                        \
     }
 
+static inline bool material_reflects(const struct material *mat)
+{
+    return mat->reflectance.x > 0 || mat->reflectance.y > 0
+           || mat->reflectance.z > 0;
+}
+
 // increases the material reference counter
 static inline struct material *material_get(struct material *mat)
 {
@@ -80,27 +101,74 @@ struct object_intersection
 
 struct object;
 
+/*
+** What intersection tests record about a hit: only what is needed to
+** compute the intersection later on. As most hits end up being replaced by
+** closer ones, the point, normal and material are only computed for the
+** closest hit, by the finalize function of the object.
+*/
+struct object_hit
+{
+    // the object which was hit, and its index in the scene
+    const struct object *object;
+    uint32_t object_id;
+    // which primitive of the object was hit, such as a mesh face
+    uint32_t prim;
+    // whether the back side of the primitive was hit
+    bool back;
+    // the barycentric coordinates of the hit on the primitive, if any: the
+    // weights of its second and third vertices
+    double u;
+    double v;
+};
+
 typedef void (*object_free_f)(struct object *obj);
 
-typedef double (*object_intersect_f)(struct object_intersection *inter,
+/*
+** Fills in the primitive and barycentric coordinates of the hit, and returns
+** the intersection distance, or INFINITY. The object fields are left to the
+** caller.
+*/
+typedef double (*object_intersect_f)(struct object_hit *hit,
                                      const struct object *obj,
                                      const struct ray *ray);
 
+// computes the intersection of a hit found along a ray, at some distance
+typedef void (*object_finalize_f)(struct object_intersection *inter,
+                                  const struct object_hit *hit,
+                                  const struct ray *ray, double dist);
+
+// computes a bounding box of the object, in world space
+typedef void (*object_bounds_f)(struct aabb *box, const struct object *obj);
+
 /*
 ** The common interface for objects.
-** Those only need an intersection function and a descructor.
+** Those only need an intersection function, a function computing the
+** intersection of hits, a bounding box function, and a descructor.
 ** If more function pointers are added, they should probably be moved to
 *constant memory.
 */
 struct object
 {
     object_intersect_f intersect;
+    object_finalize_f finalize;
+    object_bounds_f bounds;
     object_free_f free;
 };
 
 static inline void object_init(struct object *obj, object_intersect_f intersect,
-                               object_free_f free)
+                               object_finalize_f finalize,
+                               object_bounds_f bounds, object_free_f free)
 {
     obj->intersect = intersect;
+    obj->finalize = finalize;
+    obj->bounds = bounds;
     obj->free = free;
 }
+
+static inline void object_finalize_hit(struct object_intersection *inter,
+                                       const struct object_hit *hit,
+                                       const struct ray *ray, double dist)
+{
+    hit->object->finalize(inter, hit, ray, dist);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "hdr_image.h"
+
+#include <stdio.h>
+
+/*
+** Writes a linear color image to the Portable Float Map format.
+** The frame buffer layout matches the file layout, so no conversion
+** nor copy happens.
+*/
+int pfm_write(const struct hdr_image *image, FILE *file);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "scene.h"
+
+/*
+** Loads a binary little endian PLY file, such as the ones 3D scanners
+** export, as a single mesh. Polygons are split into triangles, and
+** properties other than vertex positions and face indices are ignored.
+** The file is mapped into memory: when vertices only have float x, y and z
+** properties, the mesh uses them in place instead of copying them.
+*/
+int load_ply(struct scene *scene, const char *filename);
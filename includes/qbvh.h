@@ -0,0 +1,150 @@
+#pragma once
+
+#include "bvh.h"
+#include "ray.h"
+#include "utils/simd.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// the child count of an unused child slot
+#define QBVH_EMPTY_CHILD 0xf
+
+// the smallest grid step exponent, which keeps steps normal floats
+#define QBVH_MIN_EXPONENT (-126)
+
+/*
+** A compressed bvh node, holding the bounds of its two children.
+** Child bounds are quantized to 8 bits on a grid local to the node:
+** bound = origin + q * 2^exponent, rounded outwards.
+** This takes about half the memory of regular nodes.
+*/
+struct qbvh_node
+{
+    float origin[3];
+    int8_t exponent[3];
+    // 4 bits per child: 0 for inner nodes, the number of primitives for
+    // leaves, or QBVH_EMPTY_CHILD
+    uint8_t meta;
+    // x, y, z of the first child, then x, y, z of the second one
+    uint8_t lo[6];
+    uint8_t hi[6];
+    // the node index of inner children, or the first primitive of leaves
+    uint32_t child[2];
+};
+
+/*
+** A bvh made of compressed nodes. Primitive references are not copied:
+** leaves reference the primitive array of the bvh it was built from.
+*/
+struct qbvh
+{
+    size_t node_count;
+    struct qbvh_node *nodes;
+    struct aabb root_box;
+    // when the tree was loaded from a cache file, nodes live in the file
+    // mapping of the bvh instead of being allocated
+    bool mapped;
+};
+
+static inline void qbvh_init(struct qbvh *qbvh)
+{
+    qbvh->node_count = 0;
+    qbvh->nodes = NULL;
+    aabb_init(&qbvh->root_box);
+    qbvh->mapped = false;
+}
+
+// converts a bvh into compressed nodes
+void qbvh_build(struct qbvh *qbvh, const struct bvh *bvh);
+
+void qbvh_destroy(struct qbvh *qbvh);
+
+static inline unsigned qbvh_child_count(const struct qbvh_node *node,
+                                        size_t child)
+{
+    return (node->meta >> (4 * child)) & 0xf;
+}
+
+// builds the grid step 2^exponent without going through ldexpf
+static inline float qbvh_scale(int exponent)
+{
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float res;
+    memcpy(&res, &bits, sizeof(res));
+    return res;
+}
+
+/*
+** A ray, in a form suited to test the children of compressed nodes.
+** The last lane is unused.
+*/
+struct qbvh_ray
+{
+    double tmin;
+    double source[3];
+    v4f inv_dir;
+};
+
+static inline void qbvh_ray_init(struct qbvh_ray *qray, const struct ray *ray)
+{
+    const double dir[3] = {ray->direction.x, ray->direction.y,
+                           ray->direction.z};
+    qray->tmin = ray->tmin;
+    qray->source[0] = ray->source.x;
+    qray->source[1] = ray->source.y;
+    qray->source[2] = ray->source.z;
+    for (size_t i = 0; i < 3; i++)
+        qray->inv_dir[i] = 1. / dir[i];
+    qray->inv_dir[3] = 0;
+}
+
+/*
+** Decodes the bounds of both children, and intersects them with the ray.
+** Stores the entry distance of each child in dist, or INFINITY.
+*/
+static inline void qbvh_node_intersect(double dist[2],
+                                       const struct qbvh_node *node,
+                                       const struct qbvh_ray *qray,
+                                       double max_dist)
+{
+    // offsets are computed in double precision relative to the node,
+    // so that single precision slab tests stay accurate close to the ray
+    // source
+    v4f offset = {node->origin[0] - qray->source[0],
+                  node->origin[1] - qray->source[1],
+                  node->origin[2] - qray->source[2], 0};
+    v4f scale = {qbvh_scale(node->exponent[0]), qbvh_scale(node->exponent[1]),
+                 qbvh_scale(node->exponent[2]), 0};
+
+    for (size_t child = 0; child < 2; child++)
+    {
+        const uint8_t *q_lo = &node->lo[3 * child];
+        const uint8_t *q_hi = &node->hi[3 * child];
+        v4f lo = {q_lo[0], q_lo[1], q_lo[2], 0};
+        v4f hi = {q_hi[0], q_hi[1], q_hi[2], 0};
+
+        v4f t_lo = (lo * scale + offset) * qray->inv_dir;
+        v4f t_hi = (hi * scale + offset) * qray->inv_dir;
+        v4f t_near = v4f_min(t_lo, t_hi);
+        v4f t_far = v4f_max(t_lo, t_hi);
+
+        double near = qray->tmin;
+        double far = max_dist;
+        for (size_t axis = 0; axis < 3; axis++)
+        {
+            // comparisons are written so that NaNs are ignored
+            if (t_near[axis] > near)
+                near = t_near[axis];
+            if (t_far[axis] < far)
+                far = t_far[axis];
+        }
+
+        // make up for single precision rounding errors
+        dist[child] = near <= far * (1 + 8 * FLT_EPSILON) ? near : INFINITY;
+    }
+}
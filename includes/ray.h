@@ -2,8 +2,90 @@
 
 #include "vec3.h"
 
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+** How far from their source rays spawned on a surface start looking for
+** intersections, relative to the magnitude of the coordinates of their
+** source. It keeps them from hitting the surface they start from.
+*/
+#define RAY_SELF_HIT_EPSILON 1e-7
+
 struct ray
 {
     struct vec3 source;
     struct vec3 direction;
+
+    // only intersections at distances in [tmin, tmax) count
+    double tmin;
+    double tmax;
 };
+
+static inline void ray_init(struct ray *ray, const struct vec3 *source,
+                            const struct vec3 *direction)
+{
+    ray->source = *source;
+    ray->direction = *direction;
+    ray->tmin = 0;
+    ray->tmax = INFINITY;
+}
+
+/*
+** Sets up a ray leaving a surface from a point on it.
+*/
+static inline void ray_init_from_surface(struct ray *ray,
+                                         const struct vec3 *point,
+                                         const struct vec3 *direction)
+{
+    ray_init(ray, point, direction);
+    double scale = fmax(fabs(point->x), fmax(fabs(point->y), fabs(point->z)));
+    ray->tmin = RAY_SELF_HIT_EPSILON * (1 + scale);
+}
+
+// the point at some distance along the ray
+static inline struct vec3 ray_point(const struct ray *ray, double dist)
+{
+    struct vec3 offset = vec3_mul(&ray->direction, dist);
+    return vec3_add(&ray->source, &offset);
+}
+
+// whether a distance falls in the interval of the ray
+static inline bool ray_in_range(const struct ray *ray, double dist)
+{
+    return dist >= ray->tmin && dist < ray->tmax;
+}
+
+// the maximum number of rays of a ray batch
+#define RAY_BATCH_SIZE 256
+
+/*
+** Rays laid out as arrays, so that they can be generated and traced in
+** batches, such as the primary rays of an image tile. All the rays of a
+** batch share the same interval.
+*/
+struct ray_batch
+{
+    size_t count;
+    double tmin;
+    double tmax;
+    double source_x[RAY_BATCH_SIZE];
+    double source_y[RAY_BATCH_SIZE];
+    double source_z[RAY_BATCH_SIZE];
+    double direction_x[RAY_BATCH_SIZE];
+    double direction_y[RAY_BATCH_SIZE];
+    double direction_z[RAY_BATCH_SIZE];
+};
+
+static inline void ray_batch_get(struct ray *ray,
+                                 const struct ray_batch *batch, size_t i)
+{
+    ray->source = (struct vec3){batch->source_x[i], batch->source_y[i],
+                                batch->source_z[i]};
+    ray->direction = (struct vec3){batch->direction_x[i],
+                                   batch->direction_y[i],
+                                   batch->direction_z[i]};
+    ray->tmin = batch->tmin;
+    ray->tmax = batch->tmax;
+}
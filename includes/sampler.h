@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct sampler;
+
+/*
+** Computes the position of sample number i of pixel (x, y), inside the
+** pixel: both coordinates are in [0, 1). Samples only depend on these
+** indices, so that renders don't depend on the order pixels are rendered in.
+*/
+typedef void (*sampler_sample_f)(double res[2], const struct sampler *sampler,
+                                 uint32_t x, uint32_t y, uint32_t i);
+
+/*
+** The available sample sequences:
+** - stratified samples are correlated multi-jittered (Kensler, 2013): they
+**   are stratified along both axes and on a grid, for any sample count.
+** - sobol samples are the first two dimensions of the Sobol sequence, with
+**   a shuffled and Owen scrambled sequence per pixel (Burley, 2020).
+** - blue noise samples are the same Sobol points for all pixels, shifted by
+**   a blue noise mask, so that the error left in each pixel is spread
+**   evenly across the image rather than in clumps.
+*/
+enum sampler_type
+{
+    SAMPLER_STRATIFIED,
+    SAMPLER_SOBOL,
+    SAMPLER_BLUE_NOISE,
+};
+
+/*
+** A sampler picks where the sample rays of pixels go.
+*/
+struct sampler
+{
+    sampler_sample_f sample;
+    // the number of samples per pixel
+    uint32_t count;
+    // the blue noise mask, a permutation of the ranks of its pixels
+    uint16_t *mask;
+};
+
+void sampler_init(struct sampler *sampler, enum sampler_type type,
+                  uint32_t count);
+void sampler_destroy(struct sampler *sampler);
+
+static inline void sampler_sample(double res[2], const struct sampler *sampler,
+                                  uint32_t x, uint32_t y, uint32_t i)
+{
+    sampler->sample(res, sampler, x, y, i);
+}
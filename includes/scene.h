@@ -1,7 +1,11 @@
 #pragma once
 
+#include "bvh.h"
 #include "camera.h"
+#include "grid.h"
 #include "object.h"
+#include "sphere.h"
+#include "triangle.h"
 
 #include "utils/pvect.h"
 
@@ -22,6 +26,31 @@ struct scene
     // the list of objects in the scene
     struct object_vect objects;
 
+    // the top level acceleration structure, over all objects: a grid when
+    // objects suit one, or a bvh
+    bool use_grid;
+    struct grid grid;
+    struct bvh bvh;
+    // the bounds of all objects, updated along with the acceleration
+    // structure
+    struct aabb bounds;
+    // when all objects are spheres, they are tested in batches from a copy
+    // laid out in the order of the acceleration structure references
+    bool only_spheres;
+    struct sphere_batch spheres;
+    // how loaders should build the acceleration structure of meshes
+    struct bvh_params mesh_bvh_params;
+    // whether loaders should cache the acceleration structure of meshes
+    bool mesh_bvh_cache;
+    // where to store cache files, or NULL to store them next to the scene
+    const char *mesh_bvh_cache_dir;
+    // which side of faces of loaded meshes rays can't hit
+    enum cull_mode mesh_cull;
+    // whether loaders should weld, clean up and reorder the geometry of meshes
+    bool mesh_optimize;
+    // how many materials were given an identifier
+    uint32_t material_count;
+
     // a very hacky single light
     // TODO: handle multiple lights
     struct vec3 light_color;
@@ -34,6 +63,56 @@ struct scene
 static inline void scene_init(struct scene *scene)
 {
     object_vect_init(&scene->objects, 42);
+    scene->use_grid = false;
+    grid_init(&scene->grid);
+    bvh_init(&scene->bvh);
+    aabb_init(&scene->bounds);
+    scene->only_spheres = false;
+    sphere_batch_init(&scene->spheres);
+    scene->mesh_bvh_params = (struct bvh_params)BVH_PARAMS_DEFAULT;
+    scene->mesh_bvh_cache = false;
+    scene->mesh_bvh_cache_dir = NULL;
+    scene->mesh_cull = CULL_BACK;
+    scene->mesh_optimize = false;
+    scene->material_count = 0;
 }
 
+/*
+** Gives a material the next scene-wide identifier, which identifier passes
+** output. Each material must only be added once, however many objects use it.
+*/
+static inline void scene_add_material(struct scene *scene,
+                                      struct material *mat)
+{
+    mat->id = scene->material_count++;
+}
+
+/*
+** Builds the acceleration structure over the objects of the scene.
+** It must be called once all objects are added, before rendering.
+** Many objects of similar size spread over the scene, such as particles,
+** get a uniform grid instead of a bvh.
+*/
+void scene_build_accel(struct scene *scene);
+
+/*
+** Updates the top level acceleration structure after objects moved,
+** or after the meshes they reference were refitted.
+*/
+void scene_refit(struct scene *scene);
+
+/*
+** Finds the closest hit along the ray, and returns its distance, or
+** INFINITY. The intersection itself isn't computed.
+*/
+double scene_closest_hit(struct object_hit *hit, struct scene *scene,
+                         const struct ray *ray);
+
+/*
+** Finds the closest object intersecting the ray, and returns the distance
+** of the intersection, or INFINITY.
+*/
+double scene_intersect_ray(struct object_intersection *closest_intersection,
+                           struct scene *scene, const struct ray *ray);
+
 void scene_destroy(struct scene *scene);
@@ -4,6 +4,7 @@
 #include "utils/alloc.h"
 #include "vec3.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 
 struct sphere
@@ -15,19 +16,79 @@ struct sphere
     struct material *material;
 };
 
-double object_sphere_ray_intersect(struct object_intersection *inter,
+double object_sphere_ray_intersect(struct object_hit *hit,
                                    const struct object *obj,
                                    const struct ray *ray);
 
+void sphere_finalize_hit(struct object_intersection *inter,
+                         const struct object_hit *hit, const struct ray *ray,
+                         double dist);
+
+void sphere_bounds(struct aabb *box, const struct object *obj);
+
 void sphere_free(struct object *obj);
 
 static inline struct sphere *sphere_create(struct vec3 center, double radius,
                                            struct material *mat)
 {
     struct sphere *sphere = zalloc(sizeof(*sphere));
-    object_init(&sphere->base, object_sphere_ray_intersect, sphere_free);
+    object_init(&sphere->base, object_sphere_ray_intersect,
+                sphere_finalize_hit, sphere_bounds, sphere_free);
     sphere->center = center;
     sphere->radius = radius;
     sphere->material = material_get(mat);
     return sphere;
 }
+
+static inline bool object_is_sphere(const struct object *obj)
+{
+    return obj->intersect == object_sphere_ray_intersect;
+}
+
+// the number of spheres tested at once by sphere_batch_intersect
+#define SPHERE_BATCH_WIDTH 4
+
+/*
+** Sphere data laid out as arrays, so that intersection tests can be batched
+** over multiple spheres. Acceleration structures fill it in the order of
+** their primitive references, so that leaves and cells map to ranges.
+*/
+struct sphere_batch
+{
+    size_t count;
+    double *x;
+    double *y;
+    double *z;
+    double *radius2;
+};
+
+static inline void sphere_batch_init(struct sphere_batch *batch)
+{
+    batch->count = 0;
+    batch->x = NULL;
+    batch->y = NULL;
+    batch->z = NULL;
+    batch->radius2 = NULL;
+}
+
+void sphere_batch_resize(struct sphere_batch *batch, size_t count);
+
+static inline void sphere_batch_set(struct sphere_batch *batch, size_t i,
+                                    const struct sphere *sphere)
+{
+    batch->x[i] = sphere->center.x;
+    batch->y[i] = sphere->center.y;
+    batch->z[i] = sphere->center.z;
+    batch->radius2[i] = sphere->radius * sphere->radius;
+}
+
+void sphere_batch_destroy(struct sphere_batch *batch);
+
+/*
+** Finds the closest sphere of the range [begin, begin + count) the ray hits
+** within its interval. Returns the index of the sphere and stores its
+** distance in dist, or returns SIZE_MAX. The ray direction must be normalized.
+*/
+size_t sphere_batch_intersect(double *dist, const struct sphere_batch *batch,
+                              size_t begin, size_t count,
+                              const struct ray *ray);
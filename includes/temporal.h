@@ -0,0 +1,104 @@
+#pragma once
+
+#include "camera.h"
+#include "hdr_image.h"
+#include "ray.h"
+#include "vec3.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** What temporal rendering remembers about a pixel: its color, accumulated
+** over some number of samples and frames, and the surface its latest
+** sample hit, which tells whether the pixel can be reused by the next frame.
+*/
+struct temporal_pixel
+{
+    struct hdr_pixel color;
+    uint32_t samples;
+    // zero if nothing was hit
+    uint32_t object_id;
+    // the distance from the image plane to the hit, along the sample ray
+    float dist;
+    float normal[3];
+};
+
+struct temporal_frame
+{
+    struct camera_basis camera;
+    struct temporal_pixel *pixels;
+};
+
+/*
+** The history of a sequence: the previous frame, which gets reprojected
+** into the one being rendered.
+*/
+struct temporal
+{
+    size_t width;
+    size_t height;
+    struct temporal_frame frames[2];
+    // the index of the frame being rendered
+    size_t current;
+};
+
+void temporal_init(struct temporal *temporal, size_t width, size_t height);
+void temporal_destroy(struct temporal *temporal);
+
+/*
+** Starts rendering a new frame: the current frame becomes the previous one,
+** and the pixels of the new frame start empty.
+*/
+void temporal_begin_frame(struct temporal *temporal,
+                          const struct camera_basis *camera);
+
+static inline struct temporal_pixel *temporal_pixel(struct temporal *temporal,
+                                                    size_t x, size_t y)
+{
+    struct temporal_frame *frame = &temporal->frames[temporal->current];
+    return &frame->pixels[y * temporal->width + x];
+}
+
+/*
+** Records the surface hit by the latest sample of a pixel of the current
+** frame. object_id is zero if nothing was hit.
+*/
+void temporal_pixel_set_hit(struct temporal_pixel *pixel, uint32_t object_id,
+                            double dist, const struct vec3 *normal);
+
+/*
+** Finds the history of a point seen by the current frame, by interpolating
+** the pixels of the previous frame around where it saw the point. Pixels
+** which saw another surface are left out. Returns false if the point
+** wasn't visible, such as when it just got disoccluded.
+*/
+bool temporal_reproject(struct temporal_pixel *res,
+                        const struct temporal *temporal,
+                        const struct vec3 *point, uint32_t object_id,
+                        const struct vec3 *normal);
+
+/*
+** Same as temporal_reproject, for a sample ray which missed everything.
+*/
+bool temporal_reproject_background(struct temporal_pixel *res,
+                                   const struct temporal *temporal,
+                                   const struct ray *ray);
+
+/*
+** Clamps the color of a history between two colors, such as the range of
+** the colors around the pixel in the current frame. This way, stale colors
+** don't linger when shading changes.
+*/
+void temporal_clamp(struct temporal_pixel *history, const struct vec3 *min,
+                    const struct vec3 *max);
+
+/*
+** Blends a new sample into the accumulated color of a pixel, and stores
+** the result in pixel. Old samples fade out, so that the history follows
+** view dependent shading.
+*/
+void temporal_accumulate(struct temporal_pixel *pixel,
+                         const struct temporal_pixel *history,
+                         const struct vec3 *sample);
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "aabb.h"
+#include "vec3.h"
+
+/*
+** An affine transformation: a 3x3 linear part, followed by a translation
+** stored in the last column.
+*/
+struct transform
+{
+    double m[3][4];
+};
+
+static inline void transform_identity(struct transform *xf)
+{
+    *xf = (struct transform){{
+        {1, 0, 0, 0},
+        {0, 1, 0, 0},
+        {0, 0, 1, 0},
+    }};
+}
+
+static inline struct vec3 transform_vector(const struct transform *xf,
+                                           const struct vec3 *v)
+{
+    return (struct vec3){
+        xf->m[0][0] * v->x + xf->m[0][1] * v->y + xf->m[0][2] * v->z,
+        xf->m[1][0] * v->x + xf->m[1][1] * v->y + xf->m[1][2] * v->z,
+        xf->m[2][0] * v->x + xf->m[2][1] * v->y + xf->m[2][2] * v->z,
+    };
+}
+
+static inline struct vec3 transform_point(const struct transform *xf,
+                                          const struct vec3 *p)
+{
+    struct vec3 res = transform_vector(xf, p);
+    res.x += xf->m[0][3];
+    res.y += xf->m[1][3];
+    res.z += xf->m[2][3];
+    return res;
+}
+
+/*
+** Transforms a normal, given the inverse of the transformation applied to
+** points. Normals are transformed by the inverse transpose.
+*/
+static inline struct vec3 transform_normal(const struct transform *inv,
+                                           const struct vec3 *n)
+{
+    return (struct vec3){
+        inv->m[0][0] * n->x + inv->m[1][0] * n->y + inv->m[2][0] * n->z,
+        inv->m[0][1] * n->x + inv->m[1][1] * n->y + inv->m[2][1] * n->z,
+        inv->m[0][2] * n->x + inv->m[1][2] * n->y + inv->m[2][2] * n->z,
+    };
+}
+
+// computes the composition a * b, which applies b first
+void transform_compose(struct transform *res, const struct transform *a,
+                       const struct transform *b);
+
+// returns -1 if the transformation can't be inverted
+int transform_inverse(struct transform *res, const struct transform *xf);
+
+// computes the bounding box of a transformed box
+void transform_aabb(struct aabb *res, const struct transform *xf,
+                    const struct aabb *box);
@@ -4,8 +4,21 @@
 #include "utils/alloc.h"
 #include "vec3.h"
 
+#include <math.h>
+#include <stdbool.h>
 #include <stddef.h>
 
+/*
+** Which side of triangles rays can't hit.
+** The front side is the one where points appear counter clockwise.
+*/
+enum cull_mode
+{
+    CULL_NONE,
+    CULL_BACK,
+    CULL_FRONT,
+};
+
 /*
 ** The facing side of the triangle is the one where the points appear
 ** in counter clockwise order.
@@ -17,17 +30,167 @@ struct triangle
     struct material *material;
 };
 
-double object_triangle_ray_intersect(struct object_intersection *inter,
+/*
+** A ray, set up for watertight triangle intersection tests (Woop et al.,
+** 2013). Coordinates are permuted so that the largest component of the
+** direction is along z, and the direction is then sheared into the z axis.
+** It only depends on the ray, and is shared by all the triangles it is
+** tested against.
+*/
+struct triangle_ray
+{
+    int kx;
+    int ky;
+    int kz;
+    double shear_x;
+    double shear_y;
+    double shear_z;
+};
+
+static inline void triangle_ray_init(struct triangle_ray *tray,
+                                     const struct ray *ray)
+{
+    const double dir[3] = {ray->direction.x, ray->direction.y,
+                           ray->direction.z};
+    int kz = 0;
+    if (fabs(dir[1]) > fabs(dir[kz]))
+        kz = 1;
+    if (fabs(dir[2]) > fabs(dir[kz]))
+        kz = 2;
+
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    // keep the winding order of triangles the same
+    if (dir[kz] < 0)
+    {
+        int tmp = kx;
+        kx = ky;
+        ky = tmp;
+    }
+
+    tray->kx = kx;
+    tray->ky = ky;
+    tray->kz = kz;
+    tray->shear_x = dir[kx] / dir[kz];
+    tray->shear_y = dir[ky] / dir[kz];
+    tray->shear_z = 1. / dir[kz];
+}
+
+/*
+** Intersects a ray with the triangle formed by three points, filling the
+** barycentric coordinates and side of the hit, and returning its distance,
+** or INFINITY. It's shared by standalone triangles and meshes.
+**
+** Edges are tested in the space of the ray, where it goes through the
+** origin: rays hitting an edge shared by two triangles hit at least one of
+** them, and rays can't go through vertices.
+** cull is meant to be a constant, so that each cull mode gets its own
+** specialized code.
+*/
+static inline double triangle_ray_intersect(struct object_hit *hit,
+                                            const struct vec3 *v0,
+                                            const struct vec3 *v1,
+                                            const struct vec3 *v2,
+                                            const struct ray *ray,
+                                            const struct triangle_ray *tray,
+                                            enum cull_mode cull)
+{
+    /*        0
+    **        o
+    **       / \
+    **   a  /   \  c
+    **     /     \
+    **    /       \
+    ** 1 o---------o 2
+    **        b
+    **
+    ** The facing side is the one where points appear counter-clockwise.
+    ** It's a somewhat arbitrary choice. I picked this way because of OpenGL.
+    */
+
+    // move the vertices in the space of the ray
+    struct vec3 a = vec3_sub(v0, &ray->source);
+    struct vec3 b = vec3_sub(v1, &ray->source);
+    struct vec3 c = vec3_sub(v2, &ray->source);
+    const int kx = tray->kx;
+    const int ky = tray->ky;
+    const int kz = tray->kz;
+
+    double a_z = vec3_axis(&a, kz);
+    double b_z = vec3_axis(&b, kz);
+    double c_z = vec3_axis(&c, kz);
+    double a_x = vec3_axis(&a, kx) - tray->shear_x * a_z;
+    double a_y = vec3_axis(&a, ky) - tray->shear_y * a_z;
+    double b_x = vec3_axis(&b, kx) - tray->shear_x * b_z;
+    double b_y = vec3_axis(&b, ky) - tray->shear_y * b_z;
+    double c_x = vec3_axis(&c, kx) - tray->shear_x * c_z;
+    double c_y = vec3_axis(&c, ky) - tray->shear_y * c_z;
+
+    // scaled barycentric coordinates, which are positive for front side
+    // hits, and negative for back side hits
+    double u = c_x * b_y - c_y * b_x;
+    double v = a_x * c_y - a_y * c_x;
+    double w = b_x * a_y - b_y * a_x;
+
+    bool front = u >= 0 && v >= 0 && w >= 0;
+    bool back = u <= 0 && v <= 0 && w <= 0;
+    if (cull == CULL_BACK && !front)
+        return INFINITY;
+    if (cull == CULL_FRONT && !back)
+        return INFINITY;
+    if (cull == CULL_NONE && !front && !back)
+        return INFINITY;
+
+    double det = u + v + w;
+    if (det == 0)
+        return INFINITY;
+
+    // the distance, scaled by det
+    double scaled_t = tray->shear_z * (u * a_z + v * b_z + w * c_z);
+    double t = scaled_t / det;
+    if (!ray_in_range(ray, t))
+        return INFINITY;
+
+    hit->back = det < 0;
+    hit->u = v / det;
+    hit->v = w / det;
+    return t;
+}
+
+/*
+** The normal of the triangle formed by three points, on the side which was
+** hit, so that it faces the ray.
+*/
+static inline struct vec3 triangle_normal(const struct vec3 *v0,
+                                          const struct vec3 *v1,
+                                          const struct vec3 *v2, bool back)
+{
+    struct vec3 edge_a = vec3_sub(v1, v0);
+    struct vec3 edge_b = vec3_sub(v2, v1);
+    struct vec3 n = back ? vec3_cross(&edge_b, &edge_a)
+                         : vec3_cross(&edge_a, &edge_b);
+    vec3_normalize(&n);
+    return n;
+}
+
+double object_triangle_ray_intersect(struct object_hit *hit,
                                      const struct object *obj,
                                      const struct ray *ray);
 
+void triangle_finalize_hit(struct object_intersection *inter,
+                           const struct object_hit *hit,
+                           const struct ray *ray, double dist);
+
+void triangle_bounds(struct aabb *box, const struct object *obj);
+
 void triangle_free(struct object *obj);
 
 static inline struct triangle *triangle_create(struct vec3 points[3],
                                                struct material *mat)
 {
     struct triangle *trian = zalloc(sizeof(*trian));
-    object_init(&trian->base, object_triangle_ray_intersect, triangle_free);
+    object_init(&trian->base, object_triangle_ray_intersect,
+                triangle_finalize_hit, triangle_bounds, triangle_free);
     trian->points[0] = points[0];
     trian->points[1] = points[1];
     trian->points[2] = points[2];
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_FNV1A_INIT 0xcbf29ce484222325ull
+
+/*
+** Feeds some bytes to a 64 bit FNV-1a hash.
+** The initial hash value should be HASH_FNV1A_INIT.
+*/
+static inline uint64_t hash_fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
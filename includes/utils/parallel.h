@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+** Processes the range [begin, end) of some work.
+*/
+typedef void (*parallel_range_f)(void *ctx, size_t begin, size_t end);
+
+// the number of worker threads, which depends on the available processors
+size_t parallel_thread_count(void);
+
+/*
+** Splits [0, count) into contiguous ranges of at least grain items,
+** and processes them using as many threads as useful.
+** Returns once all the work is done.
+*/
+void parallel_for(size_t count, size_t grain, parallel_range_f fn, void *ctx);
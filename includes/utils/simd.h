@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+** Portable SIMD vectors, using the GCC vector extension.
+** The compiler maps them to whatever vector instructions the target has,
+** or splits them into scalar operations.
+*/
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+// picks lanes of a where mask is set, and lanes of b elsewhere
+static inline v4f v4f_select(v4i mask, v4f a, v4f b)
+{
+    return (v4f)((mask & (v4i)a) | (~mask & (v4i)b));
+}
+
+static inline v4f v4f_min(v4f a, v4f b)
+{
+    return v4f_select(a < b, a, b);
+}
+
+static inline v4f v4f_max(v4f a, v4f b)
+{
+    return v4f_select(a > b, a, b);
+}
+
+/*
+** Wider double precision vectors. Without AVX, passing them around changes
+** the calling convention, so they only live inside functions, and their
+** helpers are macros.
+*/
+typedef double v4d __attribute__((vector_size(32)));
+
+#define V4D_BROADCAST(X)                                                       \
+    {                                                                          \
+        (X), (X), (X), (X)                                                     \
+    }
@@ -53,6 +53,12 @@ static inline struct vec3 vec3_mul_vec(const struct vec3 *a,
     };
 }
 
+// returns the x, y or z component, for axis 0, 1 or 2
+static inline double vec3_axis(const struct vec3 *v, int axis)
+{
+    return axis == 0 ? v->x : (axis == 1 ? v->y : v->z);
+}
+
 static inline double vec3_length(const struct vec3 *v)
 {
     return sqrt(v->x * v->x + v->y * v->y + v->z * v->z);
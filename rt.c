@@ -2,36 +2,67 @@
 #include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bmp.h"
 #include "camera.h"
 #include "color.h"
+#include "denoise.h"
+#include "exr.h"
+#include "glb_loader.h"
+#include "hdr_image.h"
 #include "image.h"
+#include "instance.h"
 #include "normal_material.h"
 #include "obj_loader.h"
+#include "pfm.h"
+#include "ply_loader.h"
 #include "phong_material.h"
+#include "sampler.h"
 #include "scene.h"
 #include "sphere.h"
+#include "temporal.h"
 #include "triangle.h"
+#include "utils/static_assert.h"
 #include "vec3.h"
 
 #define NUM_SAMPLES 4
 #define MAX_DEPTH 10
 
+// with adaptive antialiasing, neighbor pixels whose normals are further
+// apart than this cosine get supersampled
+#define AA_NORMAL_THRESHOLD 0.99
+
+// with adaptive antialiasing, neighbor pixels whose depths differ by more
+// than this fraction of the closest one get supersampled, which catches
+// silhouettes over surfaces of the same object, material and orientation
+#define AA_DEPTH_THRESHOLD 0.1
+
+// the number of crests across meshes deformed by --wave
+#define WAVE_CRESTS 2
+
+// pixels are rendered in square tiles, whose primary rays are cast at once
+#define TILE_SIZE 8
+STATIC_ASSERT(tile_size, (TILE_SIZE + 2) * (TILE_SIZE + 2) <= RAY_BATCH_SIZE);
+STATIC_ASSERT(num_samples, NUM_SAMPLES <= RAY_BATCH_SIZE);
+
 static void build_test_scene(struct scene *scene, double aspect_ratio)
 {
     // create a sample red material
     struct phong_material *red_material = zalloc(sizeof(*red_material));
     phong_material_init(red_material);
+    scene_add_material(scene, &red_material->base);
     red_material->surface_color = light_from_rgb_color(191, 32, 32);
     red_material->diffuse_Kn = 0.2;
     red_material->spec_n = 10;
     red_material->spec_Ks = 0.2;
     red_material->ambient_intensity = 0.1;
+    red_material->base.reflectance = (struct vec3){0.2, 0.2, 0.2};
 
     // create a single sphere with the above material, and add it to the scene
     struct sphere *sample_sphere1
@@ -112,86 +143,139 @@ static void build_obj_scene(struct scene *scene, double aspect_ratio)
     vec3_normalize(&scene->camera.up);
 }
 
-static double random_double(double min, double max)
+/*
+** The passes a render can output. They are all computed from the same
+** primary hits, so that a single render produces all the passes needed
+** for compositing. Identifier passes store the index of what was hit plus
+** one in all channels, zero being the background, and are meant to be
+** written to float formats.
+*/
+enum aov
 {
-    // random double in [0, 1)
-    // return rand() / (RAND_MAX + 1.0);
+    AOV_BEAUTY,
+    AOV_NORMAL,
+    AOV_DEPTH,
+    AOV_OBJECT_ID,
+    AOV_MATERIAL_ID,
+    AOV_COUNT,
+};
+
+static const char *const aov_names[AOV_COUNT] = {
+    [AOV_BEAUTY] = "beauty",
+    [AOV_NORMAL] = "normal",
+    [AOV_DEPTH] = "depth",
+    [AOV_OBJECT_ID] = "object",
+    [AOV_MATERIAL_ID] = "material",
+};
 
-    // random double in [min, max)
-    return min + (max - min) * rand() / (RAND_MAX + 1.0);
+static bool aov_is_id(enum aov aov)
+{
+    return aov == AOV_OBJECT_ID || aov == AOV_MATERIAL_ID;
 }
 
-/**
-** Cast certain number of sample rays for antialiasing
+/*
+** Uniform antialiasing traces a ray through each sample of each pixel.
+** Adaptive antialiasing first traces a single ray through the center of
+** each pixel, and only supersamples pixels whose neighbors hit a different
+** object, material, or a differently oriented surface.
 */
-static struct ray *image_cast_ray(const struct rgb_image *image,
-                                  const struct scene *scene, size_t x, size_t y)
+enum aa_mode
 {
-    struct ray *ray = xcalloc(NUM_SAMPLES, sizeof(struct ray));
+    AA_UNIFORM,
+    AA_ADAPTIVE,
+};
 
-    double cam_x;
-    double cam_y;
-    double u;
-    double v;
+/*
+** The frame buffers of the passes being rendered, and where to write them.
+** Passes which weren't requested have no frame buffer.
+*/
+struct frame
+{
+    size_t width;
+    size_t height;
+    struct camera_basis camera;
+    enum aa_mode aa;
+    struct sampler sampler;
+    // the index of the frame in its sequence
+    size_t index;
+    // the history of the sequence, for temporal rendering
+    struct temporal *temporal;
+
+    // threads pick tiles one at a time, in order
+    size_t tile_count;
+    size_t next_tile;
+    size_t tiles_done;
+    bool progress;
+    struct hdr_image *aovs[AOV_COUNT];
+    const char *paths[AOV_COUNT];
+};
 
-    double rank = sqrt(NUM_SAMPLES);
+/*
+** The pixels of a tile, for all passes. Each thread renders into its own
+** tile buffer, which gets copied to the frame buffers once the tile is
+** done, so that threads don't write to the same cache lines.
+*/
+struct tile_buffer
+{
+    size_t x_s;
+    size_t y_s;
+    size_t x_e;
+    size_t y_e;
+    struct hdr_pixel pixels[AOV_COUNT][TILE_SIZE * TILE_SIZE]
+        __attribute__((aligned(64)));
+};
 
-    for (size_t i = 0; i < NUM_SAMPLES; i++)
+static struct hdr_pixel *tile_pixel(struct tile_buffer *tile, size_t aov,
+                                    size_t x, size_t y)
+{
+    size_t width = tile->x_e - tile->x_s;
+    return &tile->pixels[aov][(y - tile->y_s) * width + (x - tile->x_s)];
+}
+
+/*
+** Picks the position on the image plane of the sample rays of a pixel,
+** for antialiasing.
+*/
+static void pixel_samples(double *cam_x, double *cam_y,
+                          const struct frame *frame, size_t x, size_t y)
+{
+    for (uint32_t i = 0; i < frame->sampler.count; i++)
     {
-        /*
-        ** +---+---+
-        ** | * | * |
-        ** +---+---+
-        ** | * | * |
-        ** +---+---+
-        ** ex. 4 sample points deployed in the pixel grilled in 4
-        ** same for 16, which is 4 * 4 in the 4 grill
-        */
-        if (i < NUM_SAMPLES / 2)
-            v = y + random_double(0, 0.5);
-        else
-            v = y + random_double(0.5, 1);
-
-        size_t l = i - i % (size_t)rank;
-        if (i >= l && i < l + rank / 2)
-            u = x + random_double(0, 0.5);
-        else
-            u = x + random_double(0.5, 1);
-
-        cam_x = (u / image->width) - 0.5;
-        cam_y = (v / image->height) - 0.5;
-
-        camera_cast_ray(&ray[i], &scene->camera, cam_x, cam_y);
+        double offset[2];
+        sampler_sample(offset, &frame->sampler, x, y, i);
+        cam_x[i] = (x + offset[0]) / frame->width - 0.5;
+        cam_y[i] = (y + offset[1]) / frame->height - 0.5;
     }
-
-    return ray;
 }
 
-static double
-scene_intersect_ray(struct object_intersection *closest_intersection,
-                    struct scene *scene, struct ray *ray)
+static struct vec3 render_shaded(struct scene *scene, struct ray *ray,
+                                 int depth);
+
+/*
+** Shades an intersection found along a ray, tracing reflections off
+** reflective materials until depth is exhausted.
+*/
+static struct vec3 shade_hit(struct scene *scene, struct ray *ray,
+                             const struct object_intersection *inter,
+                             int depth)
 {
-    // we will now try to find the closest object in the scene
-    // intersecting this ray
-    double closest_intersection_dist = INFINITY;
+    struct material *mat = inter->material;
+    struct vec3 ori_color = mat->shade(mat, &inter->location, scene, ray);
 
-    for (size_t i = 0; i < object_vect_size(&scene->objects); i++)
-    {
-        struct object *obj = object_vect_get(&scene->objects, i);
-        struct object_intersection intersection;
-        // if there's no intersection between the ray and this object, skip it
-        double intersection_dist = obj->intersect(&intersection, obj, ray);
-        if (intersection_dist >= closest_intersection_dist)
-            continue;
+    // reflection rays past the last bounce would return black anyway
+    if (depth <= 1 || !material_reflects(mat))
+        return ori_color;
 
-        closest_intersection_dist = intersection_dist;
-        *closest_intersection = intersection;
-    }
+    struct vec3 reflect_dir
+        = vec3_reflect(&(ray->direction), &(inter->location.normal));
+    struct ray reflect_ray;
+    ray_init_from_surface(&reflect_ray, &inter->location.point, &reflect_dir);
 
-    return closest_intersection_dist;
-}
+    struct vec3 reflect_color = render_shaded(scene, &reflect_ray, depth - 1);
+    reflect_color = vec3_mul_vec(&reflect_color, &mat->reflectance);
 
-typedef struct vec3 (*render_mode_f)(struct scene *, struct ray *ray, int depth);
+    return vec3_add(&reflect_color, &ori_color);
+}
 
 static struct vec3 render_shaded(struct scene *scene, struct ray *ray, int depth)
 {
@@ -205,84 +289,495 @@ static struct vec3 render_shaded(struct scene *scene, struct ray *ray, int depth
     if (isinf(closest_intersection_dist))
         return (struct vec3){0, 0, 0};
 
-    struct ray reflect_ray;
-    reflect_ray.direction = vec3_reflect(&(ray->direction), &(closest_intersection.location.normal));
-    reflect_ray.source = closest_intersection.location.point;
-
-    struct material *mat = closest_intersection.material;
+    return shade_hit(scene, ray, &closest_intersection, depth);
+}
 
-    struct vec3 reflect_color = render_shaded(scene, &reflect_ray, depth - 1);
-    reflect_color = vec3_mul(&reflect_color, 0.2);
+/*
+** What adaptive antialiasing compares between neighbor pixels to find
+** edges.
+*/
+struct sample_id
+{
+    bool hit;
+    double dist;
+    uint32_t object_id;
+    uint32_t material_id;
+    struct vec3 normal;
+};
 
-    struct vec3 ori_color = mat->shade(mat, &closest_intersection.location, scene, ray);
+static bool sample_ids_differ(const struct sample_id *a,
+                              const struct sample_id *b)
+{
+    if (a->hit != b->hit)
+        return true;
+    // misses are infinitely far: a hit next to a miss is always an edge
+    if (!a->hit)
+        return false;
+    return a->object_id != b->object_id || a->material_id != b->material_id
+           || vec3_dot(&a->normal, &b->normal) < AA_NORMAL_THRESHOLD
+           || fabs(a->dist - b->dist)
+                  > AA_DEPTH_THRESHOLD * fmin(a->dist, b->dist);
+}
 
-    return vec3_add(&reflect_color, &ori_color);
+/*
+** Finds and finalizes the closest hit of a camera ray, and returns its
+** distance, or INFINITY.
+*/
+static double trace_primary(struct object_hit *hit,
+                            struct object_intersection *inter,
+                            struct sample_id *id, struct scene *scene,
+                            const struct ray *ray)
+{
+    double dist = scene_closest_hit(hit, scene, ray);
+    id->hit = !isinf(dist);
+    id->dist = dist;
+    if (!id->hit)
+        return dist;
+
+    object_finalize_hit(inter, hit, ray, dist);
+    id->object_id = hit->object_id;
+    id->material_id = inter->material->id;
+    id->normal = inter->location.normal;
+    return dist;
 }
 
-/* For all the pixels of the image, try to find the closest object
-** intersecting the camera ray. If an object is found, shade the pixel to
-** find its color.
+/*
+** Traces a camera ray, and computes all the requested passes from its
+** closest hit.
 */
-static struct vec3 render_normals(struct scene *scene, struct ray *ray, int depth)
+static void render_sample(struct vec3 res[AOV_COUNT], struct sample_id *id,
+                          const struct frame *frame, struct scene *scene,
+                          struct ray *ray)
 {
-    depth = depth;
-    struct object_intersection closest_intersection;
-    double closest_intersection_dist
-        = scene_intersect_ray(&closest_intersection, scene, ray);
+    for (size_t i = 0; i < AOV_COUNT; i++)
+        res[i] = (struct vec3){0, 0, 0};
 
+    struct object_hit hit;
+    struct object_intersection inter;
+    double dist = trace_primary(&hit, &inter, id, scene, ray);
     // if the intersection distance is infinite, do not shade the pixel
-    if (isinf(closest_intersection_dist))
-        return (struct vec3){0, 0, 0};
+    if (isinf(dist))
+        return;
+
+    if (frame->aovs[AOV_BEAUTY])
+        res[AOV_BEAUTY] = shade_hit(scene, ray, &inter, MAX_DEPTH);
+
+    if (frame->aovs[AOV_NORMAL])
+        res[AOV_NORMAL]
+            = normal_material.shade(inter.material, &inter.location, scene, ray);
+
+    // distance from 0 to +inf
+    // we want something from 0 to 1
+    double depth_repr = 1 / (dist + 1);
+    res[AOV_DEPTH] = (struct vec3){depth_repr, depth_repr, depth_repr};
 
-    struct material *mat = closest_intersection.material;
-    struct vec3 pix_color = normal_material.shade(
-        mat, &closest_intersection.location, scene, ray);
+    double object_id = hit.object_id + 1.;
+    res[AOV_OBJECT_ID] = (struct vec3){object_id, object_id, object_id};
 
-    return pix_color;
+    double material_id = inter.material->id + 1.;
+    res[AOV_MATERIAL_ID] = (struct vec3){material_id, material_id, material_id};
 }
 
-/* For all the pixels of the image, try to find the closest object
-** intersecting the camera ray. If an object is found, shade the pixel to
-** find its color.
+/*
+** Stores the passes of a pixel, given their sum over some number of
+** samples. Identifiers are stored as they are.
 */
-static struct vec3 render_distances(struct scene *scene, struct ray *ray, int depth)
+static void tile_set_pixel(struct tile_buffer *tile, size_t x, size_t y,
+                           const struct vec3 pix_color[AOV_COUNT],
+                           size_t samples)
 {
-    depth = depth;
-    struct object_intersection closest_intersection;
-    double closest_intersection_dist
-        = scene_intersect_ray(&closest_intersection, scene, ray);
+    double scale = 1.0 / samples;
+    for (size_t aov = 0; aov < AOV_COUNT; aov++)
+    {
+        struct vec3 color = pix_color[aov];
+        if (!aov_is_id(aov))
+            color = vec3_mul(&color, scale);
+        *tile_pixel(tile, aov, x, y)
+            = (struct hdr_pixel){color.x, color.y, color.z};
+    }
+}
 
-    // if the intersection distance is infinite, do not shade the pixel
-    if (isinf(closest_intersection_dist))
-        return (struct vec3){0, 0, 0};
+/*
+** Copies a finished tile to the frame buffers, one row at a time.
+*/
+static void frame_commit_tile(struct frame *frame, struct tile_buffer *tile)
+{
+    size_t row_size = (tile->x_e - tile->x_s) * sizeof(struct hdr_pixel);
+    for (size_t aov = 0; aov < AOV_COUNT; aov++)
+    {
+        struct hdr_image *image = frame->aovs[aov];
+        if (image == NULL)
+            continue;
 
-    assert(closest_intersection_dist > 0);
+        for (size_t y = tile->y_s; y < tile->y_e; y++)
+            memcpy(&image->data[y * image->width + tile->x_s],
+                   tile_pixel(tile, aov, tile->x_s, y), row_size);
+    }
+}
 
-    // distance from 0 to +inf
-    // we want something from 0 to 1
-    double depth_repr = 1 / (closest_intersection_dist + 1);
-    struct vec3 pix_color = {depth_repr, depth_repr, depth_repr};
+// called once a tile is done, whether it was rendered or not
+static void frame_tile_done(struct frame *frame)
+{
+    size_t done = __atomic_add_fetch(&frame->tiles_done, 1, __ATOMIC_RELAXED);
+    if (!frame->progress)
+        return;
+
+    size_t percent = done * 100 / frame->tile_count;
+    if (percent != (done - 1) * 100 / frame->tile_count)
+        fprintf(stderr, "\rrendering: %zu%%", percent);
+}
+
+/*
+** Renders a pixel from its sample rays, which start at index first of
+** the ray batch.
+*/
+static void aa_render(struct frame *frame, struct scene *scene,
+                      struct tile_buffer *tile, const struct ray_batch *rays,
+                      size_t first, size_t x, size_t y)
+{
+    struct vec3 pix_color[AOV_COUNT] = {{0}};
+    struct vec3 sample_pix_color[AOV_COUNT];
+    struct sample_id id;
+    size_t samples = frame->sampler.count;
+    for (size_t i = 0; i < samples; i++)
+    {
+        struct ray ray;
+        ray_batch_get(&ray, rays, first + i);
+        render_sample(sample_pix_color, &id, frame, scene, &ray);
+        for (size_t aov = 0; aov < AOV_COUNT; aov++)
+        {
+            // identifiers can't be averaged: keep those of the first sample
+            if (aov_is_id(aov) && i != 0)
+                continue;
+            pix_color[aov] = vec3_add(&pix_color[aov], &sample_pix_color[aov]);
+        }
+    }
+
+    tile_set_pixel(tile, x, y, pix_color, samples);
+}
+
+/*
+** Supersamples a list of pixels, casting as many of their sample rays at
+** once as a ray batch can hold.
+*/
+static void render_pixels(struct frame *frame, struct scene *scene,
+                          struct tile_buffer *tile, size_t (*pixels)[2],
+                          size_t pixel_count)
+{
+    size_t samples = frame->sampler.count;
+    size_t batch_pixels = RAY_BATCH_SIZE / samples;
+    double cam_x[RAY_BATCH_SIZE];
+    double cam_y[RAY_BATCH_SIZE];
+    struct ray_batch rays;
+    for (size_t s = 0; s < pixel_count; s += batch_pixels)
+    {
+        size_t e = s + batch_pixels;
+        if (e > pixel_count)
+            e = pixel_count;
+
+        for (size_t i = s; i < e; i++)
+            pixel_samples(&cam_x[(i - s) * samples], &cam_y[(i - s) * samples],
+                          frame, pixels[i][0], pixels[i][1]);
+        camera_cast_batch(&rays, &frame->camera, cam_x, cam_y,
+                          (e - s) * samples);
+
+        for (size_t i = s; i < e; i++)
+            aa_render(frame, scene, tile, &rays, (i - s) * samples,
+                      pixels[i][0], pixels[i][1]);
+    }
+}
+
+/*
+** Renders the pixels from (x_s, y_s) to (x_e, y_e), excluded.
+*/
+static void render_tile_uniform(struct frame *frame, struct scene *scene,
+                                struct tile_buffer *tile)
+{
+    size_t x_s = tile->x_s;
+    size_t y_s = tile->y_s;
+    size_t x_e = tile->x_e;
+    size_t y_e = tile->y_e;
+    size_t pixels[TILE_SIZE * TILE_SIZE][2];
+    size_t count = 0;
+    for (size_t y = y_s; y < y_e; y++)
+        for (size_t x = x_s; x < x_e; x++, count++)
+        {
+            pixels[count][0] = x;
+            pixels[count][1] = y;
+        }
+
+    render_pixels(frame, scene, tile, pixels, count);
+}
+
+/*
+** A single sample of each pixel of a tile, and of the pixels around it.
+** The pixels around the tile are only identified, so that pixels on the
+** sides of the tile can be compared with their neighbors.
+*/
+struct tile_samples
+{
+    size_t border_x_s;
+    size_t border_y_s;
+    size_t border_width;
+    struct ray_batch rays;
+    struct sample_id ids[(TILE_SIZE + 2) * (TILE_SIZE + 2)];
+    struct vec3 pix_colors[TILE_SIZE * TILE_SIZE][AOV_COUNT];
+    // whether each pixel of the tile differs from one of its neighbors
+    bool edges[TILE_SIZE * TILE_SIZE];
+};
+
+// the index of the sample of a pixel, which may be around the tile
+static size_t tile_sample_index(const struct tile_samples *samples, size_t x,
+                                size_t y)
+{
+    return (y - samples->border_y_s) * samples->border_width
+           + (x - samples->border_x_s);
+}
+
+/*
+** Traces a ray through each pixel of a tile and around it, either through
+** the center of pixels, or through the sample of the current frame, and
+** finds the pixels of the tile which sit on an edge.
+*/
+static void trace_tile_samples(struct tile_samples *res, struct frame *frame,
+                               struct scene *scene, size_t x_s, size_t y_s,
+                               size_t x_e, size_t y_e, bool jitter)
+{
+    size_t border_x_s = x_s ? x_s - 1 : x_s;
+    size_t border_y_s = y_s ? y_s - 1 : y_s;
+    size_t border_x_e = x_e < frame->width ? x_e + 1 : x_e;
+    size_t border_y_e = y_e < frame->height ? y_e + 1 : y_e;
+    size_t border_width = border_x_e - border_x_s;
+    size_t tile_width = x_e - x_s;
+    res->border_x_s = border_x_s;
+    res->border_y_s = border_y_s;
+    res->border_width = border_width;
+
+    uint32_t sample_i = frame->index % frame->sampler.count;
+    double cam_x[RAY_BATCH_SIZE];
+    double cam_y[RAY_BATCH_SIZE];
+    size_t count = 0;
+    for (size_t y = border_y_s; y < border_y_e; y++)
+        for (size_t x = border_x_s; x < border_x_e; x++, count++)
+        {
+            double offset[2] = {0.5, 0.5};
+            if (jitter)
+                sampler_sample(offset, &frame->sampler, x, y, sample_i);
+            cam_x[count] = (x + offset[0]) / frame->width - 0.5;
+            cam_y[count] = (y + offset[1]) / frame->height - 0.5;
+        }
+
+    camera_cast_batch(&res->rays, &frame->camera, cam_x, cam_y, count);
+
+    size_t ray_i = 0;
+    for (size_t y = border_y_s; y < border_y_e; y++)
+        for (size_t x = border_x_s; x < border_x_e; x++, ray_i++)
+        {
+            struct ray ray;
+            ray_batch_get(&ray, &res->rays, ray_i);
+            if (x >= x_s && x < x_e && y >= y_s && y < y_e)
+            {
+                size_t pix_i = (y - y_s) * tile_width + (x - x_s);
+                render_sample(res->pix_colors[pix_i], &res->ids[ray_i], frame,
+                              scene, &ray);
+                continue;
+            }
+
+            struct object_hit hit;
+            struct object_intersection inter;
+            trace_primary(&hit, &inter, &res->ids[ray_i], scene, &ray);
+        }
+
+    for (size_t y = y_s; y < y_e; y++)
+        for (size_t x = x_s; x < x_e; x++)
+        {
+            size_t pix_i = (y - y_s) * tile_width + (x - x_s);
+            size_t i = tile_sample_index(res, x, y);
+            const struct sample_id *ids = res->ids;
+            const struct sample_id *id = &ids[i];
+            res->edges[pix_i]
+                = (x > border_x_s && sample_ids_differ(id, &ids[i - 1]))
+                  || (x + 1 < border_x_e && sample_ids_differ(id, &ids[i + 1]))
+                  || (y > border_y_s
+                      && sample_ids_differ(id, &ids[i - border_width]))
+                  || (y + 1 < border_y_e
+                      && sample_ids_differ(id, &ids[i + border_width]));
+        }
+}
+
+/*
+** Renders a tile with adaptive antialiasing: pixels which differ from one
+** of their neighbors get supersampled.
+*/
+static void render_tile_adaptive(struct frame *frame, struct scene *scene,
+                                 struct tile_buffer *tile)
+{
+    size_t x_s = tile->x_s;
+    size_t y_s = tile->y_s;
+    size_t x_e = tile->x_e;
+    size_t y_e = tile->y_e;
+    struct tile_samples samples;
+    trace_tile_samples(&samples, frame, scene, x_s, y_s, x_e, y_e, false);
+
+    size_t tile_width = x_e - x_s;
+    size_t edge_pixels[TILE_SIZE * TILE_SIZE][2];
+    size_t edge_count = 0;
+    for (size_t y = y_s; y < y_e; y++)
+        for (size_t x = x_s; x < x_e; x++)
+        {
+            size_t pix_i = (y - y_s) * tile_width + (x - x_s);
+            if (!samples.edges[pix_i])
+            {
+                tile_set_pixel(tile, x, y, samples.pix_colors[pix_i], 1);
+                continue;
+            }
+
+            edge_pixels[edge_count][0] = x;
+            edge_pixels[edge_count][1] = y;
+            edge_count++;
+        }
+
+    render_pixels(frame, scene, tile, edge_pixels, edge_count);
+}
 
-    return pix_color;
+/*
+** Computes the range of the shaded colors of the pixels of a tile around
+** pixel (x, y) of the tile.
+*/
+static void tile_color_range(struct vec3 *min, struct vec3 *max,
+                             const struct tile_samples *samples, size_t x,
+                             size_t y, size_t tile_width, size_t tile_height)
+{
+    *min = samples->pix_colors[y * tile_width + x][AOV_BEAUTY];
+    *max = *min;
+    for (size_t ny = y ? y - 1 : y; ny <= y + 1 && ny < tile_height; ny++)
+        for (size_t nx = x ? x - 1 : x; nx <= x + 1 && nx < tile_width; nx++)
+        {
+            const struct vec3 *color
+                = &samples->pix_colors[ny * tile_width + nx][AOV_BEAUTY];
+            vec3_update_min_components(min, color);
+            vec3_update_max_components(max, color);
+        }
 }
 
-static void aa_render(render_mode_f renderer, struct rgb_image *image,
-                      struct scene *scene, size_t x, size_t y)
+/*
+** Renders a tile of a sequence, reusing the previous frame. Pixels which
+** were visible in the previous frame only get a single new sample, which
+** is blended into their history. The others are supersampled. Pixels on
+** edges mix several surfaces, which can't be reprojected as one: they are
+** supersampled in every frame, and left out of the history.
+*/
+static void render_tile_temporal(struct frame *frame, struct scene *scene,
+                                 struct tile_buffer *tile)
 {
-    struct ray *ray = image_cast_ray(image, scene, x, y);
-    struct vec3 pix_color = {0};
-    struct vec3 sample_pix_color;
-    for (size_t i = 0; i < NUM_SAMPLES; i++)
+    size_t x_s = tile->x_s;
+    size_t y_s = tile->y_s;
+    size_t x_e = tile->x_e;
+    size_t y_e = tile->y_e;
+    // the new sample moves inside the pixel from frame to frame
+    struct tile_samples samples;
+    trace_tile_samples(&samples, frame, scene, x_s, y_s, x_e, y_e, true);
+
+    size_t tile_width = x_e - x_s;
+    size_t rejected[TILE_SIZE * TILE_SIZE][2];
+    size_t rejected_count = 0;
+    for (size_t y = y_s; y < y_e; y++)
+        for (size_t x = x_s; x < x_e; x++)
+        {
+            size_t pix_i = (y - y_s) * tile_width + (x - x_s);
+            size_t i = tile_sample_index(&samples, x, y);
+            const struct sample_id *id = &samples.ids[i];
+            struct ray ray;
+            ray_batch_get(&ray, &samples.rays, i);
+
+            struct temporal_pixel *pixel
+                = temporal_pixel(frame->temporal, x, y);
+            struct temporal_pixel history;
+            bool reused;
+            if (samples.edges[pix_i])
+                reused = false;
+            else if (id->hit)
+            {
+                // object identifiers are shifted, zero being the background
+                uint32_t object_id = id->object_id + 1;
+                temporal_pixel_set_hit(pixel, object_id, id->dist, &id->normal);
+                struct vec3 point = ray_point(&ray, id->dist);
+                reused = temporal_reproject(&history, frame->temporal, &point,
+                                            object_id, &id->normal);
+            }
+            else
+                reused = temporal_reproject_background(&history,
+                                                       frame->temporal, &ray);
+
+            if (!reused)
+            {
+                rejected[rejected_count][0] = x;
+                rejected[rejected_count][1] = y;
+                rejected_count++;
+                continue;
+            }
+
+            // the history can't stray away from the new samples around it
+            struct vec3 min;
+            struct vec3 max;
+            tile_color_range(&min, &max, &samples, x - x_s, y - y_s,
+                             tile_width, y_e - y_s);
+            temporal_clamp(&history, &min, &max);
+
+            struct vec3 *pix_color = samples.pix_colors[pix_i];
+            temporal_accumulate(pixel, &history, &pix_color[AOV_BEAUTY]);
+            pix_color[AOV_BEAUTY]
+                = (struct vec3){pixel->color.r, pixel->color.g, pixel->color.b};
+            tile_set_pixel(tile, x, y, pix_color, 1);
+        }
+
+    // the history of other pixels starts over from their new samples
+    render_pixels(frame, scene, tile, rejected, rejected_count);
+    for (size_t i = 0; i < rejected_count; i++)
     {
-        sample_pix_color = renderer(scene, &ray[i], MAX_DEPTH);
-        pix_color = vec3_add(&pix_color, &sample_pix_color);
+        size_t x = rejected[i][0];
+        size_t y = rejected[i][1];
+        if (samples.edges[(y - y_s) * tile_width + (x - x_s)])
+            continue;
+
+        struct temporal_pixel *pixel = temporal_pixel(frame->temporal, x, y);
+        pixel->color = *tile_pixel(tile, AOV_BEAUTY, x, y);
+        pixel->samples = frame->sampler.count;
     }
-    free(ray);
+}
 
-    double scale = 1.0 / NUM_SAMPLES;
-    pix_color = vec3_mul(&pix_color, scale);
+static void render_tile(struct frame *frame, struct scene *scene, size_t x_s,
+                        size_t y_s, size_t x_e, size_t y_e)
+{
+    struct tile_buffer tile = {.x_s = x_s, .y_s = y_s, .x_e = x_e, .y_e = y_e};
+
+    // tiles whose rays can't reach the scene are left to the background
+    struct camera_frustum frustum;
+    camera_frustum_init(&frustum, &frame->camera,
+                        (double)x_s / frame->width - 0.5,
+                        (double)y_s / frame->height - 0.5,
+                        (double)x_e / frame->width - 0.5,
+                        (double)y_e / frame->height - 0.5);
+    if (!camera_frustum_overlaps(&frustum, &scene->bounds))
+    {
+        // the next frame can reuse the background
+        if (frame->temporal)
+            for (size_t y = y_s; y < y_e; y++)
+                for (size_t x = x_s; x < x_e; x++)
+                    temporal_pixel(frame->temporal, x, y)->samples
+                        = frame->sampler.count;
+        frame_tile_done(frame);
+        return;
+    }
 
-    rgb_image_set(image, x, y, rgb_color_from_light(&pix_color));
+    if (frame->temporal)
+        render_tile_temporal(frame, scene, &tile);
+    else if (frame->aa == AA_ADAPTIVE)
+        render_tile_adaptive(frame, scene, &tile);
+    else
+        render_tile_uniform(frame, scene, &tile);
+    frame_commit_tile(frame, &tile);
+    frame_tile_done(frame);
 }
 
 // Used as argument to thread_start()
@@ -291,44 +786,55 @@ struct thread_info
     size_t thread_num;
     pthread_t thread_id;
 
-    size_t y_s; // Starting line of the image
-    size_t y_e; // Ending line of the image
-
     struct scene *scene;
-    struct rgb_image *image;
-    render_mode_f renderer;
+    struct frame *frame;
 };
 
 /**
 ** The render function of the starting thread,
-** for each thread, it render only the lines specified by arg
+** each thread renders the next tile nobody took yet, until none are left,
+** so that threads all finish at about the same time
 */
 static void *thread_start(void *arg)
 {
     struct thread_info *tinfo = arg;
-    // printf("Thread %zu takes charge with line %zu to %zu\n",
-    // tinfo->thread_num, tinfo->y_s, tinfo->y_e - 1);
-    size_t s = tinfo->y_s;
-    size_t e = tinfo->y_e;
-
     struct scene *scene = tinfo->scene;
-    struct rgb_image *image = tinfo->image;
+    struct frame *frame = tinfo->frame;
 
-    for (size_t y = s; y < e; y++)
-        for (size_t x = 0; x < image->width; x++)
-            // tinfo->renderer(image, scene, x, y);
-            aa_render(tinfo->renderer, image, scene, x, y);
+    size_t tiles_x = (frame->width + TILE_SIZE - 1) / TILE_SIZE;
+    while (true)
+    {
+        size_t tile_i
+            = __atomic_fetch_add(&frame->next_tile, 1, __ATOMIC_RELAXED);
+        if (tile_i >= frame->tile_count)
+            break;
+
+        size_t x = tile_i % tiles_x * TILE_SIZE;
+        size_t y = tile_i / tiles_x * TILE_SIZE;
+        size_t tile_x_e = x + TILE_SIZE;
+        if (tile_x_e > frame->width)
+            tile_x_e = frame->width;
+        size_t tile_y_e = y + TILE_SIZE;
+        if (tile_y_e > frame->height)
+            tile_y_e = frame->height;
+        render_tile(frame, scene, x, y, tile_x_e, tile_y_e);
+    }
 
     return NULL;
 }
 
-static void multithreading(struct rgb_image *image, struct scene *scene,
-                           render_mode_f renderer)
+static void multithreading(struct frame *frame, struct scene *scene)
 {
     // multithreading depending on the number of available processors
     size_t num_threads = sysconf(_SC_NPROCESSORS_ONLN);
     // size_t num_threads = 2;
 
+    size_t tiles_x = (frame->width + TILE_SIZE - 1) / TILE_SIZE;
+    size_t tiles_y = (frame->height + TILE_SIZE - 1) / TILE_SIZE;
+    frame->tile_count = tiles_x * tiles_y;
+    frame->next_tile = 0;
+    frame->tiles_done = 0;
+
     // Allocate memory for the arguments of thread_start
     struct thread_info *tinfo
         = xcalloc(num_threads, sizeof(struct thread_info));
@@ -339,12 +845,8 @@ static void multithreading(struct rgb_image *image, struct scene *scene,
     {
         tinfo[tnum].thread_num = tnum + 1;
 
-        tinfo[tnum].y_s = tnum * image->height / num_threads;
-        tinfo[tnum].y_e = (tnum + 1) * image->height / num_threads;
-
         tinfo[tnum].scene = scene;
-        tinfo[tnum].image = image;
-        tinfo[tnum].renderer = renderer;
+        tinfo[tnum].frame = frame;
 
         res = pthread_create(&tinfo[tnum].thread_id, NULL, &thread_start,
                              &tinfo[tnum]);
@@ -364,58 +866,448 @@ static void multithreading(struct rgb_image *image, struct scene *scene,
         free(retval);
     }
     free(tinfo);
+
+    if (frame->progress)
+        fputc('\n', stderr);
 }
 
-int main(int argc, char *argv[])
+/*
+** Rotates a vector around a unit axis, by some angle in radians.
+*/
+static struct vec3 rotate_vector(const struct vec3 *v, const struct vec3 *axis,
+                                 double angle)
+{
+    double cos_a = cos(angle);
+    double sin_a = sin(angle);
+    struct vec3 cross = vec3_cross(axis, v);
+    struct vec3 res = vec3_mul(v, cos_a);
+    cross = vec3_mul(&cross, sin_a);
+    res = vec3_add(&res, &cross);
+    struct vec3 along = vec3_mul(axis, vec3_dot(axis, v) * (1 - cos_a));
+    return vec3_add(&res, &along);
+}
+
+/*
+** Computes the camera of a turntable frame: the camera orbits around pivot,
+** around its up axis, by angle radians.
+*/
+static void turntable_camera(struct camera *res, const struct camera *camera,
+                             const struct vec3 *pivot, double angle)
+{
+    *res = *camera;
+    struct vec3 to_center = vec3_sub(&camera->center, pivot);
+    to_center = rotate_vector(&to_center, &camera->up, angle);
+    res->center = vec3_add(pivot, &to_center);
+    res->forward = rotate_vector(&camera->forward, &camera->up, angle);
+}
+
+static double elapsed_seconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/*
+** Deforms the meshes of a sequence with a wave traveling along their x axis,
+** which moves vertices along their y axis. The trees of meshes are refitted
+** at each frame, and get rebuilt once they degrade too much.
+*/
+struct wave
+{
+    // the height of the wave, relative to the size of each mesh
+    double amplitude;
+    size_t mesh_count;
+    struct mesh **meshes;
+    // the vertices of each mesh before deformation, and their bounds
+    float **rest_vertices;
+    struct aabb *rest_bounds;
+};
+
+static void wave_init(struct wave *wave, struct scene *scene, double amplitude)
+{
+    size_t object_count = object_vect_size(&scene->objects);
+    wave->amplitude = amplitude;
+    wave->mesh_count = 0;
+    wave->meshes = xcalloc(object_count, sizeof(*wave->meshes));
+    wave->rest_vertices = xcalloc(object_count, sizeof(*wave->rest_vertices));
+    wave->rest_bounds = xcalloc(object_count, sizeof(*wave->rest_bounds));
+
+    for (size_t i = 0; i < object_count; i++)
+    {
+        struct object *obj = object_vect_get(&scene->objects, i);
+        if (!object_is_instance(obj))
+            continue;
+
+        // instances may share meshes, which only get deformed once
+        struct mesh *mesh = ((struct instance *)obj)->mesh;
+        size_t k = 0;
+        while (k < wave->mesh_count && wave->meshes[k] != mesh)
+            k++;
+        if (k < wave->mesh_count)
+            continue;
+
+        // vertices are kept as loaded, which mesh_set_vertices expects
+        size_t loaded_count = mesh_loaded_vertex_count(mesh);
+        float *rest = xalloc(3 * loaded_count * sizeof(*rest));
+        mesh_get_vertices(mesh, rest);
+        struct aabb *bounds = &wave->rest_bounds[wave->mesh_count];
+        aabb_init(bounds);
+        for (size_t v = 0; v < mesh->vertex_count; v++)
+        {
+            struct vec3 vertex = mesh_vertex(mesh, v);
+            aabb_extend_point(bounds, &vertex);
+        }
+
+        wave->meshes[wave->mesh_count] = mesh;
+        wave->rest_vertices[wave->mesh_count] = rest;
+        wave->mesh_count++;
+    }
+}
+
+static void wave_destroy(struct wave *wave)
+{
+    for (size_t i = 0; i < wave->mesh_count; i++)
+        free(wave->rest_vertices[i]);
+    free(wave->meshes);
+    free(wave->rest_vertices);
+    free(wave->rest_bounds);
+}
+
+/*
+** Moves the vertices of meshes to where the wave is at some phase, in
+** [0, 1), and updates acceleration structures.
+*/
+static void wave_apply(struct wave *wave, struct scene *scene, double phase)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t rebuilt = 0;
+    for (size_t i = 0; i < wave->mesh_count; i++)
+    {
+        struct mesh *mesh = wave->meshes[i];
+        const float *rest = wave->rest_vertices[i];
+        const struct aabb *bounds = &wave->rest_bounds[i];
+        struct vec3 extent = vec3_sub(&bounds->max, &bounds->min);
+        double size = fmax(extent.x, fmax(extent.y, extent.z));
+        double height = wave->amplitude * size;
+
+        size_t loaded_count = mesh_loaded_vertex_count(mesh);
+        float *vertices = xalloc(3 * loaded_count * sizeof(*vertices));
+        for (size_t v = 0; v < loaded_count; v++)
+        {
+            const float *src = &rest[3 * v];
+            double t = extent.x > 0 ? (src[0] - bounds->min.x) / extent.x : 0;
+            vertices[3 * v] = src[0];
+            vertices[3 * v + 1]
+                = src[1] + height * sin(2 * M_PI * (WAVE_CRESTS * t - phase));
+            vertices[3 * v + 2] = src[2];
+        }
+        mesh_set_vertices(mesh, vertices);
+        free(vertices);
+
+        if (mesh_refit(mesh))
+            rebuilt++;
+    }
+    scene_refit(scene);
+
+    fprintf(stderr, "wave: refitted %zu meshes, rebuilt %zu: %.3fs\n",
+            wave->mesh_count, rebuilt, elapsed_seconds(&start));
+}
+
+/*
+** Numbers output paths when rendering a sequence, by inserting the index
+** of the frame before the extension: out.bmp becomes out_0001.bmp.
+** Returns a heap allocated string.
+*/
+static char *sequence_path(const char *path, size_t index)
 {
+    const char *ext = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    if (ext == NULL || (slash && ext < slash))
+        ext = path + strlen(path);
+
+    size_t size = strlen(path) + 32;
+    char *res = xalloc(size);
+    snprintf(res, size, "%.*s_%04zu%s", (int)(ext - path), path, index, ext);
+    return res;
+}
+
+/*
+** Writes the frame buffer to disk, picking the file format from the
+** extension of the output path. Float formats get the linear light values,
+** anything else is gamma encoded to a 24 bit bmp.
+*/
+static int write_output(const struct hdr_image *image, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        err(1, "failed to open the output file");
+
     int rc;
+    const char *ext = strrchr(path, '.');
+    if (ext && strcmp(ext, ".pfm") == 0)
+        rc = pfm_write(image, fp);
+    else if (ext && strcmp(ext, ".exr") == 0)
+        rc = exr_write(image, fp);
+    else
+    {
+        struct rgb_image *rgb = rgb_image_alloc(image->width, image->height);
+        hdr_image_quantize(rgb, image);
+        rc = bmp_write(rgb, ppm_from_ppi(80), fp);
+        free(rgb);
+    }
 
-    if (argc < 3)
-        errx(1, "Usage: SCENE.obj OUTPUT.bmp [--normals] [--distances]");
+    if (fclose(fp) != 0)
+        rc = -1;
+    return rc;
+}
 
-    struct scene scene;
-    scene_init(&scene);
+/*
+** Loads the scene file, using the loader picked by its extension.
+*/
+static int load_scene_file(struct scene *scene, const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    if (ext && strcmp(ext, ".ply") == 0)
+        return load_ply(scene, path);
+    if (ext && strcmp(ext, ".glb") == 0)
+        return load_glb(scene, path);
+    return load_obj(scene, path);
+}
 
-    // initialize the frame buffer (the buffer that will store the result of the
-    // rendering)
-    struct rgb_image *image = rgb_image_alloc(1000, 1000);
+/*
+** Parses an option requesting a pass, such as --aov-normal=normal.exr.
+** Returns false if the option isn't one.
+*/
+static bool parse_aov_option(struct frame *frame, const char *arg)
+{
+    const char prefix[] = "--aov-";
+    if (strncmp(arg, prefix, sizeof(prefix) - 1) != 0)
+        return false;
 
-    // set all the pixels of the image to black
-    struct rgb_pixel bg_color = {0};
-    rgb_image_clear(image, &bg_color);
+    const char *name = arg + sizeof(prefix) - 1;
+    const char *path = strchr(name, '=');
+    if (path == NULL)
+        return false;
 
-    double aspect_ratio = (double)image->width / image->height;
+    for (size_t aov = 0; aov < AOV_COUNT; aov++)
+    {
+        size_t name_len = strlen(aov_names[aov]);
+        if ((size_t)(path - name) == name_len
+            && strncmp(name, aov_names[aov], name_len) == 0)
+        {
+            frame->paths[aov] = path + 1;
+            return true;
+        }
+    }
+    errx(1, "unknown pass in %s", arg);
+}
 
-    // build the scene
-    build_obj_scene(&scene, aspect_ratio);
-    if (load_obj(&scene, argv[1]))
-        return 41;
+int main(int argc, char *argv[])
+{
+    int rc = 0;
 
-    // build_test_scene(&scene, aspect_ratio);
+    if (argc < 3)
+        errx(1, "Usage: SCENE.{obj,ply,glb} OUTPUT.{bmp,pfm,exr} [--normals] "
+                "[--distances] [--aov-{beauty,normal,depth,object,material}"
+                "=PATH] [--sbvh] [--bvh-cache[=DIR]] [--optimize-meshes] "
+                "[--bvh-compress={auto,on,off}] [--cull={none,back,front}] "
+                "[--projection={perspective,orthographic}] "
+                "[--aa={uniform,adaptive}] [--samples=N] "
+                "[--sampler={stratified,sobol,blue-noise}] [--denoise] "
+                "[--frames=N] [--wave=AMPLITUDE] [--temporal] [--progress]");
+
+    struct scene scene;
+    scene_init(&scene);
 
     // parse options
-    render_mode_f renderer = render_shaded;
+    // the main output is the shaded image, unless another pass is picked
+    enum aov main_aov = AOV_BEAUTY;
+    struct frame frame = {.width = 1000, .height = 1000};
+    enum camera_projection projection = CAMERA_PERSPECTIVE;
+    enum sampler_type sampler_type = SAMPLER_STRATIFIED;
+    unsigned long samples = NUM_SAMPLES;
+    bool denoise_requested = false;
+    unsigned long frame_count = 1;
+    double wave_amplitude = 0;
+    bool temporal_requested = false;
     for (int i = 3; i < argc; i++)
     {
         if (strcmp(argv[i], "--normals") == 0)
-            renderer = render_normals;
+            main_aov = AOV_NORMAL;
         else if (strcmp(argv[i], "--distances") == 0)
-            renderer = render_distances;
+            main_aov = AOV_DEPTH;
+        else if (parse_aov_option(&frame, argv[i]))
+            continue;
+        else if (strcmp(argv[i], "--sbvh") == 0)
+            scene.mesh_bvh_params.spatial_splits = true;
+        else if (strcmp(argv[i], "--bvh-cache") == 0)
+            scene.mesh_bvh_cache = true;
+        else if (strcmp(argv[i], "--optimize-meshes") == 0)
+            scene.mesh_optimize = true;
+        else if (strncmp(argv[i], "--bvh-cache=", 12) == 0)
+        {
+            scene.mesh_bvh_cache = true;
+            scene.mesh_bvh_cache_dir = argv[i] + 12;
+        }
+        else if (strcmp(argv[i], "--bvh-compress=on") == 0)
+            scene.mesh_bvh_params.compress_threshold = 0;
+        else if (strcmp(argv[i], "--bvh-compress=off") == 0)
+            scene.mesh_bvh_params.compress_threshold = SIZE_MAX;
+        else if (strcmp(argv[i], "--cull=none") == 0)
+            scene.mesh_cull = CULL_NONE;
+        else if (strcmp(argv[i], "--cull=back") == 0)
+            scene.mesh_cull = CULL_BACK;
+        else if (strcmp(argv[i], "--cull=front") == 0)
+            scene.mesh_cull = CULL_FRONT;
+        else if (strcmp(argv[i], "--aa=uniform") == 0)
+            frame.aa = AA_UNIFORM;
+        else if (strcmp(argv[i], "--aa=adaptive") == 0)
+            frame.aa = AA_ADAPTIVE;
+        else if (strcmp(argv[i], "--projection=perspective") == 0)
+            projection = CAMERA_PERSPECTIVE;
+        else if (strcmp(argv[i], "--projection=orthographic") == 0)
+            projection = CAMERA_ORTHOGRAPHIC;
+        else if (strncmp(argv[i], "--samples=", 10) == 0)
+        {
+            char *end;
+            samples = strtoul(argv[i] + 10, &end, 10);
+            if (*end || samples == 0 || samples > RAY_BATCH_SIZE)
+                errx(1, "the sample count must be between 1 and %d",
+                     RAY_BATCH_SIZE);
+        }
+        else if (strcmp(argv[i], "--sampler=stratified") == 0)
+            sampler_type = SAMPLER_STRATIFIED;
+        else if (strcmp(argv[i], "--sampler=sobol") == 0)
+            sampler_type = SAMPLER_SOBOL;
+        else if (strcmp(argv[i], "--sampler=blue-noise") == 0)
+            sampler_type = SAMPLER_BLUE_NOISE;
+        else if (strcmp(argv[i], "--denoise") == 0)
+            denoise_requested = true;
+        else if (strncmp(argv[i], "--frames=", 9) == 0)
+        {
+            char *end;
+            frame_count = strtoul(argv[i] + 9, &end, 10);
+            if (*end || frame_count == 0)
+                errx(1, "the frame count must be a positive integer");
+        }
+        else if (strncmp(argv[i], "--wave=", 7) == 0)
+        {
+            char *end;
+            wave_amplitude = strtod(argv[i] + 7, &end);
+            if (*end || !isfinite(wave_amplitude))
+                errx(1, "the wave amplitude must be a number");
+        }
+        else if (strcmp(argv[i], "--temporal") == 0)
+            temporal_requested = true;
+        else if (strcmp(argv[i], "--progress") == 0)
+            frame.progress = true;
     }
 
-    // render all pixels using multithreading
-    multithreading(image, &scene, renderer);
+    frame.paths[main_aov] = argv[2];
 
-    // write the rendered image to a bmp file
-    FILE *fp = fopen(argv[2], "w");
-    if (fp == NULL)
-        err(1, "failed to open the output file");
+    // denoising is guided by the normal and depth passes, which get rendered
+    // even when they aren't written
+    bool denoise_beauty = denoise_requested && frame.paths[AOV_BEAUTY];
+
+    // initialize the frame buffers (the buffers that will store the result of
+    // the rendering)
+    for (size_t aov = 0; aov < AOV_COUNT; aov++)
+    {
+        bool guide = denoise_beauty && (aov == AOV_NORMAL || aov == AOV_DEPTH);
+        if (frame.paths[aov] == NULL && !guide)
+            continue;
 
-    rc = bmp_write(image, ppm_from_ppi(80), fp);
-    fclose(fp);
+        frame.aovs[aov] = hdr_image_alloc(frame.width, frame.height);
+    }
+
+    // temporal rendering reuses the shaded colors of previous frames
+    struct temporal temporal;
+    if (temporal_requested && frame.aovs[AOV_BEAUTY])
+    {
+        temporal_init(&temporal, frame.width, frame.height);
+        frame.temporal = &temporal;
+    }
+
+    double aspect_ratio = (double)frame.width / frame.height;
+
+    // build the scene
+    build_obj_scene(&scene, aspect_ratio);
+    if (load_scene_file(&scene, argv[1]))
+        return 41;
+
+    // build_test_scene(&scene, aspect_ratio);
+
+    scene_build_accel(&scene);
+    scene.camera.projection = projection;
+    sampler_init(&frame.sampler, sampler_type, samples);
+
+    // meshes may be deformed over the sequence
+    struct wave wave;
+    if (wave_amplitude)
+        wave_init(&wave, &scene, wave_amplitude);
+
+    // sequences are turntables around the center of the scene
+    struct vec3 pivot = aabb_center(&scene.bounds);
+    for (size_t i = 0; i < frame_count; i++)
+    {
+        if (wave_amplitude)
+            wave_apply(&wave, &scene, (double)i / frame_count);
+
+        struct camera camera;
+        turntable_camera(&camera, &scene.camera, &pivot,
+                         2 * M_PI * i / frame_count);
+        camera_basis_init(&frame.camera, &camera);
+        frame.index = i;
+        if (frame.temporal)
+            temporal_begin_frame(frame.temporal, &frame.camera);
+
+        // set all the pixels of the images to black
+        struct vec3 bg_color = {0};
+        for (size_t aov = 0; aov < AOV_COUNT; aov++)
+            if (frame.aovs[aov])
+                hdr_image_clear(frame.aovs[aov], &bg_color);
+
+        // render all pixels using multithreading
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        multithreading(&frame, &scene);
+        if (denoise_beauty)
+        {
+            fprintf(stderr, "render: %.3fs\n", elapsed_seconds(&start));
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            denoise(frame.aovs[AOV_BEAUTY], frame.aovs[AOV_NORMAL],
+                    frame.aovs[AOV_DEPTH], DENOISE_ITERATIONS);
+            fprintf(stderr, "denoise: %.3fs\n", elapsed_seconds(&start));
+        }
+
+        // write the rendered passes to disk
+        for (size_t aov = 0; aov < AOV_COUNT; aov++)
+        {
+            if (frame.aovs[aov] == NULL || frame.paths[aov] == NULL)
+                continue;
+
+            char *path = frame_count > 1 ? sequence_path(frame.paths[aov], i)
+                                         : NULL;
+            if (write_output(frame.aovs[aov], path ? path : frame.paths[aov]))
+            {
+                warnx("failed to write the %s pass", aov_names[aov]);
+                rc = 1;
+            }
+            free(path);
+        }
+    }
 
     // release resources
+    if (wave_amplitude)
+        wave_destroy(&wave);
+    for (size_t aov = 0; aov < AOV_COUNT; aov++)
+        free(frame.aovs[aov]);
+    if (frame.temporal)
+        temporal_destroy(frame.temporal);
+    sampler_destroy(&frame.sampler);
     scene_destroy(&scene);
-    free(image);
     return rc;
 }
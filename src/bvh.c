@@ -0,0 +1,913 @@
+#include "bvh.h"
+#include "utils/alloc.h"
+#include "utils/parallel.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// the minimum number of nodes refitted by a thread
+#define BVH_REFIT_GRAIN 1024
+
+// the number of candidate split planes per axis is BVH_BIN_COUNT - 1
+#define BVH_BIN_COUNT 16
+
+// the cost of traversing a node, relative to intersecting a primitive
+#define BVH_TRAVERSAL_COST 1.
+
+// the number of sibling pairs grouped in a treelet when laying out nodes.
+// a treelet then spans a 4KiB page
+#define BVH_TREELET_PAIRS 64
+
+// spatial splits are only considered when the children of the best object
+// split overlap by more than this fraction of the root area
+#define BVH_SPATIAL_MIN_OVERLAP 1e-5
+
+/*
+** A primitive, as seen by the builder
+*/
+struct build_prim
+{
+    struct aabb box;
+    struct vec3 center;
+    uint32_t id;
+};
+
+struct build_ctx
+{
+    struct bvh *bvh;
+
+    // splits primitives for spatial splits, or NULL
+    bvh_prim_split_f prim_split;
+    const void *prims_ctx;
+    // the number of references spatial splits can still duplicate
+    size_t ref_budget;
+    // spatial splits are only tried when object split children overlap
+    // more than this area
+    double min_overlap;
+};
+
+struct bin
+{
+    struct aabb box;
+    size_t count;
+};
+
+struct spatial_bin
+{
+    struct aabb box;
+    // the number of references starting and ending in this bin
+    size_t enter;
+    size_t exit;
+};
+
+struct split
+{
+    int axis;
+    // object splits: primitives in bins below this index go left
+    size_t bin;
+    // spatial splits: the position of the split plane
+    double pos;
+    double cost;
+    struct aabb left_box;
+    struct aabb right_box;
+};
+
+static float round_down(double x)
+{
+    float res = x;
+    if (res > x)
+        res = nextafterf(res, -INFINITY);
+    return res;
+}
+
+static float round_up(double x)
+{
+    float res = x;
+    if (res < x)
+        res = nextafterf(res, INFINITY);
+    return res;
+}
+
+void bvh_node_set_bounds(struct bvh_node *node, const struct aabb *box)
+{
+    node->min[0] = round_down(box->min.x);
+    node->min[1] = round_down(box->min.y);
+    node->min[2] = round_down(box->min.z);
+    node->max[0] = round_up(box->max.x);
+    node->max[1] = round_up(box->max.y);
+    node->max[2] = round_up(box->max.z);
+}
+
+static size_t bin_index(const struct aabb *centers, int axis,
+                        const struct vec3 *center)
+{
+    double lo = vec3_axis(&centers->min, axis);
+    double extent = vec3_axis(&centers->max, axis) - lo;
+    double rel = (vec3_axis(center, axis) - lo) / extent;
+    size_t res = rel * BVH_BIN_COUNT;
+    return res < BVH_BIN_COUNT ? res : BVH_BIN_COUNT - 1;
+}
+
+static double split_cost(const struct aabb *left, size_t left_count,
+                         const struct aabb *right, size_t right_count,
+                         double parent_area)
+{
+    return BVH_TRAVERSAL_COST
+           + (aabb_half_area(left) * left_count
+              + aabb_half_area(right) * right_count)
+                 / parent_area;
+}
+
+/*
+** Finds the cheapest split plane amongst the bin boundaries of all axis.
+** Returns false if primitives can't be told apart by their centers.
+*/
+static bool find_split(struct split *best, const struct build_prim *refs,
+                       size_t count, const struct aabb *box,
+                       const struct aabb *centers)
+{
+    best->cost = INFINITY;
+    double parent_area = aabb_half_area(box);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (vec3_axis(&centers->max, axis) <= vec3_axis(&centers->min, axis))
+            continue;
+
+        struct bin bins[BVH_BIN_COUNT];
+        for (size_t i = 0; i < BVH_BIN_COUNT; i++)
+        {
+            aabb_init(&bins[i].box);
+            bins[i].count = 0;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const struct build_prim *ref = &refs[i];
+            struct bin *bin = &bins[bin_index(centers, axis, &ref->center)];
+            aabb_extend(&bin->box, &ref->box);
+            bin->count++;
+        }
+
+        // sweep from the right, storing the right side of each plane
+        struct aabb right_box[BVH_BIN_COUNT];
+        size_t right_count[BVH_BIN_COUNT];
+        struct aabb acc_box;
+        aabb_init(&acc_box);
+        size_t acc_count = 0;
+        for (size_t i = BVH_BIN_COUNT - 1; i > 0; i--)
+        {
+            aabb_extend(&acc_box, &bins[i].box);
+            acc_count += bins[i].count;
+            right_box[i] = acc_box;
+            right_count[i] = acc_count;
+        }
+
+        // sweep from the left, evaluating all split planes
+        aabb_init(&acc_box);
+        acc_count = 0;
+        for (size_t i = 1; i < BVH_BIN_COUNT; i++)
+        {
+            aabb_extend(&acc_box, &bins[i - 1].box);
+            acc_count += bins[i - 1].count;
+            double cost = split_cost(&acc_box, acc_count, &right_box[i],
+                                     right_count[i], parent_area);
+            if (cost < best->cost)
+            {
+                best->cost = cost;
+                best->axis = axis;
+                best->bin = i;
+                best->left_box = acc_box;
+                best->right_box = right_box[i];
+            }
+        }
+    }
+
+    return !isinf(best->cost);
+}
+
+static size_t partition(struct build_prim *refs, size_t count,
+                        const struct split *split, const struct aabb *centers)
+{
+    size_t left = 0;
+    size_t right = count;
+    while (left < right)
+    {
+        struct build_prim *ref = &refs[left];
+        if (bin_index(centers, split->axis, &ref->center) < split->bin)
+        {
+            left++;
+            continue;
+        }
+
+        right--;
+        struct build_prim tmp = *ref;
+        *ref = refs[right];
+        refs[right] = tmp;
+    }
+    return left;
+}
+
+static bool aabb_is_empty(const struct aabb *box)
+{
+    return box->min.x > box->max.x || box->min.y > box->max.y
+           || box->min.z > box->max.z;
+}
+
+static void aabb_intersect(struct aabb *box, const struct aabb *o)
+{
+    vec3_update_max_components(&box->min, &o->min);
+    vec3_update_min_components(&box->max, &o->max);
+}
+
+static void vec3_set_axis(struct vec3 *v, int axis, double value)
+{
+    if (axis == 0)
+        v->x = value;
+    else if (axis == 1)
+        v->y = value;
+    else
+        v->z = value;
+}
+
+/*
+** Splits a reference in two at some plane. Each side is clipped to the
+** part of the primitive on this side, and may be empty.
+*/
+static void split_ref(struct aabb *left, struct aabb *right,
+                      const struct build_ctx *ctx, const struct build_prim *ref,
+                      int axis, double pos)
+{
+    ctx->prim_split(left, right, ctx->prims_ctx, ref->id, axis, pos);
+
+    // the reference may have already been clipped by previous splits
+    aabb_intersect(left, &ref->box);
+    aabb_intersect(right, &ref->box);
+    if (vec3_axis(&left->max, axis) > pos)
+        vec3_set_axis(&left->max, axis, pos);
+    if (vec3_axis(&right->min, axis) < pos)
+        vec3_set_axis(&right->min, axis, pos);
+}
+
+/*
+** Finds the cheapest spatial split plane. References straddling a plane
+** are clipped on both sides, instead of being assigned to one side as
+** a whole. This avoids overlapping children for long primitives.
+*/
+static bool find_spatial_split(struct split *best, const struct build_ctx *ctx,
+                               const struct build_prim *refs, size_t count,
+                               const struct aabb *box)
+{
+    best->cost = INFINITY;
+    double parent_area = aabb_half_area(box);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double lo = vec3_axis(&box->min, axis);
+        double bin_size = (vec3_axis(&box->max, axis) - lo) / BVH_BIN_COUNT;
+        if (!(bin_size > 0))
+            continue;
+
+        struct spatial_bin bins[BVH_BIN_COUNT];
+        for (size_t i = 0; i < BVH_BIN_COUNT; i++)
+        {
+            aabb_init(&bins[i].box);
+            bins[i].enter = 0;
+            bins[i].exit = 0;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const struct build_prim *ref = &refs[i];
+            double first_pos = (vec3_axis(&ref->box.min, axis) - lo) / bin_size;
+            double last_pos = (vec3_axis(&ref->box.max, axis) - lo) / bin_size;
+            size_t first = first_pos < 0 ? 0 : first_pos;
+            size_t last = last_pos < 0 ? 0 : last_pos;
+            if (last >= BVH_BIN_COUNT)
+                last = BVH_BIN_COUNT - 1;
+            if (first > last)
+                first = last;
+
+            // clip the reference into all the bins it spans
+            struct build_prim rest = *ref;
+            for (size_t bin = first; bin < last; bin++)
+            {
+                struct aabb left;
+                struct aabb right;
+                split_ref(&left, &right, ctx, &rest, axis,
+                          lo + (bin + 1) * bin_size);
+                if (!aabb_is_empty(&left))
+                    aabb_extend(&bins[bin].box, &left);
+                rest.box = right;
+            }
+            if (!aabb_is_empty(&rest.box))
+                aabb_extend(&bins[last].box, &rest.box);
+
+            bins[first].enter++;
+            bins[last].exit++;
+        }
+
+        struct aabb right_box[BVH_BIN_COUNT];
+        size_t right_count[BVH_BIN_COUNT];
+        struct aabb acc_box;
+        aabb_init(&acc_box);
+        size_t acc_count = 0;
+        for (size_t i = BVH_BIN_COUNT - 1; i > 0; i--)
+        {
+            aabb_extend(&acc_box, &bins[i].box);
+            acc_count += bins[i].exit;
+            right_box[i] = acc_box;
+            right_count[i] = acc_count;
+        }
+
+        aabb_init(&acc_box);
+        acc_count = 0;
+        for (size_t i = 1; i < BVH_BIN_COUNT; i++)
+        {
+            aabb_extend(&acc_box, &bins[i - 1].box);
+            acc_count += bins[i - 1].enter;
+            if (acc_count == 0 || right_count[i] == 0)
+                continue;
+
+            double cost = split_cost(&acc_box, acc_count, &right_box[i],
+                                     right_count[i], parent_area);
+            if (cost < best->cost)
+            {
+                best->cost = cost;
+                best->axis = axis;
+                best->pos = lo + i * bin_size;
+                best->left_box = acc_box;
+                best->right_box = right_box[i];
+            }
+        }
+    }
+
+    return !isinf(best->cost);
+}
+
+static void push_ref(struct build_prim *refs, size_t *count,
+                     const struct build_prim *ref, const struct aabb *box)
+{
+    struct build_prim *res = &refs[(*count)++];
+    res->id = ref->id;
+    res->box = *box;
+    res->center = aabb_center(box);
+}
+
+/*
+** Distributes references on both sides of a spatial split plane,
+** duplicating the ones which straddle it, as long as the budget allows.
+*/
+static void spatial_partition(struct build_ctx *ctx, struct build_prim *left,
+                              size_t *left_count, struct build_prim *right,
+                              size_t *right_count,
+                              const struct build_prim *refs, size_t count,
+                              const struct split *split)
+{
+    *left_count = 0;
+    *right_count = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const struct build_prim *ref = &refs[i];
+        double ref_min = vec3_axis(&ref->box.min, split->axis);
+        double ref_max = vec3_axis(&ref->box.max, split->axis);
+
+        if (ref_max <= split->pos)
+        {
+            push_ref(left, left_count, ref, &ref->box);
+            continue;
+        }
+
+        if (ref_min >= split->pos)
+        {
+            push_ref(right, right_count, ref, &ref->box);
+            continue;
+        }
+
+        struct aabb left_box;
+        struct aabb right_box;
+        split_ref(&left_box, &right_box, ctx, ref, split->axis, split->pos);
+        bool left_empty = aabb_is_empty(&left_box);
+        bool right_empty = aabb_is_empty(&right_box);
+
+        if (!left_empty && !right_empty && ctx->ref_budget)
+        {
+            ctx->ref_budget--;
+            push_ref(left, left_count, ref, &left_box);
+            push_ref(right, right_count, ref, &right_box);
+        }
+        else if (right_empty
+                 || (!left_empty
+                     && vec3_axis(&ref->center, split->axis) < split->pos))
+            push_ref(left, left_count, ref, &ref->box);
+        else
+            push_ref(right, right_count, ref, &ref->box);
+    }
+}
+
+static int cmp_center_x(const void *a, const void *b)
+{
+    double ca = ((const struct build_prim *)a)->center.x;
+    double cb = ((const struct build_prim *)b)->center.x;
+    return (ca > cb) - (ca < cb);
+}
+
+static int cmp_center_y(const void *a, const void *b)
+{
+    double ca = ((const struct build_prim *)a)->center.y;
+    double cb = ((const struct build_prim *)b)->center.y;
+    return (ca > cb) - (ca < cb);
+}
+
+static int cmp_center_z(const void *a, const void *b)
+{
+    double ca = ((const struct build_prim *)a)->center.z;
+    double cb = ((const struct build_prim *)b)->center.z;
+    return (ca > cb) - (ca < cb);
+}
+
+/*
+** Splits the references in two halves along the largest axis.
+** This always makes progress, and bounds the depth of the tree.
+*/
+static size_t median_split(struct build_prim *refs, size_t count,
+                           const struct aabb *centers)
+{
+    struct vec3 extent = vec3_sub(&centers->max, &centers->min);
+    int (*cmp)(const void *, const void *) = cmp_center_x;
+    if (extent.y > extent.x && extent.y >= extent.z)
+        cmp = cmp_center_y;
+    else if (extent.z > extent.x && extent.z > extent.y)
+        cmp = cmp_center_z;
+
+    qsort(refs, count, sizeof(*refs), cmp);
+    return count / 2;
+}
+
+static void build_node(struct build_ctx *ctx, uint32_t node_i,
+                       struct build_prim *refs, size_t count, size_t depth);
+
+/*
+** Tries to find a spatial split cheaper than the best object split.
+** If there is one, builds the children of the node using it.
+*/
+static bool build_spatial_children(struct build_ctx *ctx, uint32_t node_i,
+                                   struct build_prim *refs, size_t count,
+                                   size_t depth, const struct aabb *box,
+                                   const struct split *object_split)
+{
+    struct aabb overlap = object_split->left_box;
+    aabb_intersect(&overlap, &object_split->right_box);
+    if (aabb_is_empty(&overlap) || aabb_half_area(&overlap) <= ctx->min_overlap)
+        return false;
+
+    struct split split;
+    if (!find_spatial_split(&split, ctx, refs, count, box)
+        || split.cost >= object_split->cost)
+        return false;
+
+    // references straddling the plane may end up on both sides
+    struct build_prim *left = xcalloc(count, sizeof(*left));
+    struct build_prim *right = xcalloc(count, sizeof(*right));
+    size_t left_count;
+    size_t right_count;
+    spatial_partition(ctx, left, &left_count, right, &right_count, refs, count,
+                      &split);
+
+    bool res = left_count && right_count;
+    if (res)
+    {
+        struct bvh *bvh = ctx->bvh;
+        uint32_t child = bvh->node_count;
+        bvh->node_count += 2;
+        bvh->nodes[node_i].offset = child;
+        bvh->nodes[node_i].count = 0;
+
+        build_node(ctx, child, left, left_count, depth + 1);
+        build_node(ctx, child + 1, right, right_count, depth + 1);
+    }
+
+    free(left);
+    free(right);
+    return res;
+}
+
+static void build_node(struct build_ctx *ctx, uint32_t node_i,
+                       struct build_prim *refs, size_t count, size_t depth)
+{
+    struct bvh *bvh = ctx->bvh;
+
+    struct aabb box;
+    struct aabb centers;
+    aabb_init(&box);
+    aabb_init(&centers);
+    for (size_t i = 0; i < count; i++)
+    {
+        aabb_extend(&box, &refs[i].box);
+        aabb_extend_point(&centers, &refs[i].center);
+    }
+
+    struct bvh_node *node = &bvh->nodes[node_i];
+    bvh_node_set_bounds(node, &box);
+
+    size_t mid = 0;
+    // past half the maximum depth, only use median splits, which halve
+    // the number of references at each level
+    if (count > 1 && depth < BVH_MAX_DEPTH / 2)
+    {
+        struct split split;
+        bool found = find_split(&split, refs, count, &box, &centers);
+        if (!found)
+            split.cost = INFINITY;
+
+        if (ctx->prim_split && ctx->ref_budget && !isinf(split.cost)
+            && build_spatial_children(ctx, node_i, refs, count, depth, &box,
+                                      &split))
+            return;
+
+        if (found)
+        {
+            if (split.cost >= count && count <= BVH_MAX_LEAF_SIZE)
+                goto make_leaf;
+            mid = partition(refs, count, &split, &centers);
+        }
+    }
+
+    if (mid == 0 || mid == count)
+    {
+        if (count <= BVH_MAX_LEAF_SIZE)
+            goto make_leaf;
+        mid = median_split(refs, count, &centers);
+    }
+
+    uint32_t child = bvh->node_count;
+    bvh->node_count += 2;
+    node->offset = child;
+    node->count = 0;
+
+    build_node(ctx, child, refs, mid, depth + 1);
+    build_node(ctx, child + 1, refs + mid, count - mid, depth + 1);
+    return;
+
+make_leaf:
+    node->offset = bvh->prim_count;
+    node->count = count;
+    for (size_t i = 0; i < count; i++)
+        bvh->prims[bvh->prim_count++] = refs[i].id;
+}
+
+static double node_half_area(const struct bvh_node *node)
+{
+    struct aabb box;
+    bvh_node_get_bounds(&box, node);
+    return aabb_half_area(&box);
+}
+
+/*
+** A pair of siblings waiting to be laid out: the index of the first sibling
+** in the old node array, and the index of their parent in the new one.
+*/
+struct layout_pair
+{
+    uint32_t first;
+    uint32_t parent;
+};
+
+struct layout_ctx
+{
+    const struct bvh_node *old_nodes;
+    struct bvh_node *nodes;
+    size_t node_count;
+
+    // treelet roots which still have to be laid out
+    struct layout_pair *pending;
+    size_t pending_count;
+    size_t pending_capacity;
+};
+
+static void push_pending(struct layout_ctx *ctx, struct layout_pair pair)
+{
+    if (ctx->pending_count == ctx->pending_capacity)
+    {
+        ctx->pending_capacity = ctx->pending_capacity * 2 + 16;
+        ctx->pending = xrealloc(ctx->pending, ctx->pending_capacity
+                                                  * sizeof(*ctx->pending));
+    }
+    ctx->pending[ctx->pending_count++] = pair;
+}
+
+/*
+** Lays out a treelet, grown from a pair of siblings by repeatedly adding the
+** children of the node most likely to be hit by a ray, which is the one with
+** the largest area. The pairs left out become the roots of other treelets.
+*/
+static void layout_treelet(struct layout_ctx *ctx, struct layout_pair root)
+{
+    struct layout_pair frontier[2 * BVH_TREELET_PAIRS];
+    double frontier_area[2 * BVH_TREELET_PAIRS];
+    size_t frontier_count = 1;
+    frontier[0] = root;
+    frontier_area[0] = INFINITY;
+
+    for (size_t k = 0; k < BVH_TREELET_PAIRS && frontier_count; k++)
+    {
+        size_t best = 0;
+        for (size_t i = 1; i < frontier_count; i++)
+            if (frontier_area[i] > frontier_area[best])
+                best = i;
+
+        struct layout_pair pair = frontier[best];
+        frontier[best] = frontier[--frontier_count];
+        frontier_area[best] = frontier_area[frontier_count];
+
+        uint32_t first = ctx->node_count;
+        ctx->node_count += 2;
+        ctx->nodes[pair.parent].offset = first;
+        for (size_t i = 0; i < 2; i++)
+        {
+            const struct bvh_node *node = &ctx->old_nodes[pair.first + i];
+            ctx->nodes[first + i] = *node;
+            if (node->count)
+                continue;
+
+            frontier[frontier_count].first = node->offset;
+            frontier[frontier_count].parent = first + i;
+            frontier_area[frontier_count] = node_half_area(node);
+            frontier_count++;
+        }
+    }
+
+    // push the remaining pairs in reverse order of area, so that the most
+    // likely ones are laid out right after this treelet
+    while (frontier_count)
+    {
+        size_t worst = 0;
+        for (size_t i = 1; i < frontier_count; i++)
+            if (frontier_area[i] < frontier_area[worst])
+                worst = i;
+
+        push_pending(ctx, frontier[worst]);
+        frontier[worst] = frontier[--frontier_count];
+        frontier_area[worst] = frontier_area[frontier_count];
+    }
+}
+
+/*
+** Reorders nodes so that nodes visited together share cache lines and pages,
+** and primitive indices so that they follow the order of leaves.
+** Siblings stay next to each other, and children after their parent.
+*/
+static void layout(struct bvh *bvh)
+{
+    struct layout_ctx ctx = {
+        .old_nodes = bvh->nodes,
+        .nodes = xcalloc(bvh->node_count, sizeof(*bvh->nodes)),
+        .node_count = 1,
+    };
+
+    ctx.nodes[0] = bvh->nodes[0];
+    if (bvh->nodes[0].count == 0)
+        push_pending(&ctx, (struct layout_pair){bvh->nodes[0].offset, 0});
+
+    // treelets are laid out depth first, next to their parent treelet
+    while (ctx.pending_count)
+        layout_treelet(&ctx, ctx.pending[--ctx.pending_count]);
+    free(ctx.pending);
+
+    assert(ctx.node_count == bvh->node_count);
+    free(bvh->nodes);
+    bvh->nodes = ctx.nodes;
+
+    uint32_t *prims = xcalloc(bvh->prim_count, sizeof(*prims));
+    size_t prim_count = 0;
+    for (size_t i = 0; i < bvh->node_count; i++)
+    {
+        struct bvh_node *node = &bvh->nodes[i];
+        if (node->count == 0)
+            continue;
+
+        for (size_t k = 0; k < node->count; k++)
+            prims[prim_count + k] = bvh->prims[node->offset + k];
+        node->offset = prim_count;
+        prim_count += node->count;
+    }
+    free(bvh->prims);
+    bvh->prims = prims;
+}
+
+static void build(struct bvh *bvh, const struct aabb *prim_bounds,
+                  size_t count, struct build_ctx *ctx)
+{
+    bvh_destroy(bvh);
+    bvh_init(bvh);
+    if (count == 0)
+        return;
+
+    struct build_prim *refs = xcalloc(count, sizeof(*refs));
+    struct aabb root_box;
+    aabb_init(&root_box);
+    for (size_t i = 0; i < count; i++)
+    {
+        refs[i].box = prim_bounds[i];
+        refs[i].center = aabb_center(&prim_bounds[i]);
+        refs[i].id = i;
+        aabb_extend(&root_box, &prim_bounds[i]);
+    }
+
+    // a binary tree with n leaves has at most 2n - 1 nodes
+    size_t max_refs = count + ctx->ref_budget;
+    bvh->nodes = xcalloc(2 * max_refs - 1, sizeof(*bvh->nodes));
+    bvh->prims = xcalloc(max_refs, sizeof(*bvh->prims));
+    ctx->bvh = bvh;
+    ctx->min_overlap = BVH_SPATIAL_MIN_OVERLAP * aabb_half_area(&root_box);
+
+    bvh->node_count = 1;
+    build_node(ctx, 0, refs, count, 0);
+    free(refs);
+
+    // give back the unused duplication budget
+    if (bvh->prim_count < max_refs)
+    {
+        bvh->nodes
+            = xrealloc(bvh->nodes, bvh->node_count * sizeof(*bvh->nodes));
+        bvh->prims
+            = xrealloc(bvh->prims, bvh->prim_count * sizeof(*bvh->prims));
+    }
+
+    layout(bvh);
+
+    bvh->build_cost = bvh_cost(bvh);
+}
+
+void bvh_build(struct bvh *bvh, const struct aabb *prim_bounds, size_t count)
+{
+    struct build_ctx ctx = {
+        .prim_split = NULL,
+        .ref_budget = 0,
+    };
+    build(bvh, prim_bounds, count, &ctx);
+}
+
+void bvh_build_spatial(struct bvh *bvh, const struct aabb *prim_bounds,
+                       size_t count, const struct bvh_params *params,
+                       bvh_prim_split_f prim_split, const void *ctx)
+{
+    if (!params->spatial_splits)
+    {
+        bvh_build(bvh, prim_bounds, count);
+        return;
+    }
+
+    struct build_ctx build_ctx = {
+        .prim_split = prim_split,
+        .prims_ctx = ctx,
+        .ref_budget = count * params->spatial_budget,
+    };
+    build(bvh, prim_bounds, count, &build_ctx);
+}
+
+void bvh_destroy(struct bvh *bvh)
+{
+    if (bvh->mapping)
+    {
+        munmap(bvh->mapping, bvh->mapping_size);
+        return;
+    }
+
+    free(bvh->nodes);
+    free(bvh->prims);
+}
+
+void bvh_drop_nodes(struct bvh *bvh)
+{
+    if (bvh->mapping)
+        return;
+
+    free(bvh->nodes);
+    bvh->nodes = NULL;
+    bvh->node_count = 0;
+}
+
+double bvh_cost(const struct bvh *bvh)
+{
+    if (bvh->node_count == 0)
+        return 0;
+
+    double root_area = node_half_area(&bvh->nodes[0]);
+    if (root_area == 0)
+        return 0;
+
+    double cost = 0;
+    for (size_t i = 0; i < bvh->node_count; i++)
+    {
+        const struct bvh_node *node = &bvh->nodes[i];
+        double weight = node->count ? node->count : BVH_TRAVERSAL_COST;
+        cost += weight * node_half_area(node);
+    }
+    return cost / root_area;
+}
+
+struct refit_ctx
+{
+    struct bvh *bvh;
+    bvh_prim_bounds_f prim_bounds;
+    const void *prims_ctx;
+    // node indices, sorted by decreasing depth
+    const uint32_t *order;
+};
+
+static void refit_node(const struct refit_ctx *ctx, struct bvh_node *node)
+{
+    struct bvh *bvh = ctx->bvh;
+    if (node->count)
+    {
+        struct aabb box;
+        aabb_init(&box);
+        for (size_t i = 0; i < node->count; i++)
+        {
+            struct aabb prim_box;
+            ctx->prim_bounds(&prim_box, ctx->prims_ctx,
+                             bvh->prims[node->offset + i]);
+            aabb_extend(&box, &prim_box);
+        }
+        bvh_node_set_bounds(node, &box);
+        return;
+    }
+
+    const struct bvh_node *left = &bvh->nodes[node->offset];
+    const struct bvh_node *right = left + 1;
+    for (size_t i = 0; i < 3; i++)
+    {
+        node->min[i] = fminf(left->min[i], right->min[i]);
+        node->max[i] = fmaxf(left->max[i], right->max[i]);
+    }
+}
+
+static void refit_range(void *arg, size_t begin, size_t end)
+{
+    const struct refit_ctx *ctx = arg;
+    for (size_t i = begin; i < end; i++)
+        refit_node(ctx, &ctx->bvh->nodes[ctx->order[i]]);
+}
+
+double bvh_refit(struct bvh *bvh, bvh_prim_bounds_f prim_bounds,
+                 const void *ctx)
+{
+    size_t node_count = bvh->node_count;
+    if (node_count == 0)
+        return 1;
+
+    // children are stored after their parent, so a single forward pass
+    // is enough to compute the depth of all nodes
+    uint8_t *depth = xcalloc(node_count, sizeof(*depth));
+    size_t level_count = 1;
+    for (size_t i = 0; i < node_count; i++)
+    {
+        const struct bvh_node *node = &bvh->nodes[i];
+        if (node->count)
+            continue;
+
+        depth[node->offset] = depth[node->offset + 1] = depth[i] + 1;
+        if ((size_t)depth[i] + 2 > level_count)
+            level_count = depth[i] + 2;
+    }
+
+    // sort nodes by decreasing depth: all the nodes of a level can be
+    // refitted in parallel, once the level below is done
+    size_t *level_start = xcalloc(level_count + 1, sizeof(*level_start));
+    for (size_t i = 0; i < node_count; i++)
+        level_start[level_count - depth[i]]++;
+    for (size_t i = 1; i <= level_count; i++)
+        level_start[i] += level_start[i - 1];
+
+    uint32_t *order = xcalloc(node_count, sizeof(*order));
+    for (size_t i = 0; i < node_count; i++)
+        order[level_start[level_count - 1 - depth[i]]++] = i;
+
+    struct refit_ctx refit_ctx = {
+        .bvh = bvh,
+        .prim_bounds = prim_bounds,
+        .prims_ctx = ctx,
+        .order = order,
+    };
+
+    // level_start[i] now is the end of level i, and the start of level i + 1
+    size_t begin = 0;
+    for (size_t level = 0; level < level_count; level++)
+    {
+        size_t end = level_start[level];
+        parallel_for(end - begin, BVH_REFIT_GRAIN, refit_range, &refit_ctx);
+        refit_ctx.order += end - begin;
+        begin = end;
+    }
+
+    free(order);
+    free(level_start);
+    free(depth);
+
+    if (bvh->build_cost == 0)
+        return 1;
+    return bvh_cost(bvh) / bvh->build_cost;
+}
@@ -0,0 +1,309 @@
+#include "bvh_cache.h"
+#include "utils/alloc.h"
+#include "utils/static_assert.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BVH_CACHE_MAGIC "RTBVHCCH"
+// must be bumped when the layout of nodes or files changes
+#define BVH_CACHE_VERSION 2
+// tells apart files written on machines with another byte order
+#define BVH_CACHE_BYTE_ORDER 0x01020304
+
+// header flags
+#define BVH_CACHE_COMPRESSED 1
+
+/*
+** Cache files are made of this header, followed by the nodes of the bvh,
+** the compressed nodes, the primitive references of leaves, and how
+** primitives were renumbered.
+*/
+struct bvh_cache_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t node_size;
+    uint32_t qnode_size;
+    uint64_t key;
+    uint64_t node_count;
+    uint64_t qnode_count;
+    uint64_t prim_count;
+    // the number of primitives the tree is built over
+    uint64_t count;
+    double build_cost;
+    double root_box[6];
+    uint32_t flags;
+    uint32_t unused;
+};
+
+// nodes directly follow the header, and must stay aligned
+STATIC_ASSERT(bvh_cache_header_size, sizeof(struct bvh_cache_header) == 128);
+
+static bool header_matches(const struct bvh_cache_header *header,
+                           size_t file_size, uint64_t key, size_t count,
+                           bool compressed)
+{
+    if (memcmp(header->magic, BVH_CACHE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != BVH_CACHE_VERSION
+        || header->byte_order != BVH_CACHE_BYTE_ORDER
+        || header->node_size != sizeof(struct bvh_node)
+        || header->qnode_size != sizeof(struct qbvh_node)
+        || header->key != key || header->count != count
+        || !(header->flags & BVH_CACHE_COMPRESSED) != !compressed)
+        return false;
+
+    // the file must hold exactly what the header announces
+    uint64_t max_count = file_size / sizeof(uint32_t);
+    if (header->node_count > max_count || header->qnode_count > max_count
+        || header->prim_count > max_count
+        || (!compressed && header->qnode_count))
+        return false;
+
+    uint64_t expected_size = sizeof(*header)
+                             + header->node_count * sizeof(struct bvh_node)
+                             + header->qnode_count * sizeof(struct qbvh_node)
+                             + (header->prim_count + count) * sizeof(uint32_t);
+    return expected_size == file_size;
+}
+
+/*
+** Checks that a tree over count primitives can be traversed safely, as
+** files matching their key may still have been corrupted: children and
+** primitive references must be in range, children must come after their
+** parent, and the tree can't be deeper than traversal stacks.
+*/
+static bool tree_valid(const struct bvh_node *nodes, size_t node_count,
+                       const uint32_t *prims, size_t prim_count, size_t count)
+{
+    for (size_t i = 0; i < prim_count; i++)
+        if (prims[i] >= count)
+            return false;
+
+    uint8_t *depths = xcalloc(node_count, sizeof(*depths));
+    bool res = true;
+    for (size_t i = 0; res && i < node_count; i++)
+    {
+        const struct bvh_node *node = &nodes[i];
+        if (node->count)
+        {
+            res = (uint64_t)node->offset + node->count <= prim_count;
+            continue;
+        }
+
+        // children come after their parent, so their depth is final once
+        // all nodes before them were checked
+        res = node->offset > i && (uint64_t)node->offset + 1 < node_count
+              && depths[i] < BVH_MAX_DEPTH;
+        for (size_t k = 0; res && k < 2; k++)
+            if (depths[node->offset + k] < depths[i] + 1)
+                depths[node->offset + k] = depths[i] + 1;
+    }
+    free(depths);
+    return res;
+}
+
+// same as tree_valid, for compressed nodes, whose leaves live in their parent
+static bool qtree_valid(const struct qbvh_node *nodes, size_t node_count,
+                        size_t prim_count)
+{
+    uint8_t *depths = xcalloc(node_count, sizeof(*depths));
+    bool res = true;
+    for (size_t i = 0; res && i < node_count; i++)
+        for (size_t k = 0; res && k < 2; k++)
+        {
+            unsigned child_count = qbvh_child_count(&nodes[i], k);
+            uint32_t child = nodes[i].child[k];
+            if (child_count == QBVH_EMPTY_CHILD)
+                continue;
+            if (child_count)
+            {
+                res = (uint64_t)child + child_count <= prim_count;
+                continue;
+            }
+
+            res = child > i && child < node_count && depths[i] < BVH_MAX_DEPTH;
+            if (res && depths[child] < depths[i] + 1)
+                depths[child] = depths[i] + 1;
+        }
+    free(depths);
+    return res;
+}
+
+// checks that every primitive was given a distinct new index
+static bool renumbering_valid(const uint32_t *new_ids, size_t count)
+{
+    bool *used = xcalloc(count, sizeof(*used));
+    bool res = true;
+    for (size_t i = 0; res && i < count; i++)
+    {
+        res = new_ids[i] < count && !used[new_ids[i]];
+        if (res)
+            used[new_ids[i]] = true;
+    }
+    free(used);
+    return res;
+}
+
+int bvh_cache_load(struct bvh *bvh, struct qbvh *qbvh,
+                   const uint32_t **new_ids, const char *path, uint64_t key,
+                   size_t count)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1
+        || (size_t)st.st_size < sizeof(struct bvh_cache_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    // the mapping is private and writable, so that the tree can still be
+    // refitted without touching the file
+    void *mapping
+        = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return -1;
+
+    const struct bvh_cache_header *header = mapping;
+    if (!header_matches(header, size, key, count, qbvh != NULL))
+    {
+        munmap(mapping, size);
+        return -1;
+    }
+
+    struct bvh_node *nodes = (struct bvh_node *)(header + 1);
+    struct qbvh_node *qnodes = (struct qbvh_node *)(nodes + header->node_count);
+    uint32_t *prims = (uint32_t *)(qnodes + header->qnode_count);
+    const uint32_t *ids = prims + header->prim_count;
+    if (!tree_valid(nodes, header->node_count, prims, header->prim_count,
+                    count)
+        || !qtree_valid(qnodes, header->qnode_count, header->prim_count)
+        || !renumbering_valid(ids, count))
+    {
+        munmap(mapping, size);
+        return -1;
+    }
+
+    bvh_destroy(bvh);
+    bvh_init(bvh);
+    bvh->mapping = mapping;
+    bvh->mapping_size = size;
+    bvh->node_count = header->node_count;
+    bvh->nodes = nodes;
+    bvh->prim_count = header->prim_count;
+    bvh->prims = prims;
+    bvh->build_cost = header->build_cost;
+
+    if (qbvh)
+    {
+        qbvh_destroy(qbvh);
+        qbvh_init(qbvh);
+        qbvh->mapped = true;
+        qbvh->node_count = header->qnode_count;
+        qbvh->nodes = qnodes;
+        const double *box = header->root_box;
+        qbvh->root_box.min = (struct vec3){box[0], box[1], box[2]};
+        qbvh->root_box.max = (struct vec3){box[3], box[4], box[5]};
+    }
+
+    *new_ids = ids;
+    return 0;
+}
+
+// compressed trees have no regular nodes, and empty trees have nothing
+static bool write_array(FILE *fp, const void *data, size_t size, size_t count)
+{
+    return count == 0 || fwrite(data, size, count, fp) == count;
+}
+
+int bvh_cache_store(const struct bvh *bvh, const struct qbvh *qbvh,
+                    const uint32_t *new_ids, size_t count, const char *path,
+                    uint64_t key)
+{
+    struct bvh_cache_header header = {
+        .magic = BVH_CACHE_MAGIC,
+        .version = BVH_CACHE_VERSION,
+        .byte_order = BVH_CACHE_BYTE_ORDER,
+        .node_size = sizeof(struct bvh_node),
+        .qnode_size = sizeof(struct qbvh_node),
+        .key = key,
+        .node_count = bvh->node_count,
+        .qnode_count = qbvh ? qbvh->node_count : 0,
+        .prim_count = bvh->prim_count,
+        .count = count,
+        .build_cost = bvh->build_cost,
+        .flags = qbvh ? BVH_CACHE_COMPRESSED : 0,
+    };
+    if (qbvh)
+    {
+        const struct aabb *box = &qbvh->root_box;
+        const double root_box[6] = {box->min.x, box->min.y, box->min.z,
+                                    box->max.x, box->max.y, box->max.z};
+        memcpy(header.root_box, root_box, sizeof(root_box));
+    }
+
+    // write to a temporary file first, so that concurrent readers never
+    // see a partially written cache
+    size_t tmp_size = strlen(path) + 32;
+    char *tmp_path = xalloc(tmp_size);
+    snprintf(tmp_path, tmp_size, "%s.tmp.%ld", path, (long)getpid());
+
+    int rc = -1;
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL)
+        goto out;
+
+    bool ok = write_array(fp, &header, sizeof(header), 1);
+    ok &= write_array(fp, bvh->nodes, sizeof(*bvh->nodes), bvh->node_count);
+    if (qbvh)
+        ok &= write_array(fp, qbvh->nodes, sizeof(*qbvh->nodes),
+                          qbvh->node_count);
+    ok &= write_array(fp, bvh->prims, sizeof(*bvh->prims), bvh->prim_count);
+    ok &= write_array(fp, new_ids, sizeof(*new_ids), count);
+    ok &= fclose(fp) == 0;
+
+    if (ok && rename(tmp_path, path) == 0)
+        rc = 0;
+    else
+        unlink(tmp_path);
+
+out:
+    if (rc)
+        warn("failed to write the bvh cache: %s", path);
+    free(tmp_path);
+    return rc;
+}
+
+char *bvh_cache_path(const char *cache_dir, const char *source_path,
+                     uint64_t key)
+{
+    size_t size;
+    char *res;
+    if (cache_dir)
+    {
+        size = strlen(cache_dir) + 32;
+        res = xalloc(size);
+        snprintf(res, size, "%s/%016llx.bvh", cache_dir,
+                 (unsigned long long)key);
+    }
+    else
+    {
+        size = strlen(source_path) + 8;
+        res = xalloc(size);
+        snprintf(res, size, "%s.bvh", source_path);
+    }
+    return res;
+}
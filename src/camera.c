@@ -1,27 +1,259 @@
 #include "camera.h"
+#include "utils/simd.h"
 
-void camera_cast_ray(struct ray *ray, const struct camera *camera, double cam_x,
-                     double cam_y)
+#include <assert.h>
+#include <string.h>
+
+// the number of rays cast at once by camera_cast_batch
+#define CAMERA_BATCH_WIDTH 4
+
+void camera_basis_init(struct camera_basis *basis, const struct camera *camera)
+{
+    struct vec3 right = vec3_cross(&camera->forward, &camera->up);
+    basis->projection = camera->projection;
+    basis->center = camera->center;
+    basis->right = vec3_mul(&right, camera->width);
+    basis->up = vec3_mul(&camera->up, camera->height);
+    basis->forward = vec3_mul(&camera->forward, camera->focal_distance);
+}
+
+void camera_basis_cast_ray(struct ray *ray, const struct camera_basis *basis,
+                           double cam_x, double cam_y)
 {
     // translate relative position inside the image plane
     // into absolute position into the image plane.
-    double x_coeff = cam_x * camera->width;
-    double y_coeff = cam_y * camera->height;
-
-    struct vec3 right = vec3_cross(&camera->forward, &camera->up);
-    // right_offset = right * x_coeff
-    struct vec3 right_offset = vec3_mul(&right, x_coeff);
-    // up_offset = up * y_coeff
-    struct vec3 up_offset = vec3_mul(&camera->up, y_coeff);
-    // offset = right_offset + up_offset
+    struct vec3 right_offset = vec3_mul(&basis->right, cam_x);
+    struct vec3 up_offset = vec3_mul(&basis->up, cam_y);
     struct vec3 offset = vec3_add(&right_offset, &up_offset);
-    // ray->source = center + offset
-    ray->source = vec3_add(&camera->center, &offset);
-
-    struct vec3 vantage_point_offset
-        = vec3_mul(&camera->forward, -camera->focal_distance);
-    struct vec3 vantage_point
-        = vec3_add(&vantage_point_offset, &camera->center);
-    ray->direction = vec3_sub(&ray->source, &vantage_point);
+    ray->source = vec3_add(&basis->center, &offset);
+
+    if (basis->projection == CAMERA_ORTHOGRAPHIC)
+        ray->direction = basis->forward;
+    else
+        // the direction from the vantage point to the source
+        ray->direction = vec3_add(&basis->forward, &offset);
     vec3_normalize(&ray->direction);
+    ray->tmin = 0;
+    ray->tmax = INFINITY;
+}
+
+bool camera_basis_project(double *cam_x, double *cam_y, double *dist,
+                          const struct camera_basis *basis,
+                          const struct vec3 *point)
+{
+    // the up vector isn't always orthogonal to the forward one: the point is
+    // split along all three axes by solving a linear system
+    struct vec3 to_point = vec3_sub(point, &basis->center);
+    if (basis->projection == CAMERA_PERSPECTIVE)
+        // relative to the vantage point
+        to_point = vec3_add(&to_point, &basis->forward);
+
+    struct vec3 right_up = vec3_cross(&basis->right, &basis->up);
+    struct vec3 up_forward = vec3_cross(&basis->up, &basis->forward);
+    struct vec3 forward_right = vec3_cross(&basis->forward, &basis->right);
+    double det = vec3_dot(&basis->forward, &right_up);
+    if (det == 0)
+        return false;
+
+    double forward = vec3_dot(&to_point, &right_up) / det;
+    double right = vec3_dot(&to_point, &up_forward) / det;
+    double up = vec3_dot(&to_point, &forward_right) / det;
+    if (basis->projection == CAMERA_ORTHOGRAPHIC)
+    {
+        *cam_x = right;
+        *cam_y = up;
+        *dist = forward * vec3_length(&basis->forward);
+        return forward >= 0;
+    }
+
+    // rays start on the image plane, one forward step from the vantage point
+    if (forward <= 1)
+        return false;
+
+    *cam_x = right / forward;
+    *cam_y = up / forward;
+    struct vec3 right_offset = vec3_mul(&basis->right, *cam_x);
+    struct vec3 up_offset = vec3_mul(&basis->up, *cam_y);
+    struct vec3 offset = vec3_add(&right_offset, &up_offset);
+    struct vec3 dir = vec3_add(&basis->forward, &offset);
+    *dist = (forward - 1) * vec3_length(&dir);
+    return true;
+}
+
+void camera_cast_ray(struct ray *ray, const struct camera *camera, double cam_x,
+                     double cam_y)
+{
+    struct camera_basis basis;
+    camera_basis_init(&basis, camera);
+    camera_basis_cast_ray(ray, &basis, cam_x, cam_y);
+}
+
+/*
+** Computes the plane going through a side of the frustum, which starts on
+** the image plane at point edge, along axis, and oriented so that inside
+** is on the side of the inner point.
+*/
+static void frustum_side(struct camera_frustum *frustum, size_t i,
+                         const struct camera_basis *basis,
+                         const struct vec3 *edge, const struct vec3 *axis,
+                         const struct vec3 *inner)
+{
+    struct vec3 dir = basis->forward;
+    if (basis->projection == CAMERA_PERSPECTIVE)
+    {
+        // the direction of the ray cast through the edge
+        struct vec3 edge_offset = vec3_sub(edge, &basis->center);
+        dir = vec3_add(&basis->forward, &edge_offset);
+    }
+
+    struct vec3 normal = vec3_cross(axis, &dir);
+    struct vec3 to_inner = vec3_sub(inner, edge);
+    if (vec3_dot(&normal, &to_inner) < 0)
+        normal = vec3_mul(&normal, -1);
+
+    frustum->normal[i] = normal;
+    frustum->offset[i] = vec3_dot(&normal, edge);
+}
+
+// the point of the image plane at some coordinates
+static struct vec3 image_plane_point(const struct camera_basis *basis,
+                                     double cam_x, double cam_y)
+{
+    struct vec3 right_offset = vec3_mul(&basis->right, cam_x);
+    struct vec3 up_offset = vec3_mul(&basis->up, cam_y);
+    struct vec3 offset = vec3_add(&right_offset, &up_offset);
+    return vec3_add(&basis->center, &offset);
+}
+
+void camera_frustum_init(struct camera_frustum *frustum,
+                         const struct camera_basis *basis, double x_min,
+                         double y_min, double x_max, double y_max)
+{
+    struct vec3 inner = image_plane_point(basis, (x_min + x_max) / 2,
+                                          (y_min + y_max) / 2);
+    // the left and bottom sides go through the first corner, the right and
+    // top sides through the other one
+    struct vec3 min = image_plane_point(basis, x_min, y_min);
+    struct vec3 max = image_plane_point(basis, x_max, y_max);
+    frustum_side(frustum, 0, basis, &min, &basis->up, &inner);
+    frustum_side(frustum, 1, basis, &max, &basis->up, &inner);
+    frustum_side(frustum, 2, basis, &min, &basis->right, &inner);
+    frustum_side(frustum, 3, basis, &max, &basis->right, &inner);
+
+    // rays start from the image plane
+    frustum->normal[4] = basis->forward;
+    frustum->offset[4] = vec3_dot(&basis->forward, &basis->center);
+}
+
+bool camera_frustum_overlaps(const struct camera_frustum *frustum,
+                             const struct aabb *box)
+{
+    if (box->min.x > box->max.x || box->min.y > box->max.y
+        || box->min.z > box->max.z)
+        return false;
+
+    for (size_t i = 0; i < 5; i++)
+    {
+        // the corner of the box the furthest along the normal
+        const struct vec3 *n = &frustum->normal[i];
+        struct vec3 corner = {
+            n->x > 0 ? box->max.x : box->min.x,
+            n->y > 0 ? box->max.y : box->min.y,
+            n->z > 0 ? box->max.z : box->min.z,
+        };
+        if (vec3_dot(n, &corner) < frustum->offset[i])
+            return false;
+    }
+    return true;
+}
+
+/*
+** projection is meant to be a constant, so that each projection gets its own
+** specialized code.
+*/
+static inline void camera_cast_batch_projection(
+    struct ray_batch *batch, const struct camera_basis *basis,
+    const double *cam_x, const double *cam_y, size_t count,
+    enum camera_projection projection)
+{
+    const v4d center_x = V4D_BROADCAST(basis->center.x);
+    const v4d center_y = V4D_BROADCAST(basis->center.y);
+    const v4d center_z = V4D_BROADCAST(basis->center.z);
+    const v4d right_x = V4D_BROADCAST(basis->right.x);
+    const v4d right_y = V4D_BROADCAST(basis->right.y);
+    const v4d right_z = V4D_BROADCAST(basis->right.z);
+    const v4d up_x = V4D_BROADCAST(basis->up.x);
+    const v4d up_y = V4D_BROADCAST(basis->up.y);
+    const v4d up_z = V4D_BROADCAST(basis->up.z);
+    const v4d forward_x = V4D_BROADCAST(basis->forward.x);
+    const v4d forward_y = V4D_BROADCAST(basis->forward.y);
+    const v4d forward_z = V4D_BROADCAST(basis->forward.z);
+
+    // orthographic rays all share the same direction
+    struct vec3 ortho_dir = basis->forward;
+    vec3_normalize(&ortho_dir);
+
+    // the batch is a multiple of the width, so that full vectors can be
+    // stored past count
+    for (size_t i = 0; i < count; i += CAMERA_BATCH_WIDTH)
+    {
+        size_t width = count - i;
+        if (width > CAMERA_BATCH_WIDTH)
+            width = CAMERA_BATCH_WIDTH;
+
+        v4d x = {0};
+        v4d y = {0};
+        for (size_t k = 0; k < width; k++)
+        {
+            x[k] = cam_x[i + k];
+            y[k] = cam_y[i + k];
+        }
+
+        v4d offset_x = right_x * x + up_x * y;
+        v4d offset_y = right_y * x + up_y * y;
+        v4d offset_z = right_z * x + up_z * y;
+        v4d source_x = center_x + offset_x;
+        v4d source_y = center_y + offset_y;
+        v4d source_z = center_z + offset_z;
+        memcpy(&batch->source_x[i], &source_x, sizeof(source_x));
+        memcpy(&batch->source_y[i], &source_y, sizeof(source_y));
+        memcpy(&batch->source_z[i], &source_z, sizeof(source_z));
+
+        v4d dir_x = V4D_BROADCAST(ortho_dir.x);
+        v4d dir_y = V4D_BROADCAST(ortho_dir.y);
+        v4d dir_z = V4D_BROADCAST(ortho_dir.z);
+        if (projection == CAMERA_PERSPECTIVE)
+        {
+            dir_x = forward_x + offset_x;
+            dir_y = forward_y + offset_y;
+            dir_z = forward_z + offset_z;
+            v4d len2 = dir_x * dir_x + dir_y * dir_y + dir_z * dir_z;
+            v4d inv_len;
+            for (size_t k = 0; k < CAMERA_BATCH_WIDTH; k++)
+                inv_len[k] = 1 / sqrt(len2[k]);
+            dir_x *= inv_len;
+            dir_y *= inv_len;
+            dir_z *= inv_len;
+        }
+        memcpy(&batch->direction_x[i], &dir_x, sizeof(dir_x));
+        memcpy(&batch->direction_y[i], &dir_y, sizeof(dir_y));
+        memcpy(&batch->direction_z[i], &dir_z, sizeof(dir_z));
+    }
+
+    batch->count = count;
+    batch->tmin = 0;
+    batch->tmax = INFINITY;
+}
+
+void camera_cast_batch(struct ray_batch *batch,
+                       const struct camera_basis *basis, const double *cam_x,
+                       const double *cam_y, size_t count)
+{
+    assert(count <= RAY_BATCH_SIZE && RAY_BATCH_SIZE % CAMERA_BATCH_WIDTH == 0);
+    if (basis->projection == CAMERA_ORTHOGRAPHIC)
+        camera_cast_batch_projection(batch, basis, cam_x, cam_y, count,
+                                     CAMERA_ORTHOGRAPHIC);
+    else
+        camera_cast_batch_projection(batch, basis, cam_x, cam_y, count,
+                                     CAMERA_PERSPECTIVE);
 }
@@ -0,0 +1,274 @@
+#include "denoise.h"
+#include "utils/alloc.h"
+#include "utils/parallel.h"
+#include "utils/simd.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the normal weight is the cosine between normals, raised to the power of
+// 2^DENOISE_NORMAL_SQUARINGS
+#define DENOISE_NORMAL_SQUARINGS 7
+
+// how far apart depths, relative to the depth of the filtered pixel, and
+// per pixel of tap distance, are considered part of the same surface
+#define DENOISE_SIGMA_DEPTH 0.02f
+
+// how different the luminance of taps can be during the first pass. The
+// tolerance halves at each pass, as the noise gets filtered out
+#define DENOISE_SIGMA_COLOR 1.f
+
+// the number of rows filtered by each parallel task, at least
+#define DENOISE_GRAIN 16
+
+enum denoise_plane
+{
+    PLANE_R,
+    PLANE_G,
+    PLANE_B,
+    PLANE_COUNT,
+};
+
+/*
+** The image and its guides, with one plane per channel, so that
+** consecutive pixels can be loaded as vectors. Planes are surrounded by
+** copies of their edge pixels, so that taps never have to be clamped.
+*/
+struct denoise_ctx
+{
+    size_t width;
+    size_t height;
+    size_t padding;
+    size_t stride;
+    float *color[2][PLANE_COUNT];
+    float *normal[3];
+    float *depth;
+
+    // the current pass
+    size_t src;
+    size_t step;
+    float inv_sigma_color;
+};
+
+static size_t plane_index(const struct denoise_ctx *ctx, size_t x, size_t y)
+{
+    return (y + ctx->padding) * ctx->stride + x + ctx->padding;
+}
+
+static v4f load_v4f(const float *src)
+{
+    v4f res;
+    memcpy(&res, src, sizeof(res));
+    return res;
+}
+
+static void store_v4f(float *dst, v4f val)
+{
+    memcpy(dst, &val, sizeof(val));
+}
+
+/*
+** An approximation of exp(-x), for x >= 0, as (1 + x / 16) ^ -16.
+*/
+static v4f v4f_exp_neg(v4f x)
+{
+    const v4f one = {1, 1, 1, 1};
+    const v4f scale = {1.f / 16, 1.f / 16, 1.f / 16, 1.f / 16};
+    v4f res = one + x * scale;
+    res *= res;
+    res *= res;
+    res *= res;
+    res *= res;
+    return one / res;
+}
+
+static v4f v4f_abs(v4f x)
+{
+    return v4f_max(x, -x);
+}
+
+static v4f luminance(v4f r, v4f g, v4f b)
+{
+    const v4f r_weight = {0.2126f, 0.2126f, 0.2126f, 0.2126f};
+    const v4f g_weight = {0.7152f, 0.7152f, 0.7152f, 0.7152f};
+    const v4f b_weight = {0.0722f, 0.0722f, 0.0722f, 0.0722f};
+    return r * r_weight + g * g_weight + b * b_weight;
+}
+
+/*
+** Fills the borders of a plane with copies of the closest edge pixel.
+*/
+static void plane_pad(const struct denoise_ctx *ctx, float *plane)
+{
+    for (size_t y = 0; y < ctx->height; y++)
+    {
+        float *row = &plane[plane_index(ctx, 0, y)];
+        float left = row[0];
+        float right = row[ctx->width - 1];
+        for (size_t x = 1; x <= ctx->padding; x++)
+            row[-(ptrdiff_t)x] = left;
+        for (size_t x = ctx->width; x < ctx->stride - ctx->padding; x++)
+            row[x] = right;
+    }
+
+    size_t row_size = ctx->stride * sizeof(*plane);
+    float *first = &plane[plane_index(ctx, 0, 0) - ctx->padding];
+    float *last = &plane[plane_index(ctx, 0, ctx->height - 1) - ctx->padding];
+    for (size_t y = 1; y <= ctx->padding; y++)
+    {
+        memcpy(first - y * ctx->stride, first, row_size);
+        memcpy(last + y * ctx->stride, last, row_size);
+    }
+}
+
+/*
+** Filters rows [begin, end) of the current pass, 4 pixels at a time.
+** Pixels past the end of rows land in the padding, which gets rebuilt
+** after each pass.
+*/
+static void filter_rows(void *arg, size_t begin, size_t end)
+{
+    struct denoise_ctx *ctx = arg;
+    static const float kernel[5] = {1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4,
+                                    1.f / 16};
+    float *const *src = ctx->color[ctx->src];
+    float *const *dst = ctx->color[!ctx->src];
+    const v4f zero = {0, 0, 0, 0};
+    const v4f one = {1, 1, 1, 1};
+    const float depth_scale = DENOISE_SIGMA_DEPTH * ctx->step;
+    const v4f sigma_depth = {depth_scale, depth_scale, depth_scale,
+                             depth_scale};
+    const v4f min_depth = {1e-6f, 1e-6f, 1e-6f, 1e-6f};
+    const float c = ctx->inv_sigma_color;
+    const v4f inv_sigma_color = {c, c, c, c};
+
+    for (size_t y = begin; y < end; y++)
+        for (size_t x = 0; x < ctx->width; x += 4)
+        {
+            size_t p = plane_index(ctx, x, y);
+            v4f n_x = load_v4f(&ctx->normal[0][p]);
+            v4f n_y = load_v4f(&ctx->normal[1][p]);
+            v4f n_z = load_v4f(&ctx->normal[2][p]);
+            v4f z = load_v4f(&ctx->depth[p]);
+            v4f l = luminance(load_v4f(&src[PLANE_R][p]),
+                              load_v4f(&src[PLANE_G][p]),
+                              load_v4f(&src[PLANE_B][p]));
+            v4f depth_tolerance = v4f_max(z * sigma_depth, min_depth);
+
+            // the center tap is always weighted in, even when the guides
+            // are degenerate
+            const float k_center = kernel[2] * kernel[2];
+            v4f sum_w = {k_center, k_center, k_center, k_center};
+            v4f sum_r = sum_w * load_v4f(&src[PLANE_R][p]);
+            v4f sum_g = sum_w * load_v4f(&src[PLANE_G][p]);
+            v4f sum_b = sum_w * load_v4f(&src[PLANE_B][p]);
+            for (int dy = -2; dy <= 2; dy++)
+                for (int dx = -2; dx <= 2; dx++)
+                {
+                    if (dx == 0 && dy == 0)
+                        continue;
+
+                    size_t q = p + (dy * (ptrdiff_t)ctx->stride + dx)
+                                       * (ptrdiff_t)ctx->step;
+                    v4f q_r = load_v4f(&src[PLANE_R][q]);
+                    v4f q_g = load_v4f(&src[PLANE_G][q]);
+                    v4f q_b = load_v4f(&src[PLANE_B][q]);
+
+                    v4f w_n = n_x * load_v4f(&ctx->normal[0][q])
+                              + n_y * load_v4f(&ctx->normal[1][q])
+                              + n_z * load_v4f(&ctx->normal[2][q]);
+                    w_n = v4f_min(v4f_max(w_n, zero), one);
+                    for (int i = 0; i < DENOISE_NORMAL_SQUARINGS; i++)
+                        w_n *= w_n;
+
+                    v4f z_diff = v4f_abs(z - load_v4f(&ctx->depth[q]));
+                    v4f l_diff = v4f_abs(l - luminance(q_r, q_g, q_b));
+                    v4f w = v4f_exp_neg(z_diff / depth_tolerance
+                                        + l_diff * inv_sigma_color);
+
+                    float k = kernel[dy + 2] * kernel[dx + 2];
+                    w *= w_n * (v4f){k, k, k, k};
+                    sum_w += w;
+                    sum_r += w * q_r;
+                    sum_g += w * q_g;
+                    sum_b += w * q_b;
+                }
+
+            store_v4f(&dst[PLANE_R][p], sum_r / sum_w);
+            store_v4f(&dst[PLANE_G][p], sum_g / sum_w);
+            store_v4f(&dst[PLANE_B][p], sum_b / sum_w);
+        }
+}
+
+void denoise(struct hdr_image *color, const struct hdr_image *normal,
+             const struct hdr_image *depth, size_t iterations)
+{
+    assert(color->width == normal->width && color->height == normal->height);
+    assert(color->width == depth->width && color->height == depth->height);
+    if (iterations == 0 || color->width == 0 || color->height == 0)
+        return;
+
+    struct denoise_ctx ctx = {
+        .width = color->width,
+        .height = color->height,
+        // the widest pass reaches 2 taps away, 2^(iterations - 1) apart
+        .padding = (size_t)2 << (iterations - 1),
+    };
+    // rows are rounded up to whole vectors
+    ctx.stride = (ctx.width + 2 * ctx.padding + 3) & ~(size_t)3;
+    size_t plane_size = ctx.stride * (ctx.height + 2 * ctx.padding);
+
+    float **planes[] = {
+        &ctx.color[0][PLANE_R], &ctx.color[0][PLANE_G], &ctx.color[0][PLANE_B],
+        &ctx.color[1][PLANE_R], &ctx.color[1][PLANE_G], &ctx.color[1][PLANE_B],
+        &ctx.normal[0],         &ctx.normal[1],         &ctx.normal[2],
+        &ctx.depth,
+    };
+    for (size_t i = 0; i < sizeof(planes) / sizeof(planes[0]); i++)
+        *planes[i] = xcalloc(plane_size, sizeof(float));
+
+    for (size_t y = 0; y < ctx.height; y++)
+        for (size_t x = 0; x < ctx.width; x++)
+        {
+            size_t i = y * ctx.width + x;
+            size_t p = plane_index(&ctx, x, y);
+            ctx.color[0][PLANE_R][p] = color->data[i].r;
+            ctx.color[0][PLANE_G][p] = color->data[i].g;
+            ctx.color[0][PLANE_B][p] = color->data[i].b;
+            ctx.normal[0][p] = normal->data[i].r * 2 - 1;
+            ctx.normal[1][p] = normal->data[i].g * 2 - 1;
+            ctx.normal[2][p] = normal->data[i].b * 2 - 1;
+            ctx.depth[p] = depth->data[i].r;
+        }
+
+    for (size_t i = 0; i < 3; i++)
+        plane_pad(&ctx, ctx.normal[i]);
+    plane_pad(&ctx, ctx.depth);
+
+    float sigma_color = DENOISE_SIGMA_COLOR;
+    for (size_t i = 0; i < iterations; i++)
+    {
+        ctx.src = i % 2;
+        ctx.step = (size_t)1 << i;
+        ctx.inv_sigma_color = 1 / sigma_color;
+        for (size_t k = 0; k < PLANE_COUNT; k++)
+            plane_pad(&ctx, ctx.color[ctx.src][k]);
+        parallel_for(ctx.height, DENOISE_GRAIN, filter_rows, &ctx);
+        sigma_color /= 2;
+    }
+
+    float *const *res = ctx.color[iterations % 2];
+    for (size_t y = 0; y < ctx.height; y++)
+        for (size_t x = 0; x < ctx.width; x++)
+        {
+            size_t i = y * ctx.width + x;
+            size_t p = plane_index(&ctx, x, y);
+            color->data[i].r = res[PLANE_R][p];
+            color->data[i].g = res[PLANE_G][p];
+            color->data[i].b = res[PLANE_B][p];
+        }
+
+    for (size_t i = 0; i < sizeof(planes) / sizeof(planes[0]); i++)
+        free(*planes[i]);
+}
@@ -0,0 +1,227 @@
+#include "exr.h"
+#include "utils/evect.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define EXR_MAGIC 20000630
+#define EXR_VERSION 2
+#define EXR_TILED_FLAG 0x200
+#define EXR_PIXEL_TYPE_HALF 1
+
+/*
+** Converts a single precision float to IEEE 754 half precision,
+** rounding to the nearest even value.
+*/
+static uint16_t half_from_float(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t exponent = (bits >> 23) & 0xff;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    // infinity and NaN
+    if (exponent == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+    int32_t half_exponent = (int32_t)exponent - 127 + 15;
+
+    // too large: round to infinity
+    if (half_exponent >= 0x1f)
+        return sign | 0x7c00;
+
+    // too small for a normal half: produce a subnormal, or zero
+    if (half_exponent <= 0)
+    {
+        if (half_exponent < -10)
+            return sign;
+
+        mantissa |= 0x800000;
+        uint32_t shift = 14 - half_exponent;
+        uint32_t half_mantissa = mantissa >> shift;
+        uint32_t rem = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (half_mantissa & 1)))
+            half_mantissa++;
+        return sign | half_mantissa;
+    }
+
+    // a carry out of the mantissa correctly bumps the exponent
+    uint32_t half = ((uint32_t)half_exponent << 10) | (mantissa >> 13);
+    uint32_t rem = mantissa & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1)))
+        half++;
+    return sign | half;
+}
+
+static void push_u8(struct evect *buf, uint8_t value)
+{
+    evect_push(buf, value);
+}
+
+static void push_u16(struct evect *buf, uint16_t value)
+{
+    push_u8(buf, value);
+    push_u8(buf, value >> 8);
+}
+
+static void push_u32(struct evect *buf, uint32_t value)
+{
+    push_u16(buf, value);
+    push_u16(buf, value >> 16);
+}
+
+static void push_u64(struct evect *buf, uint64_t value)
+{
+    push_u32(buf, value);
+    push_u32(buf, value >> 32);
+}
+
+static void push_f32(struct evect *buf, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    push_u32(buf, bits);
+}
+
+static void push_string(struct evect *buf, const char *str)
+{
+    evect_push_string(buf, str);
+    push_u8(buf, '\0');
+}
+
+static void push_attribute(struct evect *buf, const char *name,
+                           const char *type, uint32_t size)
+{
+    push_string(buf, name);
+    push_string(buf, type);
+    push_u32(buf, size);
+}
+
+static void push_header(struct evect *buf, const struct hdr_image *image)
+{
+    push_u32(buf, EXR_MAGIC);
+    push_u32(buf, EXR_VERSION | EXR_TILED_FLAG);
+
+    // channels must be sorted by name, and are stored in this order
+    const char *channels[] = {"B", "G", "R"};
+    push_attribute(buf, "channels", "chlist", 3 * (2 + 16) + 1);
+    for (size_t i = 0; i < 3; i++)
+    {
+        push_string(buf, channels[i]);
+        push_u32(buf, EXR_PIXEL_TYPE_HALF);
+        push_u32(buf, 0); // pLinear, then 3 reserved bytes
+        push_u32(buf, 1); // x sampling
+        push_u32(buf, 1); // y sampling
+    }
+    push_u8(buf, '\0');
+
+    push_attribute(buf, "compression", "compression", 1);
+    push_u8(buf, 0); // no compression
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        push_attribute(buf, i ? "displayWindow" : "dataWindow", "box2i", 16);
+        push_u32(buf, 0);
+        push_u32(buf, 0);
+        push_u32(buf, image->width - 1);
+        push_u32(buf, image->height - 1);
+    }
+
+    push_attribute(buf, "lineOrder", "lineOrder", 1);
+    push_u8(buf, 0); // increasing y
+
+    push_attribute(buf, "pixelAspectRatio", "float", 4);
+    push_f32(buf, 1.);
+
+    push_attribute(buf, "screenWindowCenter", "v2f", 8);
+    push_f32(buf, 0.);
+    push_f32(buf, 0.);
+
+    push_attribute(buf, "screenWindowWidth", "float", 4);
+    push_f32(buf, 1.);
+
+    push_attribute(buf, "tiles", "tiledesc", 9);
+    push_u32(buf, EXR_TILE_SIZE);
+    push_u32(buf, EXR_TILE_SIZE);
+    push_u8(buf, 0); // a single resolution level
+
+    // end of header
+    push_u8(buf, '\0');
+}
+
+static size_t tile_extent(size_t image_size, size_t tile_i)
+{
+    size_t start = tile_i * EXR_TILE_SIZE;
+    size_t rem = image_size - start;
+    return rem < EXR_TILE_SIZE ? rem : EXR_TILE_SIZE;
+}
+
+static void push_tile(struct evect *buf, const struct hdr_image *image,
+                      size_t tile_x, size_t tile_y)
+{
+    size_t width = tile_extent(image->width, tile_x);
+    size_t height = tile_extent(image->height, tile_y);
+
+    push_u32(buf, tile_x);
+    push_u32(buf, tile_y);
+    push_u32(buf, 0); // level x
+    push_u32(buf, 0); // level y
+    push_u32(buf, width * height * 3 * sizeof(uint16_t));
+
+    for (size_t line = 0; line < height; line++)
+    {
+        // exr images are stored from the top down
+        size_t exr_y = tile_y * EXR_TILE_SIZE + line;
+        const struct hdr_pixel *row
+            = &image->data[image->width * (image->height - 1 - exr_y)
+                           + tile_x * EXR_TILE_SIZE];
+
+        for (size_t x = 0; x < width; x++)
+            push_u16(buf, half_from_float(row[x].b));
+        for (size_t x = 0; x < width; x++)
+            push_u16(buf, half_from_float(row[x].g));
+        for (size_t x = 0; x < width; x++)
+            push_u16(buf, half_from_float(row[x].r));
+    }
+}
+
+int exr_write(const struct hdr_image *image, FILE *file)
+{
+    size_t tiles_x = (image->width + EXR_TILE_SIZE - 1) / EXR_TILE_SIZE;
+    size_t tiles_y = (image->height + EXR_TILE_SIZE - 1) / EXR_TILE_SIZE;
+
+    struct evect buf;
+    evect_init(&buf, 4096);
+
+    push_header(&buf, image);
+
+    // the offset table lists where each tile starts in the file
+    uint64_t offset = evect_size(&buf) + tiles_x * tiles_y * sizeof(uint64_t);
+    for (size_t tile_y = 0; tile_y < tiles_y; tile_y++)
+        for (size_t tile_x = 0; tile_x < tiles_x; tile_x++)
+        {
+            push_u64(&buf, offset);
+            size_t tile_size = tile_extent(image->width, tile_x)
+                               * tile_extent(image->height, tile_y);
+            offset += 5 * sizeof(uint32_t) + tile_size * 3 * sizeof(uint16_t);
+        }
+
+    int rc = 0;
+    for (size_t tile_y = 0; tile_y < tiles_y && rc == 0; tile_y++)
+        for (size_t tile_x = 0; tile_x < tiles_x && rc == 0; tile_x++)
+        {
+            push_tile(&buf, image, tile_x, tile_y);
+
+            // flush each tile to keep the staging buffer small
+            size_t size = evect_size(&buf);
+            if (fwrite(evect_data(&buf), 1, size, file) != size)
+                rc = -1;
+            evect_reset(&buf);
+        }
+
+    evect_destroy(&buf);
+    return rc;
+}
@@ -0,0 +1,720 @@
+#include "glb_loader.h"
+#include "color.h"
+#include "json.h"
+#include "mesh.h"
+#include "mesh_loader.h"
+#include "transform.h"
+#include "utils/alloc.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define GLB_MAGIC 0x46546c67 // "glTF"
+#define GLB_VERSION 2
+#define GLB_CHUNK_JSON 0x4e4f534a
+#define GLB_CHUNK_BIN 0x004e4942
+
+#define GLTF_MODE_TRIANGLES 4
+#define GLTF_UNSIGNED_BYTE 5121
+#define GLTF_UNSIGNED_SHORT 5123
+#define GLTF_UNSIGNED_INT 5125
+#define GLTF_FLOAT 5126
+
+// nodes nested deeper than this are left out, which also breaks cycles
+#define GLTF_MAX_DEPTH 64
+
+struct glb_file
+{
+    const char *filename;
+    int fd;
+    const unsigned char *data;
+    size_t size;
+    struct json_value *json;
+    // the offset and size of the binary chunk in the file
+    size_t bin_offset;
+    size_t bin_size;
+
+    // one per glTF material, and one for primitives without a material
+    size_t material_count;
+    struct material **materials;
+    // one per glTF mesh, loaded when a node first references it
+    size_t mesh_count;
+    struct mesh **meshes;
+    bool *mesh_loaded;
+};
+
+/*
+** Where the elements of an accessor are in the file.
+*/
+struct glb_accessor
+{
+    size_t offset;
+    size_t count;
+    size_t stride;
+    size_t component_type;
+};
+
+struct glb_primitive
+{
+    size_t position_index;
+    struct glb_accessor positions;
+    bool indexed;
+    struct glb_accessor indices;
+    size_t material;
+};
+
+static bool host_is_little_endian(void)
+{
+    uint16_t one = 1;
+    unsigned char first;
+    memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+static uint32_t read_u32(const unsigned char *p)
+{
+    uint32_t res;
+    memcpy(&res, p, sizeof(res));
+    return res;
+}
+
+static size_t component_size(size_t component_type)
+{
+    switch (component_type)
+    {
+    case GLTF_UNSIGNED_BYTE:
+        return 1;
+    case GLTF_UNSIGNED_SHORT:
+        return 2;
+    case GLTF_UNSIGNED_INT:
+    case GLTF_FLOAT:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+static bool json_is_string(const struct json_value *value, const char *str)
+{
+    return value && value->type == JSON_STRING
+           && strcmp(value->string, str) == 0;
+}
+
+/*
+** Locates an accessor of the binary chunk, and checks that all its elements
+** are inside their buffer view. Sparse accessors aren't supported.
+*/
+static bool glb_accessor(struct glb_accessor *res, const struct glb_file *file,
+                         size_t index, const char *type, size_t components)
+{
+    const struct json_value *accessor
+        = json_at(json_get(file->json, "accessors"), index);
+    size_t view_index;
+    if (accessor == NULL || json_get(accessor, "sparse")
+        || !json_is_string(json_get(accessor, "type"), type)
+        || !json_index(&view_index, json_get(accessor, "bufferView"))
+        || !json_index(&res->count, json_get(accessor, "count"))
+        || !json_index(&res->component_type,
+                       json_get(accessor, "componentType")))
+        return false;
+
+    const struct json_value *view
+        = json_at(json_get(file->json, "bufferViews"), view_index);
+    size_t buffer = 0;
+    size_t view_offset = 0;
+    size_t view_size;
+    size_t offset = 0;
+    if (view == NULL
+        || (json_get(view, "buffer")
+            && !json_index(&buffer, json_get(view, "buffer")))
+        || (json_get(view, "byteOffset")
+            && !json_index(&view_offset, json_get(view, "byteOffset")))
+        || !json_index(&view_size, json_get(view, "byteLength"))
+        || (json_get(accessor, "byteOffset")
+            && !json_index(&offset, json_get(accessor, "byteOffset"))))
+        return false;
+
+    // only the first buffer can be the binary chunk
+    const struct json_value *buffer_desc
+        = json_at(json_get(file->json, "buffers"), buffer);
+    if (buffer != 0 || buffer_desc == NULL || json_get(buffer_desc, "uri")
+        || view_offset > file->bin_size
+        || view_size > file->bin_size - view_offset)
+        return false;
+
+    size_t element_size = component_size(res->component_type) * components;
+    res->stride = element_size;
+    if (json_get(view, "byteStride")
+        && !json_index(&res->stride, json_get(view, "byteStride")))
+        return false;
+    if (element_size == 0 || res->stride < element_size)
+        return false;
+
+    // the last element must end inside the view
+    if (res->count
+        && (offset > view_size || view_size - offset < element_size
+            || (view_size - offset - element_size) / res->stride
+                   < res->count - 1))
+        return false;
+    res->offset = file->bin_offset + view_offset + offset;
+    return true;
+}
+
+static uint32_t glb_read_index(const struct glb_file *file,
+                               const struct glb_accessor *accessor, size_t i)
+{
+    const unsigned char *p
+        = file->data + accessor->offset + i * accessor->stride;
+    switch (accessor->component_type)
+    {
+    case GLTF_UNSIGNED_BYTE:
+        return *p;
+    case GLTF_UNSIGNED_SHORT:
+    {
+        uint16_t res;
+        memcpy(&res, p, sizeof(res));
+        return res;
+    }
+    default:
+        return read_u32(p);
+    }
+}
+
+/*
+** Whether the elements of an accessor are packed, aligned, and of the type
+** meshes store, so that they can be used in place.
+*/
+static bool glb_accessor_in_place(const struct glb_accessor *accessor,
+                                  size_t component_type, size_t components)
+{
+    return accessor->component_type == component_type
+           && accessor->stride == 4 * components && accessor->offset % 4 == 0;
+}
+
+static bool glb_parse_primitive(struct glb_primitive *res,
+                                const struct glb_file *file,
+                                const struct json_value *primitive)
+{
+    size_t mode = GLTF_MODE_TRIANGLES;
+    if (json_get(primitive, "mode")
+        && (!json_index(&mode, json_get(primitive, "mode"))
+            || mode != GLTF_MODE_TRIANGLES))
+    {
+        warnx("%s: only triangle primitives are supported", file->filename);
+        return false;
+    }
+
+    const struct json_value *attributes = json_get(primitive, "attributes");
+    if (!json_index(&res->position_index, json_get(attributes, "POSITION"))
+        || !glb_accessor(&res->positions, file, res->position_index, "VEC3",
+                         3)
+        || res->positions.component_type != GLTF_FLOAT)
+        goto invalid;
+
+    const struct json_value *indices = json_get(primitive, "indices");
+    res->indexed = indices != NULL;
+    size_t index;
+    if (res->indexed
+        && (!json_index(&index, indices)
+            || !glb_accessor(&res->indices, file, index, "SCALAR", 1)
+            || res->indices.component_type == GLTF_FLOAT))
+        goto invalid;
+
+    // the last material is the default one
+    res->material = file->material_count - 1;
+    if (json_get(primitive, "material")
+        && (!json_index(&res->material, json_get(primitive, "material"))
+            || res->material >= file->material_count - 1))
+        goto invalid;
+    return true;
+
+invalid:
+    warnx("%s: invalid primitive", file->filename);
+    return false;
+}
+
+/*
+** Maps the part of the file between two offsets for a mesh to use in place,
+** and returns where the mapping starts in the file.
+*/
+static unsigned char *glb_map_range(size_t *map_offset, size_t *map_size,
+                                    const struct glb_file *file, size_t start,
+                                    size_t end)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    *map_offset = start - start % page_size;
+    *map_size = end - *map_offset;
+    // the mapping is private and writable, so that the mesh can still be
+    // animated without touching the file
+    void *mapping = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                         file->fd, *map_offset);
+    return mapping == MAP_FAILED ? NULL : mapping;
+}
+
+/*
+** Vertices are used in place when all primitives share the same packed
+** positions, and so are indices when there's a single primitive with packed
+** 32 bit indices. Everything else is copied.
+*/
+static struct mesh *glb_build_mesh(struct glb_file *file,
+                                   const struct glb_primitive *primitives,
+                                   size_t primitive_count)
+{
+    bool shared_positions = true;
+    size_t vertex_count = 0;
+    size_t face_count = 0;
+    for (size_t i = 0; i < primitive_count; i++)
+    {
+        const struct glb_primitive *primitive = &primitives[i];
+        if (primitive->position_index != primitives[0].position_index)
+            shared_positions = false;
+        vertex_count += primitive->positions.count;
+        size_t corners = primitive->indexed ? primitive->indices.count
+                                            : primitive->positions.count;
+        face_count += corners / 3;
+    }
+    if (shared_positions)
+        vertex_count = primitives[0].positions.count;
+    if (vertex_count > UINT32_MAX || face_count == 0)
+        return NULL;
+
+    const struct glb_accessor *positions = &primitives[0].positions;
+    const struct glb_accessor *indices = &primitives[0].indices;
+    bool vertices_in_place
+        = shared_positions
+          && glb_accessor_in_place(positions, GLTF_FLOAT, 3);
+    bool faces_in_place
+        = primitive_count == 1 && primitives[0].indexed
+          && indices->count % 3 == 0
+          && glb_accessor_in_place(indices, GLTF_UNSIGNED_INT, 1);
+
+    // all indices are checked, even the ones used in place
+    for (size_t i = 0; i < primitive_count; i++)
+    {
+        const struct glb_primitive *primitive = &primitives[i];
+        for (size_t k = 0; primitive->indexed && k < primitive->indices.count;
+             k++)
+            if (glb_read_index(file, &primitive->indices, k)
+                >= primitive->positions.count)
+            {
+                warnx("%s: vertex index out of range", file->filename);
+                return NULL;
+            }
+    }
+
+    struct mesh *mesh = mesh_create();
+    float *vertices = NULL;
+    uint32_t *faces = NULL;
+    if (vertices_in_place || faces_in_place)
+    {
+        size_t start = SIZE_MAX;
+        size_t end = 0;
+        if (vertices_in_place)
+        {
+            start = positions->offset;
+            end = positions->offset + 3 * sizeof(float) * vertex_count;
+        }
+        if (faces_in_place)
+        {
+            size_t faces_end
+                = indices->offset + sizeof(uint32_t) * indices->count;
+            start = indices->offset < start ? indices->offset : start;
+            end = faces_end > end ? faces_end : end;
+        }
+
+        size_t map_offset;
+        size_t map_size;
+        unsigned char *mapping
+            = glb_map_range(&map_offset, &map_size, file, start, end);
+        if (mapping)
+        {
+            mesh_set_mapping(mesh, mapping, map_size);
+            if (vertices_in_place)
+                vertices = (float *)(mapping + positions->offset - map_offset);
+            if (faces_in_place)
+                faces = (uint32_t *)(mapping + indices->offset - map_offset);
+        }
+    }
+
+    if (vertices == NULL)
+    {
+        vertices = xcalloc(3 * vertex_count, sizeof(*vertices));
+        float *dst = vertices;
+        for (size_t i = 0; i < (shared_positions ? 1 : primitive_count); i++)
+        {
+            const struct glb_accessor *src = &primitives[i].positions;
+            for (size_t k = 0; k < src->count; k++, dst += 3)
+                memcpy(dst, file->data + src->offset + k * src->stride,
+                       3 * sizeof(*dst));
+        }
+    }
+
+    uint32_t *face_materials = xcalloc(face_count, sizeof(*face_materials));
+    // the index of glTF materials in the mesh material table
+    uint32_t *mesh_materials
+        = xalloc(file->material_count * sizeof(*mesh_materials));
+    for (size_t i = 0; i < file->material_count; i++)
+        mesh_materials[i] = UINT32_MAX;
+
+    if (faces == NULL)
+        faces = xcalloc(3 * face_count, sizeof(*faces));
+    size_t face_i = 0;
+    size_t base = 0;
+    for (size_t i = 0; i < primitive_count; i++)
+    {
+        const struct glb_primitive *primitive = &primitives[i];
+        size_t material = primitive->material;
+        if (mesh_materials[material] == UINT32_MAX)
+            mesh_materials[material]
+                = mesh_add_material(mesh, file->materials[material]);
+
+        size_t corners = primitive->indexed ? primitive->indices.count
+                                            : primitive->positions.count;
+        for (size_t k = 0; k + 3 <= corners; k += 3, face_i++)
+        {
+            face_materials[face_i] = mesh_materials[material];
+            if (faces_in_place && mesh->mapping)
+                continue;
+            for (size_t c = 0; c < 3; c++)
+            {
+                uint32_t index = k + c;
+                if (primitive->indexed)
+                    index = glb_read_index(file, &primitive->indices, k + c);
+                faces[3 * face_i + c] = base + index;
+            }
+        }
+        if (!shared_positions)
+            base += primitive->positions.count;
+    }
+    free(mesh_materials);
+
+    mesh_set_geometry(mesh, vertices, vertex_count, faces, face_materials,
+                      face_count);
+    return mesh;
+}
+
+/*
+** Loads a glTF mesh from its primitives, and builds its acceleration
+** structure. Returns NULL if it has no triangles.
+*/
+static struct mesh *glb_load_mesh(struct scene *scene, struct glb_file *file,
+                                  size_t index)
+{
+    const struct json_value *primitives
+        = json_get(json_at(json_get(file->json, "meshes"), index),
+                   "primitives");
+    if (primitives == NULL || primitives->type != JSON_ARRAY)
+        return NULL;
+
+    struct glb_primitive *parsed
+        = xcalloc(primitives->count, sizeof(*parsed));
+    size_t count = 0;
+    bool double_sided = false;
+    for (size_t i = 0; i < primitives->count; i++)
+    {
+        if (!glb_parse_primitive(&parsed[count], file, &primitives->items[i]))
+            continue;
+
+        const struct json_value *material = json_at(
+            json_get(file->json, "materials"), parsed[count].material);
+        const struct json_value *sides = json_get(material, "doubleSided");
+        if (sides && sides->type == JSON_BOOL && sides->boolean)
+            double_sided = true;
+        count++;
+    }
+
+    struct mesh *mesh = NULL;
+    if (count)
+        mesh = glb_build_mesh(file, parsed, count);
+    free(parsed);
+    if (mesh == NULL)
+        return NULL;
+
+    // each mesh of the file gets its own cache file
+    size_t name_size = strlen(file->filename) + 32;
+    char *name = xalloc(name_size);
+    snprintf(name, name_size, "%s.%zu", file->filename, index);
+    mesh_loader_build(scene, mesh, name);
+    free(name);
+
+    if (double_sided)
+        mesh->cull = CULL_NONE;
+    return mesh;
+}
+
+/*
+** Converts a glTF material. glTF colors are linear, and get gamma encoded
+** the way OBJ colors are. Smooth metals reflect their base color.
+*/
+static struct material *glb_material(struct scene *scene,
+                                     const struct json_value *material)
+{
+    const struct json_value *pbr = json_get(material, "pbrMetallicRoughness");
+    const struct json_value *base_color = json_get(pbr, "baseColorFactor");
+    float color[3];
+    float diffuse[3];
+    for (size_t i = 0; i < 3; i++)
+    {
+        color[i] = json_number(json_at(base_color, i), 1);
+        diffuse[i] = pow(color[i], 1 / GAMMA_COEFF);
+    }
+
+    struct material *res = mesh_loader_material(scene, diffuse);
+    double metallic = json_number(json_get(pbr, "metallicFactor"), 1);
+    double roughness = json_number(json_get(pbr, "roughnessFactor"), 1);
+    double mirror = metallic * (1 - roughness);
+    res->reflectance = (struct vec3){color[0] * mirror, color[1] * mirror,
+                                     color[2] * mirror};
+    return res;
+}
+
+/*
+** Computes the transform of a node relative to its parent, from either its
+** column major matrix, or its translation, rotation and scale.
+*/
+static void glb_node_transform(struct transform *res,
+                               const struct json_value *node)
+{
+    const struct json_value *matrix = json_get(node, "matrix");
+    if (matrix)
+    {
+        for (size_t row = 0; row < 3; row++)
+            for (size_t col = 0; col < 4; col++)
+                res->m[row][col] = json_number(json_at(matrix, col * 4 + row),
+                                               row == col);
+        return;
+    }
+
+    const struct json_value *translation = json_get(node, "translation");
+    const struct json_value *rotation = json_get(node, "rotation");
+    const struct json_value *scale = json_get(node, "scale");
+    double x = json_number(json_at(rotation, 0), 0);
+    double y = json_number(json_at(rotation, 1), 0);
+    double z = json_number(json_at(rotation, 2), 0);
+    double w = json_number(json_at(rotation, 3), 1);
+    double rot[3][3] = {
+        {1 - 2 * (y * y + z * z), 2 * (x * y - z * w), 2 * (x * z + y * w)},
+        {2 * (x * y + z * w), 1 - 2 * (x * x + z * z), 2 * (y * z - x * w)},
+        {2 * (x * z - y * w), 2 * (y * z + x * w), 1 - 2 * (x * x + y * y)},
+    };
+    for (size_t row = 0; row < 3; row++)
+    {
+        for (size_t col = 0; col < 3; col++)
+            res->m[row][col]
+                = rot[row][col] * json_number(json_at(scale, col), 1);
+        res->m[row][3] = json_number(json_at(translation, row), 0);
+    }
+}
+
+static void glb_add_node(struct scene *scene, struct glb_file *file,
+                         size_t index, const struct transform *parent,
+                         size_t depth)
+{
+    const struct json_value *node
+        = json_at(json_get(file->json, "nodes"), index);
+    if (node == NULL || depth == GLTF_MAX_DEPTH)
+    {
+        warnx("%s: invalid node %zu", file->filename, index);
+        return;
+    }
+
+    struct transform local;
+    struct transform to_world;
+    glb_node_transform(&local, node);
+    transform_compose(&to_world, parent, &local);
+
+    size_t mesh_index;
+    if (json_index(&mesh_index, json_get(node, "mesh"))
+        && mesh_index < file->mesh_count)
+    {
+        if (!file->mesh_loaded[mesh_index])
+        {
+            file->meshes[mesh_index] = glb_load_mesh(scene, file, mesh_index);
+            file->mesh_loaded[mesh_index] = true;
+        }
+
+        struct mesh *mesh = file->meshes[mesh_index];
+        if (mesh && mesh_loader_add_instance(scene, mesh, &to_world))
+            warnx("%s: node %zu can't be inverted", file->filename, index);
+    }
+
+    const struct json_value *children = json_get(node, "children");
+    for (size_t i = 0; children && i < children->count; i++)
+    {
+        size_t child;
+        if (json_index(&child, json_at(children, i)))
+            glb_add_node(scene, file, child, &to_world, depth + 1);
+    }
+}
+
+/*
+** Adds the nodes of the default scene, or of the first one. Files without
+** scenes get all the nodes which aren't the child of another.
+*/
+static void glb_add_scene(struct scene *scene, struct glb_file *file)
+{
+    struct transform identity;
+    transform_identity(&identity);
+
+    const struct json_value *scenes = json_get(file->json, "scenes");
+    if (scenes && scenes->type == JSON_ARRAY && scenes->count)
+    {
+        size_t scene_index = 0;
+        if (!json_index(&scene_index, json_get(file->json, "scene")))
+            scene_index = 0;
+        const struct json_value *nodes
+            = json_get(json_at(scenes, scene_index), "nodes");
+        for (size_t i = 0; nodes && i < nodes->count; i++)
+        {
+            size_t node;
+            if (json_index(&node, json_at(nodes, i)))
+                glb_add_node(scene, file, node, &identity, 0);
+        }
+        return;
+    }
+
+    const struct json_value *nodes = json_get(file->json, "nodes");
+    if (nodes == NULL || nodes->type != JSON_ARRAY)
+        return;
+
+    bool *is_child = xcalloc(nodes->count, sizeof(*is_child));
+    for (size_t i = 0; i < nodes->count; i++)
+    {
+        const struct json_value *children
+            = json_get(&nodes->items[i], "children");
+        for (size_t k = 0; children && k < children->count; k++)
+        {
+            size_t child;
+            if (json_index(&child, json_at(children, k))
+                && child < nodes->count)
+                is_child[child] = true;
+        }
+    }
+    for (size_t i = 0; i < nodes->count; i++)
+        if (!is_child[i])
+            glb_add_node(scene, file, i, &identity, 0);
+    free(is_child);
+}
+
+/*
+** Checks the header of the file, and finds its JSON and binary chunks.
+*/
+static int glb_parse_chunks(struct glb_file *file)
+{
+    const unsigned char *data = file->data;
+    if (file->size < 20 || read_u32(data) != GLB_MAGIC
+        || read_u32(data + 4) != GLB_VERSION
+        || read_u32(data + 8) > file->size)
+        goto invalid;
+
+    // the length in the header covers the file header and the JSON chunk
+    // header, and the JSON chunk has to end within it
+    size_t size = read_u32(data + 8);
+    if (size < 20)
+        goto invalid;
+    size_t json_size = read_u32(data + 12);
+    if (read_u32(data + 16) != GLB_CHUNK_JSON || json_size > size - 20)
+        goto invalid;
+
+    file->json = json_parse((const char *)data + 20, json_size);
+    if (file->json == NULL)
+        goto invalid;
+
+    // the binary chunk is optional, and follows the JSON one. as the JSON
+    // chunk ends within the file, size - bin_header can't wrap around
+    size_t bin_header = 20 + json_size;
+    file->bin_offset = bin_header + 8;
+    file->bin_size = 0;
+    if (size - bin_header >= 8
+        && read_u32(data + bin_header + 4) == GLB_CHUNK_BIN)
+    {
+        file->bin_size = read_u32(data + bin_header);
+        if (file->bin_size > size - file->bin_offset)
+            goto invalid;
+    }
+    return 0;
+
+invalid:
+    warnx("%s: invalid glb file", file->filename);
+    return -1;
+}
+
+int load_glb(struct scene *scene, const char *filename)
+{
+    if (!host_is_little_endian())
+    {
+        warnx("%s: glb files can only be loaded on little endian machines",
+              filename);
+        return -1;
+    }
+
+    struct glb_file file = {.filename = filename};
+    file.fd = open(filename, O_RDONLY);
+    if (file.fd == -1)
+    {
+        warn("failed to open %s", filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(file.fd, &st) == -1 || st.st_size == 0)
+    {
+        warnx("%s: invalid glb file", filename);
+        close(file.fd);
+        return -1;
+    }
+
+    file.size = st.st_size;
+    void *mapping = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        warn("failed to map %s", filename);
+        close(file.fd);
+        return -1;
+    }
+    file.data = mapping;
+
+    int rc = glb_parse_chunks(&file);
+    if (rc == 0)
+    {
+        const struct json_value *materials = json_get(file.json, "materials");
+        size_t gltf_materials = materials ? materials->count : 0;
+        file.material_count = gltf_materials + 1;
+        file.materials
+            = xcalloc(file.material_count, sizeof(*file.materials));
+        for (size_t i = 0; i < gltf_materials; i++)
+            file.materials[i] = glb_material(scene, &materials->items[i]);
+        file.materials[gltf_materials] = glb_material(scene, NULL);
+
+        const struct json_value *meshes = json_get(file.json, "meshes");
+        file.mesh_count = meshes ? meshes->count : 0;
+        file.meshes = xcalloc(file.mesh_count, sizeof(*file.meshes));
+        file.mesh_loaded = xcalloc(file.mesh_count, sizeof(*file.mesh_loaded));
+
+        glb_add_scene(scene, &file);
+
+        // instances hold their own references
+        for (size_t i = 0; i < file.mesh_count; i++)
+            if (file.meshes[i])
+                mesh_put(file.meshes[i]);
+        for (size_t i = 0; i < file.material_count; i++)
+            material_put(file.materials[i]);
+        free(file.meshes);
+        free(file.mesh_loaded);
+        free(file.materials);
+        json_free(file.json);
+    }
+
+    munmap(mapping, file.size);
+    close(file.fd);
+    return rc;
+}
@@ -0,0 +1,262 @@
+#include "grid.h"
+#include "utils/alloc.h"
+#include "utils/parallel.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// the number of cells per primitive the grid aims for
+#define GRID_CELLS_PER_PRIM 2.
+
+// the maximum number of cells along an axis
+#define GRID_MAX_RES 1024
+
+// cells are never smaller than this fraction of the mean primitive extent,
+// which bounds the number of cells each primitive overlaps
+#define GRID_MIN_CELL_EXTENT 0.5
+
+// grids aren't worth it for fewer primitives
+#define GRID_MIN_PRIMS 256
+
+// primitives can be at most this many times larger than the mean
+#define GRID_MAX_SIZE_RATIO 4.
+
+// the minimum fraction of cells holding a primitive center. for uniformly
+// spread primitives, it's about 1 - exp(-1 / GRID_CELLS_PER_PRIM)
+#define GRID_MIN_OCCUPANCY 0.15
+
+// the minimum number of primitives or cells processed by a build thread
+#define GRID_BUILD_GRAIN 4096
+
+struct prim_stats
+{
+    struct aabb box;
+    double mean_extent;
+    double max_extent;
+};
+
+static double box_extent(const struct aabb *box)
+{
+    struct vec3 d = vec3_sub(&box->max, &box->min);
+    return fmax(d.x, fmax(d.y, d.z));
+}
+
+static void prim_stats(struct prim_stats *stats, const struct aabb *prim_bounds,
+                       size_t count)
+{
+    aabb_init(&stats->box);
+    double sum = 0;
+    stats->max_extent = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        aabb_extend(&stats->box, &prim_bounds[i]);
+        double extent = box_extent(&prim_bounds[i]);
+        sum += extent;
+        if (extent > stats->max_extent)
+            stats->max_extent = extent;
+    }
+    stats->mean_extent = count ? sum / count : 0;
+}
+
+/*
+** Sizes the cells so that there are about GRID_CELLS_PER_PRIM cells per
+** primitive, with roughly cubic cells.
+*/
+static void grid_setup(struct grid *grid, const struct prim_stats *stats,
+                       size_t count)
+{
+    grid->box = stats->box;
+    struct vec3 d = vec3_sub(&grid->box.max, &grid->box.min);
+    double extent[3] = {d.x, d.y, d.z};
+
+    // flat scenes still get a thin slab of cells
+    double max_extent = box_extent(&grid->box);
+    double min_extent = max_extent * 1e-3;
+    double volume = 1;
+    for (size_t i = 0; i < 3; i++)
+        volume *= fmax(extent[i], min_extent);
+
+    double cell_extent = cbrt(volume / (GRID_CELLS_PER_PRIM * count));
+    if (cell_extent < GRID_MIN_CELL_EXTENT * stats->mean_extent)
+        cell_extent = GRID_MIN_CELL_EXTENT * stats->mean_extent;
+
+    for (size_t i = 0; i < 3; i++)
+    {
+        double res = cell_extent > 0 ? ceil(extent[i] / cell_extent) : 1;
+        if (!(res >= 1))
+            res = 1;
+        if (res > GRID_MAX_RES)
+            res = GRID_MAX_RES;
+
+        grid->res[i] = res;
+        grid->cell_size[i] = extent[i] / grid->res[i];
+        grid->inv_cell_size[i]
+            = extent[i] > 0 ? grid->res[i] / extent[i] : 0;
+    }
+}
+
+static size_t grid_cell_count(const struct grid *grid)
+{
+    return grid->res[0] * grid->res[1] * grid->res[2];
+}
+
+bool grid_suits(const struct aabb *prim_bounds, size_t count)
+{
+    if (count < GRID_MIN_PRIMS)
+        return false;
+
+    struct prim_stats stats;
+    prim_stats(&stats, prim_bounds, count);
+    if (stats.max_extent > GRID_MAX_SIZE_RATIO * stats.mean_extent)
+        return false;
+
+    // clustered primitives leave most cells empty, which rays then have to
+    // step through
+    struct grid grid;
+    grid_init(&grid);
+    grid_setup(&grid, &stats, count);
+
+    size_t cell_count = grid_cell_count(&grid);
+    unsigned char *occupied = xcalloc(cell_count, 1);
+    size_t occupied_count = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        struct vec3 center = aabb_center(&prim_bounds[i]);
+        size_t cell[3];
+        for (int axis = 0; axis < 3; axis++)
+            cell[axis] = grid_cell_coord(&grid, axis, vec3_axis(&center, axis));
+
+        size_t cell_i = grid_cell_index(&grid, cell);
+        occupied_count += !occupied[cell_i];
+        occupied[cell_i] = 1;
+    }
+    free(occupied);
+
+    return occupied_count >= GRID_MIN_OCCUPANCY * cell_count;
+}
+
+struct build_ctx
+{
+    struct grid *grid;
+    const struct aabb *prim_bounds;
+    // the number of references per cell, then where the next reference of
+    // each cell goes
+    uint32_t *counters;
+};
+
+// finds the range of cells a box overlaps, bounds included
+static void box_cells(size_t lo[3], size_t hi[3], const struct grid *grid,
+                      const struct aabb *box)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        lo[axis] = grid_cell_coord(grid, axis, vec3_axis(&box->min, axis));
+        hi[axis] = grid_cell_coord(grid, axis, vec3_axis(&box->max, axis));
+    }
+}
+
+/*
+** Runs through the cells overlapped by some primitives. The references
+** are counted in the first pass, and stored in the second one.
+*/
+static void scatter_range(struct build_ctx *ctx, size_t begin, size_t end,
+                          bool store)
+{
+    struct grid *grid = ctx->grid;
+    for (size_t prim = begin; prim < end; prim++)
+    {
+        size_t lo[3];
+        size_t hi[3];
+        box_cells(lo, hi, grid, &ctx->prim_bounds[prim]);
+
+        size_t cell[3];
+        for (cell[2] = lo[2]; cell[2] <= hi[2]; cell[2]++)
+            for (cell[1] = lo[1]; cell[1] <= hi[1]; cell[1]++)
+                for (cell[0] = lo[0]; cell[0] <= hi[0]; cell[0]++)
+                {
+                    uint32_t *counter
+                        = &ctx->counters[grid_cell_index(grid, cell)];
+                    uint32_t slot
+                        = __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+                    if (store)
+                        grid->prims[slot] = prim;
+                }
+    }
+}
+
+static void count_range(void *ctx, size_t begin, size_t end)
+{
+    scatter_range(ctx, begin, end, false);
+}
+
+static void store_range(void *ctx, size_t begin, size_t end)
+{
+    scatter_range(ctx, begin, end, true);
+}
+
+/*
+** References are stored in cells in whatever order threads got there:
+** sort them back, so that ties between primitives are always broken
+** the same way.
+*/
+static void sort_range(void *ctx, size_t begin, size_t end)
+{
+    struct grid *grid = ((struct build_ctx *)ctx)->grid;
+    for (size_t cell = begin; cell < end; cell++)
+    {
+        uint32_t *prims = &grid->prims[grid->cells[cell]];
+        size_t count = grid->cells[cell + 1] - grid->cells[cell];
+        for (size_t i = 1; i < count; i++)
+        {
+            uint32_t prim = prims[i];
+            size_t k = i;
+            for (; k > 0 && prims[k - 1] > prim; k--)
+                prims[k] = prims[k - 1];
+            prims[k] = prim;
+        }
+    }
+}
+
+void grid_build(struct grid *grid, const struct aabb *prim_bounds,
+                size_t count)
+{
+    grid_destroy(grid);
+    grid_init(grid);
+    if (count == 0)
+        return;
+
+    struct prim_stats stats;
+    prim_stats(&stats, prim_bounds, count);
+    grid_setup(grid, &stats, count);
+
+    size_t cell_count = grid_cell_count(grid);
+    struct build_ctx ctx = {
+        .grid = grid,
+        .prim_bounds = prim_bounds,
+        .counters = xcalloc(cell_count, sizeof(*ctx.counters)),
+    };
+    parallel_for(count, GRID_BUILD_GRAIN, count_range, &ctx);
+
+    // turn counts into offsets, and counters into insertion cursors
+    grid->cells = xalloc((cell_count + 1) * sizeof(*grid->cells));
+    uint32_t offset = 0;
+    for (size_t i = 0; i < cell_count; i++)
+    {
+        grid->cells[i] = offset;
+        offset += ctx.counters[i];
+        ctx.counters[i] = grid->cells[i];
+    }
+    grid->cells[cell_count] = offset;
+
+    grid->prim_count = offset;
+    grid->prims = xalloc(offset * sizeof(*grid->prims));
+    parallel_for(count, GRID_BUILD_GRAIN, store_range, &ctx);
+    parallel_for(cell_count, GRID_BUILD_GRAIN, sort_range, &ctx);
+    free(ctx.counters);
+}
+
+void grid_destroy(struct grid *grid)
+{
+    free(grid->cells);
+    free(grid->prims);
+}
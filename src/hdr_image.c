@@ -0,0 +1,34 @@
+#include "hdr_image.h"
+#include "color.h"
+
+#include <assert.h>
+
+struct hdr_image *hdr_image_alloc(size_t width, size_t height)
+{
+    size_t alloc_size = sizeof(struct hdr_image);
+    alloc_size += sizeof(struct hdr_pixel) * width * height;
+
+    struct hdr_image *res = xalloc(alloc_size);
+    res->width = width;
+    res->height = height;
+    return res;
+}
+
+void hdr_image_clear(struct hdr_image *image, const struct vec3 *light)
+{
+    for (size_t y = 0; y < image->height; y++)
+        for (size_t x = 0; x < image->width; x++)
+            hdr_image_set(image, x, y, light);
+}
+
+void hdr_image_quantize(struct rgb_image *dst, const struct hdr_image *src)
+{
+    assert(dst->width == src->width && dst->height == src->height);
+
+    for (size_t y = 0; y < src->height; y++)
+        for (size_t x = 0; x < src->width; x++)
+        {
+            struct vec3 light = hdr_image_get(src, x, y);
+            rgb_image_set(dst, x, y, rgb_color_from_light(&light));
+        }
+}
@@ -0,0 +1,65 @@
+#include "instance.h"
+#include "utils/alloc.h"
+
+#include <stdlib.h>
+
+double object_instance_ray_intersect(struct object_hit *hit,
+                                     const struct object *obj,
+                                     const struct ray *ray)
+{
+    const struct instance *inst = (const struct instance *)obj;
+    // the direction isn't normalized, so that distances along the ray
+    // are the same in both spaces
+    struct ray mesh_ray = {
+        .source = transform_point(&inst->to_mesh, &ray->source),
+        .direction = transform_vector(&inst->to_mesh, &ray->direction),
+        .tmin = ray->tmin,
+        .tmax = ray->tmax,
+    };
+    return mesh_intersect(hit, inst->mesh, &mesh_ray);
+}
+
+void instance_finalize_hit(struct object_intersection *inter,
+                           const struct object_hit *hit,
+                           const struct ray *ray, double dist)
+{
+    const struct instance *inst = (const struct instance *)hit->object;
+    mesh_finalize_hit(inter, inst->mesh, hit);
+
+    // bring the intersection back into world space
+    inter->location.point = ray_point(ray, dist);
+    inter->location.normal
+        = transform_normal(&inst->to_mesh, &inter->location.normal);
+    vec3_normalize(&inter->location.normal);
+}
+
+void instance_bounds(struct aabb *box, const struct object *obj)
+{
+    const struct instance *inst = (const struct instance *)obj;
+    struct aabb mesh_box;
+    mesh_bounds(&mesh_box, inst->mesh);
+    transform_aabb(box, &inst->to_world, &mesh_box);
+}
+
+void instance_free(struct object *obj)
+{
+    struct instance *inst = (struct instance *)obj;
+    mesh_put(inst->mesh);
+    free(inst);
+}
+
+struct instance *instance_create(struct mesh *mesh,
+                                 const struct transform *to_world)
+{
+    struct transform to_mesh;
+    if (transform_inverse(&to_mesh, to_world))
+        return NULL;
+
+    struct instance *inst = zalloc(sizeof(*inst));
+    object_init(&inst->base, object_instance_ray_intersect,
+                instance_finalize_hit, instance_bounds, instance_free);
+    inst->mesh = mesh_get(mesh);
+    inst->to_world = *to_world;
+    inst->to_mesh = to_mesh;
+    return inst;
+}
@@ -0,0 +1,350 @@
+#include "json.h"
+#include "utils/alloc.h"
+#include "utils/evect.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// deeper documents are rejected, instead of overflowing the stack
+#define JSON_MAX_DEPTH 64
+
+struct json_parser
+{
+    const char *pos;
+    const char *end;
+    size_t depth;
+};
+
+static void json_destroy(struct json_value *value)
+{
+    free(value->string);
+    for (size_t i = 0; i < value->count; i++)
+    {
+        json_destroy(&value->items[i]);
+        if (value->keys)
+            free(value->keys[i]);
+    }
+    free(value->items);
+    free(value->keys);
+}
+
+static void skip_whitespace(struct json_parser *parser)
+{
+    while (parser->pos < parser->end
+           && (*parser->pos == ' ' || *parser->pos == '\t'
+               || *parser->pos == '\n' || *parser->pos == '\r'))
+        parser->pos++;
+}
+
+// consumes c, if it's the next character
+static bool accept(struct json_parser *parser, char c)
+{
+    skip_whitespace(parser);
+    if (parser->pos == parser->end || *parser->pos != c)
+        return false;
+    parser->pos++;
+    return true;
+}
+
+static bool accept_word(struct json_parser *parser, const char *word)
+{
+    size_t len = strlen(word);
+    if ((size_t)(parser->end - parser->pos) < len
+        || memcmp(parser->pos, word, len) != 0)
+        return false;
+    parser->pos += len;
+    return true;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static bool parse_hex4(struct json_parser *parser, uint32_t *res)
+{
+    if (parser->end - parser->pos < 4)
+        return false;
+
+    *res = 0;
+    for (size_t i = 0; i < 4; i++)
+    {
+        int digit = hex_digit(*parser->pos++);
+        if (digit < 0)
+            return false;
+        *res = *res << 4 | digit;
+    }
+    return true;
+}
+
+static void push_utf8(struct evect *res, uint32_t code)
+{
+    if (code < 0x80)
+        evect_push(res, code);
+    else if (code < 0x800)
+    {
+        evect_push(res, 0xc0 | code >> 6);
+        evect_push(res, 0x80 | (code & 0x3f));
+    }
+    else if (code < 0x10000)
+    {
+        evect_push(res, 0xe0 | code >> 12);
+        evect_push(res, 0x80 | (code >> 6 & 0x3f));
+        evect_push(res, 0x80 | (code & 0x3f));
+    }
+    else
+    {
+        evect_push(res, 0xf0 | code >> 18);
+        evect_push(res, 0x80 | (code >> 12 & 0x3f));
+        evect_push(res, 0x80 | (code >> 6 & 0x3f));
+        evect_push(res, 0x80 | (code & 0x3f));
+    }
+}
+
+static bool parse_escape(struct json_parser *parser, struct evect *res)
+{
+    if (parser->pos == parser->end)
+        return false;
+
+    char c = *parser->pos++;
+    static const char escapes[] = "\"\"\\\\//b\bf\fn\nr\rt\t";
+    for (size_t i = 0; escapes[i]; i += 2)
+        if (escapes[i] == c)
+        {
+            evect_push(res, escapes[i + 1]);
+            return true;
+        }
+
+    uint32_t code;
+    if (c != 'u' || !parse_hex4(parser, &code))
+        return false;
+
+    // characters outside of the basic plane are escaped as surrogate pairs
+    if (code >= 0xd800 && code < 0xdc00)
+    {
+        uint32_t low;
+        if (!accept_word(parser, "\\u") || !parse_hex4(parser, &low)
+            || low < 0xdc00 || low >= 0xe000)
+            return false;
+        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+    }
+    else if (code >= 0xdc00 && code < 0xe000)
+        return false;
+
+    push_utf8(res, code);
+    return true;
+}
+
+// parses a string, once its opening quote is consumed
+static char *parse_string(struct json_parser *parser)
+{
+    struct evect res;
+    evect_init(&res, 16);
+    while (true)
+    {
+        if (parser->pos == parser->end
+            || (unsigned char)*parser->pos < 0x20)
+            goto fail;
+
+        char c = *parser->pos++;
+        if (c == '"')
+            break;
+        if (c != '\\')
+            evect_push(&res, c);
+        else if (!parse_escape(parser, &res))
+            goto fail;
+    }
+
+    evect_finalize(&res);
+    return evect_data(&res);
+
+fail:
+    evect_destroy(&res);
+    return NULL;
+}
+
+static bool parse_number(struct json_parser *parser, double *res)
+{
+    // numbers are copied, as strtod needs them NUL terminated
+    const char *start = parser->pos;
+    const char *p = start;
+    while (p < parser->end && p - start < 64 && strchr("+-.eE0123456789", *p))
+        p++;
+
+    char buf[65];
+    size_t len = p - start;
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+
+    char *num_end;
+    *res = strtod(buf, &num_end);
+    if (len == 0 || num_end != buf + len || !isfinite(*res))
+        return false;
+    parser->pos = p;
+    return true;
+}
+
+// appends an uninitialized item to an array or object
+static struct json_value *push_item(struct json_value *value, size_t *capacity)
+{
+    if (value->count == *capacity)
+    {
+        *capacity = *capacity ? 2 * *capacity : 4;
+        value->items
+            = xrealloc(value->items, *capacity * sizeof(*value->items));
+        if (value->type == JSON_OBJECT)
+            value->keys
+                = xrealloc(value->keys, *capacity * sizeof(*value->keys));
+    }
+    return &value->items[value->count];
+}
+
+static bool parse_value(struct json_parser *parser, struct json_value *value);
+
+static bool parse_array(struct json_parser *parser, struct json_value *value)
+{
+    value->type = JSON_ARRAY;
+    if (accept(parser, ']'))
+        return true;
+
+    size_t capacity = 0;
+    do
+    {
+        struct json_value *item = push_item(value, &capacity);
+        value->count++;
+        if (!parse_value(parser, item))
+            return false;
+    } while (accept(parser, ','));
+    return accept(parser, ']');
+}
+
+static bool parse_object(struct json_parser *parser, struct json_value *value)
+{
+    value->type = JSON_OBJECT;
+    if (accept(parser, '}'))
+        return true;
+
+    size_t capacity = 0;
+    do
+    {
+        struct json_value *item = push_item(value, &capacity);
+        *item = (struct json_value){.type = JSON_NULL};
+        char **key = &value->keys[value->count++];
+        *key = NULL;
+        if (!accept(parser, '"') || (*key = parse_string(parser)) == NULL
+            || !accept(parser, ':') || !parse_value(parser, item))
+            return false;
+    } while (accept(parser, ','));
+    return accept(parser, '}');
+}
+
+/*
+** Parses a value into value. Items are counted as soon as they are added,
+** so that json_destroy can release what was parsed even on failure.
+*/
+static bool parse_value(struct json_parser *parser, struct json_value *value)
+{
+    *value = (struct json_value){.type = JSON_NULL};
+    skip_whitespace(parser);
+    if (parser->pos == parser->end || parser->depth == JSON_MAX_DEPTH)
+        return false;
+
+    bool ok;
+    parser->depth++;
+    switch (*parser->pos++)
+    {
+    case '{':
+        ok = parse_object(parser, value);
+        break;
+    case '[':
+        ok = parse_array(parser, value);
+        break;
+    case '"':
+        value->type = JSON_STRING;
+        ok = (value->string = parse_string(parser)) != NULL;
+        break;
+    case 't':
+        value->type = JSON_BOOL;
+        value->boolean = true;
+        ok = accept_word(parser, "rue");
+        break;
+    case 'f':
+        value->type = JSON_BOOL;
+        ok = accept_word(parser, "alse");
+        break;
+    case 'n':
+        ok = accept_word(parser, "ull");
+        break;
+    default:
+        parser->pos--;
+        value->type = JSON_NUMBER;
+        ok = parse_number(parser, &value->number);
+        break;
+    }
+    parser->depth--;
+    return ok;
+}
+
+struct json_value *json_parse(const char *text, size_t size)
+{
+    struct json_parser parser = {.pos = text, .end = text + size};
+    struct json_value *res = xalloc(sizeof(*res));
+    bool ok = parse_value(&parser, res);
+    skip_whitespace(&parser);
+    if (ok && parser.pos == parser.end)
+        return res;
+
+    json_free(res);
+    return NULL;
+}
+
+void json_free(struct json_value *value)
+{
+    json_destroy(value);
+    free(value);
+}
+
+const struct json_value *json_get(const struct json_value *value,
+                                  const char *key)
+{
+    if (value == NULL || value->type != JSON_OBJECT)
+        return NULL;
+
+    for (size_t i = 0; i < value->count; i++)
+        if (strcmp(value->keys[i], key) == 0)
+            return &value->items[i];
+    return NULL;
+}
+
+const struct json_value *json_at(const struct json_value *value, size_t i)
+{
+    if (value == NULL || value->type != JSON_ARRAY || i >= value->count)
+        return NULL;
+    return &value->items[i];
+}
+
+double json_number(const struct json_value *value, double def)
+{
+    if (value == NULL || value->type != JSON_NUMBER)
+        return def;
+    return value->number;
+}
+
+bool json_index(size_t *res, const struct json_value *value)
+{
+    if (value == NULL || value->type != JSON_NUMBER || value->number < 0
+        || value->number >= (double)SIZE_MAX
+        || value->number != floor(value->number))
+        return false;
+
+    *res = value->number;
+    return true;
+}
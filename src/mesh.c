@@ -0,0 +1,436 @@
+#include "mesh.h"
+#include "bvh_cache.h"
+#include "triangle.h"
+#include "utils/alloc.h"
+#include "utils/hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+** A ray traced through a mesh, with what intersection tests need to know
+** about it.
+*/
+struct mesh_ray
+{
+    const struct mesh *mesh;
+    struct triangle_ray tray;
+};
+
+static inline double mesh_face_intersect(struct object_hit *hit,
+                                         const struct mesh_ray *mray,
+                                         uint32_t face, const struct ray *ray,
+                                         enum cull_mode cull)
+{
+    const struct mesh *mesh = mray->mesh;
+    const uint32_t *idx = &mesh->faces[3 * (size_t)face];
+    struct vec3 v0 = mesh_vertex(mesh, idx[0]);
+    struct vec3 v1 = mesh_vertex(mesh, idx[1]);
+    struct vec3 v2 = mesh_vertex(mesh, idx[2]);
+
+    hit->prim = face;
+    return triangle_ray_intersect(hit, &v0, &v1, &v2, ray, &mray->tray, cull);
+}
+
+#define MESH_TRAVERSE_CULL CULL_NONE
+#define MESH_TRAVERSE_FACE mesh_face_intersect_cull_none
+#define MESH_TRAVERSE_BVH mesh_traverse_cull_none
+#define MESH_TRAVERSE_QBVH mesh_traverse_compressed_cull_none
+#include "mesh_traverse.defs"
+#undef MESH_TRAVERSE_CULL
+#undef MESH_TRAVERSE_FACE
+#undef MESH_TRAVERSE_BVH
+#undef MESH_TRAVERSE_QBVH
+
+#define MESH_TRAVERSE_CULL CULL_BACK
+#define MESH_TRAVERSE_FACE mesh_face_intersect_cull_back
+#define MESH_TRAVERSE_BVH mesh_traverse_cull_back
+#define MESH_TRAVERSE_QBVH mesh_traverse_compressed_cull_back
+#include "mesh_traverse.defs"
+#undef MESH_TRAVERSE_CULL
+#undef MESH_TRAVERSE_FACE
+#undef MESH_TRAVERSE_BVH
+#undef MESH_TRAVERSE_QBVH
+
+#define MESH_TRAVERSE_CULL CULL_FRONT
+#define MESH_TRAVERSE_FACE mesh_face_intersect_cull_front
+#define MESH_TRAVERSE_BVH mesh_traverse_cull_front
+#define MESH_TRAVERSE_QBVH mesh_traverse_compressed_cull_front
+#include "mesh_traverse.defs"
+#undef MESH_TRAVERSE_CULL
+#undef MESH_TRAVERSE_FACE
+#undef MESH_TRAVERSE_BVH
+#undef MESH_TRAVERSE_QBVH
+
+// frees a geometry array, unless it lives in the file mapping of the mesh
+static void mesh_free_array(const struct mesh *mesh, void *array)
+{
+    const char *start = mesh->mapping;
+    if (start && (const char *)array >= start
+        && (const char *)array < start + mesh->mapping_size)
+        return;
+
+    free(array);
+}
+
+static void mesh_free(struct mesh *mesh)
+{
+    for (size_t i = 0; i < mesh->material_count; i++)
+        material_put(mesh->materials[i]);
+    free(mesh->materials);
+
+    mesh_free_array(mesh, mesh->vertices);
+    mesh_free_array(mesh, mesh->faces);
+    mesh_free_array(mesh, mesh->face_materials);
+    free(mesh->vertex_remap);
+    if (mesh->mapping)
+        munmap(mesh->mapping, mesh->mapping_size);
+    bvh_destroy(&mesh->bvh);
+    qbvh_destroy(&mesh->qbvh);
+    free(mesh);
+}
+
+struct mesh *mesh_create(void)
+{
+    struct mesh *mesh = zalloc(sizeof(*mesh));
+    // this cast is safe as refcnt is the first field of mesh
+    ref_init(&mesh->refcnt, (refcnt_free_f)mesh_free);
+    bvh_init(&mesh->bvh);
+    qbvh_init(&mesh->qbvh);
+    mesh->bvh_params = (struct bvh_params)BVH_PARAMS_DEFAULT;
+    mesh->cull = CULL_BACK;
+    return mesh;
+}
+
+void mesh_set_geometry(struct mesh *mesh, float *vertices, size_t vertex_count,
+                       uint32_t *faces, uint32_t *face_materials,
+                       size_t face_count)
+{
+    mesh_free_array(mesh, mesh->vertices);
+    mesh_free_array(mesh, mesh->faces);
+    mesh_free_array(mesh, mesh->face_materials);
+
+    mesh->vertices = vertices;
+    mesh->vertex_count = vertex_count;
+    mesh->faces = faces;
+    mesh->face_materials = face_materials;
+    mesh->face_count = face_count;
+}
+
+void mesh_set_mapping(struct mesh *mesh, void *mapping, size_t mapping_size)
+{
+    mesh->mapping = mapping;
+    mesh->mapping_size = mapping_size;
+}
+
+uint32_t mesh_add_material(struct mesh *mesh, struct material *mat)
+{
+    size_t count = mesh->material_count + 1;
+    mesh->materials = xrealloc(mesh->materials, count * sizeof(mat));
+    mesh->materials[mesh->material_count] = material_get(mat);
+    return mesh->material_count++;
+}
+
+static void mesh_face_bounds(struct aabb *box, const void *ctx, uint32_t face)
+{
+    const struct mesh *mesh = ctx;
+    aabb_init(box);
+    for (size_t i = 0; i < 3; i++)
+    {
+        struct vec3 v = mesh_vertex(mesh, mesh->faces[3 * (size_t)face + i]);
+        aabb_extend_point(box, &v);
+    }
+}
+
+/*
+** Computes the bounds of the parts of a face on each side of a plane,
+** by walking along its edges.
+*/
+static void mesh_face_split(struct aabb *left, struct aabb *right,
+                            const void *ctx, uint32_t face, int axis,
+                            double pos)
+{
+    const struct mesh *mesh = ctx;
+    const uint32_t *idx = &mesh->faces[3 * (size_t)face];
+
+    aabb_init(left);
+    aabb_init(right);
+    for (size_t i = 0; i < 3; i++)
+    {
+        struct vec3 v0 = mesh_vertex(mesh, idx[i]);
+        struct vec3 v1 = mesh_vertex(mesh, idx[(i + 1) % 3]);
+        double p0 = vec3_axis(&v0, axis);
+        double p1 = vec3_axis(&v1, axis);
+
+        if (p0 <= pos)
+            aabb_extend_point(left, &v0);
+        if (p0 >= pos)
+            aabb_extend_point(right, &v0);
+
+        // the edge crosses the plane: both sides get the crossing point
+        if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos))
+        {
+            struct vec3 edge = vec3_sub(&v1, &v0);
+            struct vec3 offset = vec3_mul(&edge, (pos - p0) / (p1 - p0));
+            struct vec3 crossing = vec3_add(&v0, &offset);
+            aabb_extend_point(left, &crossing);
+            aabb_extend_point(right, &crossing);
+        }
+    }
+}
+
+/*
+** Moves face i to new_ids[i]. The arrays of the mesh are kept, so that faces
+** which live in a file mapping stay there. Faces are scattered to a scratch
+** buffer and copied back, as the writes of a scatter don't depend on each
+** other, unlike a walk along the cycles of the permutation.
+*/
+static void mesh_permute_faces(struct mesh *mesh, const uint32_t *new_ids)
+{
+    size_t face_count = mesh->face_count;
+    uint32_t *faces = xalloc(3 * face_count * sizeof(*faces));
+    for (size_t i = 0; i < face_count; i++)
+        memcpy(&faces[3 * (size_t)new_ids[i]], &mesh->faces[3 * i],
+               3 * sizeof(*faces));
+    memcpy(mesh->faces, faces, 3 * face_count * sizeof(*faces));
+
+    uint32_t *face_materials = faces;
+    for (size_t i = 0; i < face_count; i++)
+        face_materials[new_ids[i]] = mesh->face_materials[i];
+    memcpy(mesh->face_materials, face_materials,
+           face_count * sizeof(*face_materials));
+    free(faces);
+}
+
+/*
+** Renumbers faces in the order leaves reference them, so that faces hit
+** by the same rays share cache lines. Faces are moved within their arrays,
+** which may live in a file mapping. Leaf references are updated.
+** Returns how faces were renumbered, as mesh_permute_faces expects it.
+*/
+static uint32_t *mesh_reorder_faces(struct mesh *mesh)
+{
+    struct bvh *bvh = &mesh->bvh;
+    size_t face_count = mesh->face_count;
+    uint32_t *new_ids = xalloc(face_count * sizeof(*new_ids));
+    for (size_t i = 0; i < face_count; i++)
+        new_ids[i] = UINT32_MAX;
+
+    // faces referenced by multiple leaves go with the first one
+    uint32_t next_id = 0;
+    for (size_t i = 0; i < bvh->prim_count; i++)
+        if (new_ids[bvh->prims[i]] == UINT32_MAX)
+            new_ids[bvh->prims[i]] = next_id++;
+    for (size_t i = 0; i < face_count; i++)
+        if (new_ids[i] == UINT32_MAX)
+            new_ids[i] = next_id++;
+
+    mesh_permute_faces(mesh, new_ids);
+    for (size_t i = 0; i < bvh->prim_count; i++)
+        bvh->prims[i] = new_ids[bvh->prims[i]];
+    return new_ids;
+}
+
+static bool mesh_should_compress(const struct mesh *mesh)
+{
+    return mesh->face_count >= mesh->bvh_params.compress_threshold;
+}
+
+// compresses the tree of large meshes, once it is built
+static void mesh_compress(struct mesh *mesh)
+{
+    mesh->compressed = mesh_should_compress(mesh);
+    if (!mesh->compressed)
+    {
+        qbvh_destroy(&mesh->qbvh);
+        qbvh_init(&mesh->qbvh);
+        return;
+    }
+
+    qbvh_build(&mesh->qbvh, &mesh->bvh);
+    bvh_drop_nodes(&mesh->bvh);
+}
+
+/*
+** Builds the tree, renumbers faces to follow it, and compresses it.
+** Returns how faces were renumbered.
+*/
+static uint32_t *mesh_build_tree(struct mesh *mesh)
+{
+    struct aabb *face_bounds = xcalloc(mesh->face_count, sizeof(*face_bounds));
+    for (size_t i = 0; i < mesh->face_count; i++)
+        mesh_face_bounds(&face_bounds[i], mesh, i);
+
+    bvh_build_spatial(&mesh->bvh, face_bounds, mesh->face_count,
+                      &mesh->bvh_params, mesh_face_split, mesh);
+    free(face_bounds);
+
+    uint32_t *new_ids = mesh_reorder_faces(mesh);
+    mesh_compress(mesh);
+    return new_ids;
+}
+
+void mesh_build(struct mesh *mesh)
+{
+    free(mesh_build_tree(mesh));
+}
+
+uint64_t mesh_cache_key(const struct mesh *mesh)
+{
+    uint64_t counts[2] = {mesh->vertex_count, mesh->face_count};
+    uint64_t key = HASH_FNV1A_INIT;
+    key = hash_fnv1a(key, counts, sizeof(counts));
+    key = hash_fnv1a(key, mesh->vertices,
+                     3 * mesh->vertex_count * sizeof(*mesh->vertices));
+    key = hash_fnv1a(key, mesh->faces,
+                     3 * mesh->face_count * sizeof(*mesh->faces));
+
+    // hash build parameters field by field, to skip padding
+    const struct bvh_params *params = &mesh->bvh_params;
+    uint8_t spatial_splits = params->spatial_splits;
+    key = hash_fnv1a(key, &spatial_splits, sizeof(spatial_splits));
+    key = hash_fnv1a(key, &params->spatial_budget,
+                     sizeof(params->spatial_budget));
+    uint8_t compressed = mesh_should_compress(mesh);
+    key = hash_fnv1a(key, &compressed, sizeof(compressed));
+    return key;
+}
+
+void mesh_build_cached(struct mesh *mesh, uint64_t key, const char *path)
+{
+    // the cache holds the final tree, and how faces were renumbered to
+    // follow it: only the renumbering is applied to the loaded faces
+    bool compressed = mesh_should_compress(mesh);
+    const uint32_t *cached_ids;
+    if (bvh_cache_load(&mesh->bvh, compressed ? &mesh->qbvh : NULL,
+                       &cached_ids, path, key, mesh->face_count)
+        == 0)
+    {
+        mesh->compressed = compressed;
+        mesh_permute_faces(mesh, cached_ids);
+        return;
+    }
+
+    uint32_t *new_ids = mesh_build_tree(mesh);
+    bvh_cache_store(&mesh->bvh, mesh->compressed ? &mesh->qbvh : NULL,
+                    new_ids, mesh->face_count, path, key);
+    free(new_ids);
+}
+
+void mesh_remap_vertices(struct mesh *mesh, uint32_t *remap, size_t count)
+{
+    if (mesh->vertex_remap == NULL)
+    {
+        mesh->loaded_vertex_count = count;
+        mesh->vertex_remap = remap;
+        return;
+    }
+
+    // loaded vertices go through both renumberings
+    for (size_t i = 0; i < mesh->loaded_vertex_count; i++)
+        if (mesh->vertex_remap[i] != UINT32_MAX)
+            mesh->vertex_remap[i] = remap[mesh->vertex_remap[i]];
+    free(remap);
+}
+
+void mesh_set_vertices(struct mesh *mesh, const float *vertices)
+{
+    if (mesh->vertex_remap == NULL)
+    {
+        memcpy(mesh->vertices, vertices,
+               3 * mesh->vertex_count * sizeof(*mesh->vertices));
+        return;
+    }
+
+    for (size_t i = 0; i < mesh->loaded_vertex_count; i++)
+        if (mesh->vertex_remap[i] != UINT32_MAX)
+            memcpy(&mesh->vertices[3 * (size_t)mesh->vertex_remap[i]],
+                   &vertices[3 * i], 3 * sizeof(*vertices));
+}
+
+void mesh_get_vertices(const struct mesh *mesh, float *vertices)
+{
+    if (mesh->vertex_remap == NULL)
+    {
+        memcpy(vertices, mesh->vertices,
+               3 * mesh->vertex_count * sizeof(*mesh->vertices));
+        return;
+    }
+
+    for (size_t i = 0; i < mesh->loaded_vertex_count; i++)
+    {
+        static const float origin[3] = {0};
+        uint32_t id = mesh->vertex_remap[i];
+        memcpy(&vertices[3 * i],
+               id == UINT32_MAX ? origin : &mesh->vertices[3 * (size_t)id],
+               3 * sizeof(*vertices));
+    }
+}
+
+bool mesh_refit(struct mesh *mesh)
+{
+    // compressed nodes are quantized relative to their parent, and can't be
+    // refitted in place
+    if (mesh->compressed)
+    {
+        mesh_build(mesh);
+        return true;
+    }
+
+    double degradation = bvh_refit(&mesh->bvh, mesh_face_bounds, mesh);
+    if (degradation <= BVH_REFIT_MAX_DEGRADATION)
+        return false;
+
+    mesh_build(mesh);
+    return true;
+}
+
+void mesh_bounds(struct aabb *box, const struct mesh *mesh)
+{
+    aabb_init(box);
+    if (mesh->compressed)
+        *box = mesh->qbvh.root_box;
+    else if (mesh->bvh.node_count)
+        bvh_node_get_bounds(box, &mesh->bvh.nodes[0]);
+}
+
+double mesh_intersect(struct object_hit *hit, const struct mesh *mesh,
+                      const struct ray *ray)
+{
+    struct mesh_ray mray = {.mesh = mesh};
+    triangle_ray_init(&mray.tray, ray);
+
+    const struct qbvh *qbvh = &mesh->qbvh;
+    const uint32_t *prims = mesh->bvh.prims;
+    switch (mesh->cull)
+    {
+    case CULL_NONE:
+        if (mesh->compressed)
+            return mesh_traverse_compressed_cull_none(hit, qbvh, prims,
+                                                      &mray, ray);
+        return mesh_traverse_cull_none(hit, &mesh->bvh, &mray, ray);
+    case CULL_FRONT:
+        if (mesh->compressed)
+            return mesh_traverse_compressed_cull_front(hit, qbvh, prims,
+                                                       &mray, ray);
+        return mesh_traverse_cull_front(hit, &mesh->bvh, &mray, ray);
+    case CULL_BACK:
+    default:
+        if (mesh->compressed)
+            return mesh_traverse_compressed_cull_back(hit, qbvh, prims,
+                                                      &mray, ray);
+        return mesh_traverse_cull_back(hit, &mesh->bvh, &mray, ray);
+    }
+}
+
+void mesh_finalize_hit(struct object_intersection *inter,
+                       const struct mesh *mesh, const struct object_hit *hit)
+{
+    const uint32_t *idx = &mesh->faces[3 * (size_t)hit->prim];
+    struct vec3 v0 = mesh_vertex(mesh, idx[0]);
+    struct vec3 v1 = mesh_vertex(mesh, idx[1]);
+    struct vec3 v2 = mesh_vertex(mesh, idx[2]);
+    inter->location.normal = triangle_normal(&v0, &v1, &v2, hit->back);
+    inter->material = mesh->materials[mesh->face_materials[hit->prim]];
+}
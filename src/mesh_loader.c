@@ -0,0 +1,66 @@
+#include "mesh_loader.h"
+#include "bvh_cache.h"
+#include "color.h"
+#include "instance.h"
+#include "mesh_optimize.h"
+#include "phong_material.h"
+#include "utils/alloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct material *mesh_loader_material(struct scene *scene,
+                                      const float diffuse[3])
+{
+    struct phong_material *material = zalloc(sizeof(*material));
+    phong_material_init(material);
+    material->diffuse_Kn = 0.2;
+    material->spec_n = 10;
+    material->spec_Ks = 0.2;
+    material->ambient_intensity = 0.01;
+    material->surface_color = light_from_rgb_color(
+        diffuse[0] * 255, diffuse[1] * 255, diffuse[2] * 255);
+    scene_add_material(scene, &material->base);
+    return &material->base;
+}
+
+void mesh_loader_build(struct scene *scene, struct mesh *mesh,
+                       const char *filename)
+{
+    if (scene->mesh_optimize)
+    {
+        struct mesh_optimize_stats stats;
+        mesh_optimize(mesh, &stats);
+        fprintf(stderr,
+                "%s: removed %zu vertices (%zu welded, %zu unused) and %zu "
+                "faces (%zu degenerate, %zu duplicate)\n",
+                filename, stats.welded_vertices + stats.unused_vertices,
+                stats.welded_vertices, stats.unused_vertices,
+                stats.degenerate_faces + stats.duplicate_faces,
+                stats.degenerate_faces, stats.duplicate_faces);
+    }
+
+    mesh->bvh_params = scene->mesh_bvh_params;
+    mesh->cull = scene->mesh_cull;
+    if (!scene->mesh_bvh_cache)
+    {
+        mesh_build(mesh);
+        return;
+    }
+
+    uint64_t key = mesh_cache_key(mesh);
+    char *cache_path = bvh_cache_path(scene->mesh_bvh_cache_dir, filename, key);
+    mesh_build_cached(mesh, key, cache_path);
+    free(cache_path);
+}
+
+int mesh_loader_add_instance(struct scene *scene, struct mesh *mesh,
+                             const struct transform *to_world)
+{
+    struct instance *inst = instance_create(mesh, to_world);
+    if (inst == NULL)
+        return -1;
+
+    object_vect_push(&scene->objects, &inst->base);
+    return 0;
+}
@@ -0,0 +1,321 @@
+#include "mesh_optimize.h"
+#include "aabb.h"
+#include "utils/alloc.h"
+#include "utils/hash.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the number of bits of each coordinate in Morton codes
+#define MORTON_BITS 21
+#define MORTON_MAX ((1 << MORTON_BITS) - 1)
+
+/*
+** An open addressing hash table of indices, whose keys are stored
+** elsewhere. The capacity is a power of two, at least twice the number of
+** keys.
+*/
+struct index_table
+{
+    size_t mask;
+    uint32_t *slots;
+};
+
+static void index_table_init(struct index_table *table, size_t count)
+{
+    size_t capacity = 16;
+    while (capacity < 2 * count)
+        capacity *= 2;
+    table->mask = capacity - 1;
+    table->slots = xalloc(capacity * sizeof(*table->slots));
+    for (size_t i = 0; i < capacity; i++)
+        table->slots[i] = UINT32_MAX;
+}
+
+// -0 and 0 are the same position
+static uint32_t float_bits(float value)
+{
+    uint32_t res;
+    if (value == 0)
+        value = 0;
+    memcpy(&res, &value, sizeof(res));
+    return res;
+}
+
+static uint64_t vertex_hash(const float *vertex)
+{
+    uint32_t bits[3] = {float_bits(vertex[0]), float_bits(vertex[1]),
+                        float_bits(vertex[2])};
+    return hash_fnv1a(HASH_FNV1A_INIT, bits, sizeof(bits));
+}
+
+static bool vertex_equal(const float *a, const float *b)
+{
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+/*
+** Maps each vertex to the first vertex at the same position.
+** Returns the number of welded vertices.
+*/
+static size_t weld_vertices(uint32_t *remap, const struct mesh *mesh)
+{
+    struct index_table table;
+    index_table_init(&table, mesh->vertex_count);
+    size_t welded = 0;
+    for (size_t i = 0; i < mesh->vertex_count; i++)
+    {
+        const float *vertex = &mesh->vertices[3 * i];
+        size_t slot = vertex_hash(vertex) & table.mask;
+        while (table.slots[slot] != UINT32_MAX
+               && !vertex_equal(&mesh->vertices[3 * table.slots[slot]],
+                                vertex))
+            slot = (slot + 1) & table.mask;
+
+        if (table.slots[slot] == UINT32_MAX)
+        {
+            table.slots[slot] = i;
+            remap[i] = i;
+        }
+        else
+        {
+            remap[i] = table.slots[slot];
+            welded++;
+        }
+    }
+    free(table.slots);
+    return welded;
+}
+
+static bool face_degenerate(const struct mesh *mesh, const uint32_t *face)
+{
+    if (face[0] == face[1] || face[1] == face[2] || face[2] == face[0])
+        return true;
+
+    struct vec3 v0 = mesh_vertex(mesh, face[0]);
+    struct vec3 v1 = mesh_vertex(mesh, face[1]);
+    struct vec3 v2 = mesh_vertex(mesh, face[2]);
+    struct vec3 e1 = vec3_sub(&v1, &v0);
+    struct vec3 e2 = vec3_sub(&v2, &v0);
+    struct vec3 normal = vec3_cross(&e1, &e2);
+    return vec3_dot(&normal, &normal) == 0;
+}
+
+/*
+** Rotates the vertices of a face so that the smallest index comes first,
+** which keeps its winding. Faces with the same vertices in the same order
+** then compare equal.
+*/
+static void face_canonical(uint32_t res[3], const uint32_t *face)
+{
+    size_t first = 0;
+    if (face[1] < face[first])
+        first = 1;
+    if (face[2] < face[first])
+        first = 2;
+    for (size_t i = 0; i < 3; i++)
+        res[i] = face[(first + i) % 3];
+}
+
+/*
+** The faces left after welding and cleaning, before they get reordered.
+*/
+struct face_list
+{
+    size_t count;
+    uint32_t *faces;
+    uint32_t *face_materials;
+};
+
+/*
+** Welds the vertices of faces, and removes degenerate and duplicate faces.
+** Only the first of duplicate faces is kept, along with its material.
+*/
+static void clean_faces(struct face_list *res, const struct mesh *mesh,
+                        const uint32_t *remap,
+                        struct mesh_optimize_stats *stats)
+{
+    res->count = 0;
+    res->faces = xalloc(3 * mesh->face_count * sizeof(*res->faces));
+    res->face_materials
+        = xalloc(mesh->face_count * sizeof(*res->face_materials));
+
+    struct index_table table;
+    index_table_init(&table, mesh->face_count);
+    for (size_t i = 0; i < mesh->face_count; i++)
+    {
+        uint32_t face[3];
+        for (size_t k = 0; k < 3; k++)
+            face[k] = remap[mesh->faces[3 * i + k]];
+        if (face_degenerate(mesh, face))
+        {
+            stats->degenerate_faces++;
+            continue;
+        }
+
+        uint32_t key[3];
+        face_canonical(key, face);
+        size_t slot = hash_fnv1a(HASH_FNV1A_INIT, key, sizeof(key))
+                      & table.mask;
+        bool duplicate = false;
+        for (; table.slots[slot] != UINT32_MAX;
+             slot = (slot + 1) & table.mask)
+        {
+            uint32_t other[3];
+            face_canonical(other, &res->faces[3 * table.slots[slot]]);
+            if (memcmp(key, other, sizeof(key)) == 0)
+            {
+                duplicate = true;
+                break;
+            }
+        }
+        if (duplicate)
+        {
+            stats->duplicate_faces++;
+            continue;
+        }
+
+        table.slots[slot] = res->count;
+        memcpy(&res->faces[3 * res->count], face, sizeof(face));
+        res->face_materials[res->count] = mesh->face_materials[i];
+        res->count++;
+    }
+    free(table.slots);
+}
+
+// spreads the MORTON_BITS bits of x, two zero bits apart
+static uint64_t morton_spread(uint64_t x)
+{
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+struct face_key
+{
+    uint64_t code;
+    uint32_t face;
+};
+
+static int cmp_face_key(const void *a, const void *b)
+{
+    const struct face_key *key_a = a;
+    const struct face_key *key_b = b;
+    if (key_a->code != key_b->code)
+        return key_a->code < key_b->code ? -1 : 1;
+    return (key_a->face > key_b->face) - (key_a->face < key_b->face);
+}
+
+/*
+** Sorts faces by the Morton code of their center, in the bounds of the
+** mesh, then numbers vertices in the order faces use them. Unused vertices
+** are dropped. Returns the new index of each vertex, or UINT32_MAX for
+** dropped ones.
+*/
+static uint32_t *reorder(struct mesh *mesh, const struct face_list *list,
+                         struct mesh_optimize_stats *stats)
+{
+    size_t face_count = list->count;
+    struct aabb bounds;
+    aabb_init(&bounds);
+    for (size_t i = 0; i < 3 * face_count; i++)
+    {
+        struct vec3 v = mesh_vertex(mesh, list->faces[i]);
+        aabb_extend_point(&bounds, &v);
+    }
+
+    struct vec3 extent = vec3_sub(&bounds.max, &bounds.min);
+    double scale[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double size = vec3_axis(&extent, axis);
+        scale[axis] = size > 0 ? MORTON_MAX / size : 0;
+    }
+
+    struct face_key *keys = xalloc(face_count * sizeof(*keys));
+    for (size_t i = 0; i < face_count; i++)
+    {
+        const uint32_t *face = &list->faces[3 * i];
+        struct vec3 v0 = mesh_vertex(mesh, face[0]);
+        struct vec3 v1 = mesh_vertex(mesh, face[1]);
+        struct vec3 v2 = mesh_vertex(mesh, face[2]);
+        keys[i].code = 0;
+        keys[i].face = i;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            double center = (vec3_axis(&v0, axis) + vec3_axis(&v1, axis)
+                             + vec3_axis(&v2, axis))
+                            / 3;
+            double cell
+                = (center - vec3_axis(&bounds.min, axis)) * scale[axis];
+            // rounding may put centers slightly out of bounds
+            if (!(cell > 0))
+                cell = 0;
+            if (cell > MORTON_MAX)
+                cell = MORTON_MAX;
+            keys[i].code |= morton_spread((uint64_t)cell) << axis;
+        }
+    }
+    qsort(keys, face_count, sizeof(*keys), cmp_face_key);
+
+    uint32_t *new_ids = xalloc(mesh->vertex_count * sizeof(*new_ids));
+    for (size_t i = 0; i < mesh->vertex_count; i++)
+        new_ids[i] = UINT32_MAX;
+
+    uint32_t *faces = xalloc(3 * face_count * sizeof(*faces));
+    uint32_t *face_materials = xalloc(face_count * sizeof(*face_materials));
+    float *vertices = xalloc(3 * mesh->vertex_count * sizeof(*vertices));
+    uint32_t vertex_count = 0;
+    for (size_t i = 0; i < face_count; i++)
+    {
+        const uint32_t *face = &list->faces[3 * keys[i].face];
+        for (size_t k = 0; k < 3; k++)
+        {
+            uint32_t *id = &new_ids[face[k]];
+            if (*id == UINT32_MAX)
+            {
+                *id = vertex_count++;
+                memcpy(&vertices[3 * (size_t)*id], &mesh->vertices[3 * face[k]],
+                       3 * sizeof(*vertices));
+            }
+            faces[3 * i + k] = *id;
+        }
+        face_materials[i] = list->face_materials[keys[i].face];
+    }
+    free(keys);
+
+    stats->unused_vertices = mesh->vertex_count - vertex_count;
+    vertices = xrealloc(vertices, 3 * vertex_count * sizeof(*vertices));
+    mesh_set_geometry(mesh, vertices, vertex_count, faces, face_materials,
+                      face_count);
+    return new_ids;
+}
+
+void mesh_optimize(struct mesh *mesh, struct mesh_optimize_stats *stats)
+{
+    *stats = (struct mesh_optimize_stats){0};
+    uint32_t *remap = xalloc(mesh->vertex_count * sizeof(*remap));
+    stats->welded_vertices = weld_vertices(remap, mesh);
+
+    struct face_list list;
+    clean_faces(&list, mesh, remap, stats);
+
+    size_t vertex_count = mesh->vertex_count;
+    uint32_t *new_ids = reorder(mesh, &list, stats);
+    free(list.faces);
+    free(list.face_materials);
+
+    // keep track of where loaded vertices went, so that they can still be
+    // moved: welded vertices follow the vertex they were welded to
+    for (size_t i = 0; i < vertex_count; i++)
+        remap[i] = new_ids[remap[i]];
+    free(new_ids);
+    mesh_remap_vertices(mesh, remap, vertex_count);
+    // welded vertices aren't referenced anymore, and were counted as unused
+    stats->unused_vertices -= stats->welded_vertices;
+}
@@ -1,13 +1,20 @@
-#include "color.h"
+#include "mesh.h"
+#include "mesh_loader.h"
 #include "normal_material.h"
-#include "phong_material.h"
 #include "scene.h"
-#include "triangle.h"
 #include "utils/alloc.h"
 #include "utils/evect.h"
 
 #include <err.h>
 #include <libgen.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the size of the chunks the file is read in. Longer lines grow the buffer
+#define OBJ_CHUNK_SIZE ((size_t)1 << 20)
 
 #define TINYOBJ_LOADER_C_IMPLEMENTATION
 #include "tinyobj_loader_c.h"
@@ -77,85 +84,369 @@ static void get_file_data(const char *filename, const int is_mtl,
     *data = read_file(data_len, tmp);
 }
 
-#include "utils/pvect.h"
+/*
+** Only the illumination models with ray traced reflections (3 to 7) reflect,
+** by the specular color of the material.
+*/
+static struct vec3 mtl_reflectance(const tinyobj_material_t *mtl)
+{
+    if (mtl->illum < 3 || mtl->illum > 7)
+        return (struct vec3){0, 0, 0};
 
-#define GVECT_NAME phong_material_vect
-#define GVECT_TYPE struct phong_material *
-#include "utils/pvect_wrap.h"
-#undef GVECT_NAME
-#undef GVECT_TYPE
+    return (struct vec3){mtl->specular[0], mtl->specular[1],
+                         mtl->specular[2]};
+}
 
-int load_obj(struct scene *scene, const char *filename)
+/*
+** The state of the streaming parser. Vertices and faces go straight into
+** the arrays the mesh will own, which grow as lines are parsed.
+*/
+struct obj_parser
 {
-    tinyobj_attrib_t attrib;
-    tinyobj_shape_t *shapes = NULL;
-    size_t num_shapes;
-    tinyobj_material_t *materials = NULL;
-    size_t num_materials;
+    const char *filename;
+    size_t line;
+    // the scene materials are added to
+    struct scene *scene;
+    struct mesh *mesh;
 
-    int rc;
-    unsigned int flags = TINYOBJ_FLAG_TRIANGULATE;
+    size_t vertex_count;
+    size_t vertex_capacity;
+    float *vertices;
 
-    rc = tinyobj_parse_obj(&attrib, &shapes, &num_shapes, &materials,
-                           &num_materials, filename, get_file_data, flags);
-    if (rc != TINYOBJ_SUCCESS)
-        return -1;
+    size_t face_count;
+    size_t face_capacity;
+    uint32_t *faces;
+    uint32_t *face_materials;
+    // the largest vertex index faces reference, plus one
+    size_t index_end;
+
+    // the materials of the mtl library, which are added to the mesh in the
+    // same order, from material_base on
+    size_t material_count;
+    tinyobj_material_t *materials;
+    uint32_t material_base;
+    // the material of the faces being parsed, in the mesh material table
+    uint32_t current_material;
+    // the index of the default material in the mesh, once added
+    uint32_t default_material;
+};
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static char *skip_spaces(char *p)
+{
+    while (is_space(*p))
+        p++;
+    return p;
+}
 
-    struct phong_material_vect conv_materials;
-    phong_material_vect_init(&conv_materials, num_materials);
+// removes trailing spaces, and returns the string
+static char *trim_end(char *str)
+{
+    size_t len = strlen(str);
+    while (len && is_space(str[len - 1]))
+        str[--len] = '\0';
+    return str;
+}
+
+static int obj_parse_vertex(struct obj_parser *parser, char *p)
+{
+    if (parser->vertex_count == parser->vertex_capacity)
+    {
+        parser->vertex_capacity = 2 * parser->vertex_capacity + 1024;
+        parser->vertices
+            = xrealloc(parser->vertices, 3 * parser->vertex_capacity
+                                             * sizeof(*parser->vertices));
+    }
+
+    float *vertex = &parser->vertices[3 * parser->vertex_count];
+    for (size_t i = 0; i < 3; i++)
+    {
+        char *end;
+        vertex[i] = strtof(p, &end);
+        if (end == p)
+            return -1;
+        p = end;
+    }
+    parser->vertex_count++;
+    return 0;
+}
 
-    // convert materials
-    for (size_t i = 0; i < num_materials; i++)
+static void obj_push_face(struct obj_parser *parser, const uint32_t corners[3])
+{
+    if (parser->face_count == parser->face_capacity)
     {
-        struct phong_material *shape_material = zalloc(sizeof(*shape_material));
-        phong_material_init(shape_material);
-        shape_material->diffuse_Kn = 0.2;
-        shape_material->spec_n = 10;
-        shape_material->spec_Ks = 0.2;
-        shape_material->ambient_intensity = 0.01;
-        float *diff_color = materials[i].diffuse;
-        shape_material->surface_color = light_from_rgb_color(
-            diff_color[0] * 255, diff_color[1] * 255, diff_color[2] * 255);
-        phong_material_vect_push(&conv_materials, shape_material);
+        parser->face_capacity = 2 * parser->face_capacity + 1024;
+        parser->faces = xrealloc(parser->faces, 3 * parser->face_capacity
+                                                    * sizeof(*parser->faces));
+        parser->face_materials
+            = xrealloc(parser->face_materials,
+                       parser->face_capacity * sizeof(*parser->face_materials));
     }
 
-    // convert faces
-    for (size_t face_i = 0; face_i < attrib.num_face_num_verts; face_i++)
+    memcpy(&parser->faces[3 * parser->face_count], corners,
+           3 * sizeof(*corners));
+    parser->face_materials[parser->face_count] = parser->current_material;
+    parser->face_count++;
+}
+
+/*
+** Faces without a material, or with an unknown one, get a default material.
+*/
+static uint32_t obj_default_material(struct obj_parser *parser)
+{
+    if (parser->default_material != UINT32_MAX)
+        return parser->default_material;
+
+    static const float diffuse[3] = {0.8, 0.8, 0.8};
+    struct material *material = mesh_loader_material(parser->scene, diffuse);
+    parser->default_material = mesh_add_material(parser->mesh, material);
+    material_put(material);
+    return parser->default_material;
+}
+
+/*
+** Parses the corners of a polygon, and splits it into a fan of triangles.
+** Texture coordinate and normal indices are skipped.
+*/
+static int obj_parse_face(struct obj_parser *parser, char *p)
+{
+    if (parser->current_material == UINT32_MAX)
+        parser->current_material = obj_default_material(parser);
+
+    uint32_t corners[3];
+    size_t corner_count = 0;
+    for (p = skip_spaces(p); *p; p = skip_spaces(p))
     {
-        assert(attrib.face_num_verts[face_i] == 3);
-        int mat_id = attrib.material_ids[face_i];
-        struct phong_material *mat
-            = phong_material_vect_get(&conv_materials, mat_id);
+        char *end;
+        long index = strtol(p, &end, 10);
+        if (end == p)
+            return -1;
+        p = end;
+        while (*p && !is_space(*p))
+            p++;
 
-        size_t face_off = face_i * 3;
-        struct vec3 points[3];
+        // negative indices are relative to the last vertex
+        if (index < 0)
+            index += parser->vertex_count;
+        else
+            index--;
+        if (index < 0 || (unsigned long)index >= UINT32_MAX)
+            return -1;
+        if ((size_t)index >= parser->index_end)
+            parser->index_end = index + 1;
 
-        for (size_t node_i = 0; node_i < 3; node_i++)
+        if (corner_count < 3)
+            corners[corner_count] = index;
+        else
         {
-            tinyobj_vertex_index_t node_idx = attrib.faces[face_off + node_i];
-            size_t node_vertex_offset = 3 * node_idx.v_idx;
-            points[node_i].x = attrib.vertices[node_vertex_offset + 0];
-            points[node_i].y = attrib.vertices[node_vertex_offset + 1];
-            points[node_i].z = attrib.vertices[node_vertex_offset + 2];
+            corners[1] = corners[2];
+            corners[2] = index;
         }
+        if (++corner_count >= 3)
+            obj_push_face(parser, corners);
+    }
+    return 0;
+}
 
-        struct triangle *trian = triangle_create(points, &mat->base);
-        object_vect_push(&scene->objects, &trian->base);
+static void obj_use_material(struct obj_parser *parser, const char *name)
+{
+    for (size_t i = 0; i < parser->material_count; i++)
+        if (strcmp(parser->materials[i].name, name) == 0)
+        {
+            parser->current_material = parser->material_base + i;
+            return;
+        }
+
+    warnx("%s:%zu: unknown material %s", parser->filename, parser->line, name);
+    parser->current_material = obj_default_material(parser);
+}
+
+/*
+** Loads the materials of the mtl library, which must come before any
+** material is used.
+*/
+static void obj_load_mtl(struct obj_parser *parser, char *name)
+{
+    if (parser->materials)
+    {
+        warnx("%s:%zu: only the first mtllib is loaded", parser->filename,
+              parser->line);
+        return;
     }
 
-    // release the reference counter of materials
-    for (size_t i = 0; i < num_materials; i++)
+    if (tinyobj_parse_mtl_file(&parser->materials, &parser->material_count,
+                               name, parser->filename, get_file_data)
+        != TINYOBJ_SUCCESS)
     {
-        struct phong_material *mat
-            = phong_material_vect_get(&conv_materials, i);
-        material_put(&mat->base);
+        warnx("%s: failed to load the materials of %s", parser->filename,
+              name);
+        return;
     }
 
-    phong_material_vect_destroy(&conv_materials);
+    parser->material_base = parser->mesh->material_count;
+    for (size_t i = 0; i < parser->material_count; i++)
+    {
+        struct material *material
+            = mesh_loader_material(parser->scene,
+                                   parser->materials[i].diffuse);
+        material->reflectance = mtl_reflectance(&parser->materials[i]);
+        mesh_add_material(parser->mesh, material);
+        // release the reference to the material, which is now owned by the
+        // mesh
+        material_put(material);
+    }
+}
+
+static int obj_parse_line(struct obj_parser *parser, char *line)
+{
+    line = skip_spaces(line);
+    int rc = 0;
+    if (line[0] == 'v' && is_space(line[1]))
+        rc = obj_parse_vertex(parser, line + 2);
+    else if (line[0] == 'f' && is_space(line[1]))
+        rc = obj_parse_face(parser, line + 2);
+    else if (strncmp(line, "usemtl", 6) == 0 && is_space(line[6]))
+        obj_use_material(parser, trim_end(skip_spaces(line + 7)));
+    else if (strncmp(line, "mtllib", 6) == 0 && is_space(line[6]))
+        obj_load_mtl(parser, trim_end(skip_spaces(line + 7)));
+
+    if (rc)
+        warnx("%s:%zu: invalid line", parser->filename, parser->line);
+    return rc;
+}
+
+/*
+** Parses the complete lines at the start of a buffer, and returns the size
+** of what was parsed. At the end of the file, the last line doesn't need a
+** line break.
+*/
+static int obj_parse_lines(struct obj_parser *parser, char *buf, size_t size,
+                           bool eof, size_t *parsed)
+{
+    char *p = buf;
+    char *end = buf + size;
+    while (p < end)
+    {
+        char *line_end = memchr(p, '\n', end - p);
+        if (line_end == NULL)
+        {
+            if (!eof)
+                break;
+            line_end = end;
+        }
+
+        *line_end = '\0';
+        if (line_end > p && line_end[-1] == '\r')
+            line_end[-1] = '\0';
+        parser->line++;
+        if (obj_parse_line(parser, p))
+            return -1;
+        p = line_end + 1;
+    }
+
+    *parsed = p < end ? (size_t)(p - buf) : size;
+    return 0;
+}
+
+/*
+** Reads the file one chunk at a time. Only the line crossing the end of a
+** chunk is carried over to the next one, so the text of the file is never
+** held in memory as a whole.
+*/
+static int obj_parse_file(struct obj_parser *parser, FILE *fp)
+{
+    size_t capacity = OBJ_CHUNK_SIZE;
+    // one more byte for the end of the last line
+    char *buf = xalloc(capacity + 1);
+    size_t size = 0;
+    int rc = 0;
+    while (rc == 0)
+    {
+        // lines longer than the buffer make it grow
+        if (size == capacity)
+        {
+            capacity *= 2;
+            buf = xrealloc(buf, capacity + 1);
+        }
+
+        size_t read = fread(buf + size, 1, capacity - size, fp);
+        size += read;
+        bool eof = read == 0;
+        if (eof && ferror(fp))
+        {
+            warn("failed to read %s", parser->filename);
+            rc = -1;
+            break;
+        }
+
+        size_t parsed;
+        rc = obj_parse_lines(parser, buf, size, eof, &parsed);
+        if (rc || eof)
+            break;
+        memmove(buf, buf + parsed, size - parsed);
+        size -= parsed;
+    }
+
+    free(buf);
+    return rc;
+}
+
+int load_obj(struct scene *scene, const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        warn("failed to open %s", filename);
+        return -1;
+    }
+
+    // all the faces of the file are stored in a single mesh,
+    // which is added to the scene using a single instance
+    struct obj_parser parser = {
+        .filename = filename,
+        .scene = scene,
+        .mesh = mesh_create(),
+        .current_material = UINT32_MAX,
+        .default_material = UINT32_MAX,
+    };
+    int rc = obj_parse_file(&parser, fp);
+    fclose(fp);
+    tinyobj_materials_free(parser.materials, parser.material_count);
+
+    if (rc == 0 && parser.index_end > parser.vertex_count)
+    {
+        warnx("%s: vertex index out of range", filename);
+        rc = -1;
+    }
+    if (rc)
+    {
+        free(parser.vertices);
+        free(parser.faces);
+        free(parser.face_materials);
+        mesh_put(parser.mesh);
+        return -1;
+    }
+
+    // release the room left for more vertices and faces
+    size_t face_count = parser.face_count;
+    float *vertices = xrealloc(parser.vertices, 3 * parser.vertex_count
+                                                    * sizeof(*vertices));
+    uint32_t *faces = xrealloc(parser.faces, 3 * face_count * sizeof(*faces));
+    uint32_t *face_materials = xrealloc(
+        parser.face_materials, face_count * sizeof(*face_materials));
+
+    struct mesh *mesh = parser.mesh;
+    mesh_set_geometry(mesh, vertices, parser.vertex_count, faces,
+                      face_materials, face_count);
+    mesh_loader_build(scene, mesh, filename);
 
-    // free tinyobjloader internal structures
-    tinyobj_attrib_free(&attrib);
-    tinyobj_shapes_free(shapes, num_shapes);
-    tinyobj_materials_free(materials, num_materials);
+    struct transform identity;
+    transform_identity(&identity);
+    mesh_loader_add_instance(scene, mesh, &identity);
+    mesh_put(mesh);
     return 0;
 }
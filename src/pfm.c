@@ -0,0 +1,26 @@
+#include "pfm.h"
+#include "utils/static_assert.h"
+
+STATIC_ASSERT(hdr_pixel_size, sizeof(struct hdr_pixel) == 3 * sizeof(float));
+
+int pfm_write(const struct hdr_image *image, FILE *file)
+{
+    // the sign of the scale tells the byte order of the samples.
+    // as samples are written in native order, just pick the right one
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const char *scale = "-1.0";
+#else
+    const char *scale = "1.0";
+#endif
+
+    if (fprintf(file, "PF\n%zu %zu\n%s\n", image->width, image->height, scale)
+        < 0)
+        return -1;
+
+    // both pfm and hdr images store lines from the bottom up
+    size_t pixel_count = image->width * image->height;
+    if (fwrite(image->data, sizeof(struct hdr_pixel), pixel_count, file)
+        != pixel_count)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,655 @@
+#include "ply_loader.h"
+#include "mesh.h"
+#include "mesh_loader.h"
+#include "utils/alloc.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PLY_MAX_ELEMENTS 16
+#define PLY_MAX_PROPERTIES 32
+#define PLY_MAX_NAME 32
+
+enum ply_type
+{
+    PLY_NONE,
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64,
+};
+
+static const struct
+{
+    const char *name;
+    enum ply_type type;
+} ply_type_names[] = {
+    {"char", PLY_INT8},     {"int8", PLY_INT8},       {"uchar", PLY_UINT8},
+    {"uint8", PLY_UINT8},   {"short", PLY_INT16},     {"int16", PLY_INT16},
+    {"ushort", PLY_UINT16}, {"uint16", PLY_UINT16},   {"int", PLY_INT32},
+    {"int32", PLY_INT32},   {"uint", PLY_UINT32},     {"uint32", PLY_UINT32},
+    {"float", PLY_FLOAT32}, {"float32", PLY_FLOAT32}, {"double", PLY_FLOAT64},
+    {"float64", PLY_FLOAT64},
+};
+
+static const size_t ply_type_sizes[] = {
+    [PLY_NONE] = 0,    [PLY_INT8] = 1,    [PLY_UINT8] = 1,
+    [PLY_INT16] = 2,   [PLY_UINT16] = 2,  [PLY_INT32] = 4,
+    [PLY_UINT32] = 4,  [PLY_FLOAT32] = 4, [PLY_FLOAT64] = 8,
+};
+
+struct ply_property
+{
+    char name[PLY_MAX_NAME];
+    enum ply_type type;
+    // the type of the item count of list properties, PLY_NONE otherwise
+    enum ply_type count_type;
+};
+
+struct ply_element
+{
+    char name[PLY_MAX_NAME];
+    size_t count;
+    size_t property_count;
+    struct ply_property properties[PLY_MAX_PROPERTIES];
+};
+
+struct ply_header
+{
+    size_t element_count;
+    struct ply_element elements[PLY_MAX_ELEMENTS];
+    // the offset of the body in the file
+    size_t body_offset;
+};
+
+static enum ply_type ply_parse_type(const char *name)
+{
+    size_t count = sizeof(ply_type_names) / sizeof(ply_type_names[0]);
+    for (size_t i = 0; i < count; i++)
+        if (strcmp(ply_type_names[i].name, name) == 0)
+            return ply_type_names[i].type;
+    return PLY_NONE;
+}
+
+// values are stored in the byte order of the file, which is the host's
+static double ply_read(const unsigned char *p, enum ply_type type)
+{
+    switch (type)
+    {
+    case PLY_INT8:
+        return *(const int8_t *)p;
+    case PLY_UINT8:
+        return *p;
+    case PLY_INT16:
+    {
+        int16_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    case PLY_UINT16:
+    {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    case PLY_INT32:
+    {
+        int32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    case PLY_UINT32:
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    case PLY_FLOAT32:
+    {
+        float v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    case PLY_FLOAT64:
+    {
+        double v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    case PLY_NONE:
+    default:
+        return 0;
+    }
+}
+
+static bool host_is_little_endian(void)
+{
+    uint16_t one = 1;
+    unsigned char first;
+    memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+static int ply_parse_line(struct ply_header *header, char *line,
+                          const char *filename)
+{
+    char keyword[16];
+    if (sscanf(line, "%15s", keyword) != 1 || strcmp(keyword, "comment") == 0
+        || strcmp(keyword, "obj_info") == 0)
+        return 0;
+
+    if (strcmp(keyword, "format") == 0)
+    {
+        char format[32];
+        if (sscanf(line, "format %31s", format) != 1
+            || strcmp(format, "binary_little_endian") != 0)
+        {
+            warnx("%s: only binary little endian PLY files are supported",
+                  filename);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (strcmp(keyword, "element") == 0)
+    {
+        if (header->element_count == PLY_MAX_ELEMENTS)
+        {
+            warnx("%s: too many PLY elements", filename);
+            return -1;
+        }
+
+        struct ply_element *element = &header->elements[header->element_count];
+        element->property_count = 0;
+        if (sscanf(line, "element %31s %zu", element->name, &element->count)
+            != 2)
+            goto invalid;
+        header->element_count++;
+        return 0;
+    }
+
+    if (strcmp(keyword, "property") == 0)
+    {
+        if (header->element_count == 0)
+            goto invalid;
+        struct ply_element *element
+            = &header->elements[header->element_count - 1];
+        if (element->property_count == PLY_MAX_PROPERTIES)
+        {
+            warnx("%s: too many PLY properties", filename);
+            return -1;
+        }
+
+        struct ply_property *property
+            = &element->properties[element->property_count];
+        char count_type[16];
+        char type[16];
+        if (sscanf(line, "property list %15s %15s %31s", count_type, type,
+                   property->name)
+            == 3)
+        {
+            property->count_type = ply_parse_type(count_type);
+            if (property->count_type == PLY_NONE
+                || property->count_type == PLY_FLOAT32
+                || property->count_type == PLY_FLOAT64)
+                goto invalid;
+        }
+        else if (sscanf(line, "property %15s %31s", type, property->name) == 2)
+            property->count_type = PLY_NONE;
+        else
+            goto invalid;
+
+        property->type = ply_parse_type(type);
+        if (property->type == PLY_NONE)
+            goto invalid;
+        element->property_count++;
+        return 0;
+    }
+
+invalid:
+    warnx("%s: invalid PLY header line: %s", filename, line);
+    return -1;
+}
+
+/*
+** Parses the text header of the file, which ends with an end_header line.
+*/
+static int ply_parse_header(struct ply_header *header, const char *data,
+                            size_t size, const char *filename)
+{
+    static const char end_marker[] = "\nend_header";
+    const size_t end_len = sizeof(end_marker) - 1;
+    const char *end = memmem(data, size, end_marker, end_len);
+    if (size < 4 || memcmp(data, "ply", 3) != 0 || end == NULL)
+    {
+        warnx("%s: not a PLY file", filename);
+        return -1;
+    }
+
+    const char *body = end + end_len;
+    if (body < data + size && *body == '\r')
+        body++;
+    if (body == data + size || *body != '\n')
+    {
+        warnx("%s: not a PLY file", filename);
+        return -1;
+    }
+    header->body_offset = body + 1 - data;
+    header->element_count = 0;
+
+    // the header is copied, so that lines can be split in place
+    size_t text_size = end - data;
+    char *text = xalloc(text_size + 1);
+    memcpy(text, data, text_size);
+    text[text_size] = '\0';
+
+    int rc = 0;
+    char *save;
+    // the first line is the magic number
+    strtok_r(text, "\n", &save);
+    for (char *line; rc == 0 && (line = strtok_r(NULL, "\n", &save));)
+    {
+        size_t len = strlen(line);
+        if (len && line[len - 1] == '\r')
+            line[len - 1] = '\0';
+        rc = ply_parse_line(header, line, filename);
+    }
+
+    free(text);
+    return rc;
+}
+
+static const struct ply_element *ply_find_element(
+    const struct ply_header *header, const char *name, size_t *index)
+{
+    for (size_t i = 0; i < header->element_count; i++)
+        if (strcmp(header->elements[i].name, name) == 0)
+        {
+            *index = i;
+            return &header->elements[i];
+        }
+    return NULL;
+}
+
+/*
+** Returns the end of the property at p, or NULL if it goes past the end
+** of the file.
+*/
+static const unsigned char *ply_skip_property(
+    const struct ply_property *property, const unsigned char *p,
+    const unsigned char *end)
+{
+    size_t count = 1;
+    if (property->count_type != PLY_NONE)
+    {
+        size_t count_size = ply_type_sizes[property->count_type];
+        if ((size_t)(end - p) < count_size)
+            return NULL;
+        double list_count = ply_read(p, property->count_type);
+        if (list_count < 0)
+            return NULL;
+        count = list_count;
+        p += count_size;
+    }
+
+    size_t item_size = ply_type_sizes[property->type];
+    if ((size_t)(end - p) / item_size < count)
+        return NULL;
+    return p + count * item_size;
+}
+
+/*
+** Whether the element at p can fit in the rest of the file, given the
+** smallest size its records can have: lists may be empty, but their item
+** count is always there. This bounds the count read from the header, before
+** anything gets allocated from it.
+*/
+static bool ply_element_fits(const struct ply_element *element,
+                             const unsigned char *p, const unsigned char *end)
+{
+    size_t min_record_size = 0;
+    for (size_t i = 0; i < element->property_count; i++)
+    {
+        const struct ply_property *property = &element->properties[i];
+        enum ply_type type = property->count_type != PLY_NONE
+                                 ? property->count_type
+                                 : property->type;
+        min_record_size += ply_type_sizes[type];
+    }
+
+    // records without properties take no space
+    if (min_record_size == 0)
+        return true;
+    return (size_t)(end - p) / min_record_size >= element->count;
+}
+
+/*
+** Returns the end of the element at p, or NULL if it goes past the end
+** of the file. Elements without list properties are skipped at once.
+*/
+static const unsigned char *ply_skip_element(
+    const struct ply_element *element, const unsigned char *p,
+    const unsigned char *end)
+{
+    if (element->property_count == 0)
+        return p;
+
+    size_t record_size = 0;
+    for (size_t i = 0; i < element->property_count; i++)
+    {
+        const struct ply_property *property = &element->properties[i];
+        if (property->count_type != PLY_NONE)
+        {
+            record_size = 0;
+            break;
+        }
+        record_size += ply_type_sizes[property->type];
+    }
+
+    if (record_size)
+    {
+        if ((size_t)(end - p) / record_size < element->count)
+            return NULL;
+        return p + element->count * record_size;
+    }
+
+    for (size_t r = 0; p && r < element->count; r++)
+        for (size_t i = 0; p && i < element->property_count; i++)
+            p = ply_skip_property(&element->properties[i], p, end);
+    return p;
+}
+
+/*
+** Whether vertices are exactly three packed floats, which the mesh can use
+** as they are.
+*/
+static bool ply_vertices_in_place(const struct ply_element *element,
+                                  const unsigned char *p)
+{
+    static const char *const names[] = {"x", "y", "z"};
+    if (element->property_count != 3 || (uintptr_t)p % sizeof(float) != 0)
+        return false;
+
+    for (size_t i = 0; i < 3; i++)
+    {
+        const struct ply_property *property = &element->properties[i];
+        if (property->count_type != PLY_NONE || property->type != PLY_FLOAT32
+            || strcmp(property->name, names[i]) != 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+** Reads the vertex positions of the element at p. Returns NULL if the
+** element is invalid, and sets in_place if vertices point into the file.
+** The element must have been checked by ply_element_fits.
+*/
+static float *ply_read_vertices(const struct ply_element *element,
+                                const unsigned char *p,
+                                const unsigned char *end, bool *in_place)
+{
+    if ((size_t)(end - p) / (3 * sizeof(float)) >= element->count
+        && ply_vertices_in_place(element, p))
+    {
+        *in_place = true;
+        // the mapping is private, so the vertices can still be modified
+        return (float *)p;
+    }
+
+    *in_place = false;
+    int axes[PLY_MAX_PROPERTIES];
+    size_t found = 0;
+    for (size_t i = 0; i < element->property_count; i++)
+    {
+        const struct ply_property *property = &element->properties[i];
+        axes[i] = -1;
+        if (property->count_type != PLY_NONE || property->name[1] != '\0'
+            || property->name[0] < 'x' || property->name[0] > 'z')
+            continue;
+        axes[i] = property->name[0] - 'x';
+        found |= 1 << axes[i];
+    }
+    if (found != 7)
+        return NULL;
+
+    float *vertices = xcalloc(3 * element->count, sizeof(*vertices));
+    for (size_t v = 0; v < element->count; v++)
+        for (size_t i = 0; i < element->property_count; i++)
+        {
+            const struct ply_property *property = &element->properties[i];
+            const unsigned char *next = ply_skip_property(property, p, end);
+            if (next == NULL)
+            {
+                free(vertices);
+                return NULL;
+            }
+            if (axes[i] >= 0)
+                vertices[3 * v + axes[i]] = ply_read(p, property->type);
+            p = next;
+        }
+    return vertices;
+}
+
+/*
+** Reads the vertex indices of the element at p, splitting polygons into
+** fans of triangles. Polygons with less than three vertices are left out.
+** Returns NULL if the element is invalid. The element must have been
+** checked by ply_element_fits.
+*/
+static uint32_t *ply_read_faces(const struct ply_element *element,
+                                const unsigned char *p,
+                                const unsigned char *end, size_t *face_count,
+                                uint32_t *max_index)
+{
+    size_t index_property = element->property_count;
+    for (size_t i = 0; i < element->property_count; i++)
+    {
+        const struct ply_property *property = &element->properties[i];
+        if (property->count_type != PLY_NONE
+            && property->type != PLY_FLOAT32 && property->type != PLY_FLOAT64
+            && (strcmp(property->name, "vertex_indices") == 0
+                || strcmp(property->name, "vertex_index") == 0))
+            index_property = i;
+    }
+    if (index_property == element->property_count)
+        return NULL;
+
+    // most files only have triangles. The count was checked against the
+    // size of the file, which keeps this from overflowing
+    size_t capacity = element->count ? element->count : 1;
+    uint32_t *faces = xalloc(3 * capacity * sizeof(*faces));
+    size_t count = 0;
+    uint32_t max = 0;
+    for (size_t f = 0; f < element->count; f++)
+        for (size_t i = 0; i < element->property_count; i++)
+        {
+            const struct ply_property *property = &element->properties[i];
+            const unsigned char *next = ply_skip_property(property, p, end);
+            if (next == NULL)
+            {
+                free(faces);
+                return NULL;
+            }
+            if (i != index_property)
+            {
+                p = next;
+                continue;
+            }
+
+            size_t item_size = ply_type_sizes[property->type];
+            size_t vertex_count = ply_read(p, property->count_type);
+            const unsigned char *items
+                = p + ply_type_sizes[property->count_type];
+            p = next;
+            for (size_t k = 2; k < vertex_count; k++)
+            {
+                if (count == capacity)
+                {
+                    capacity *= 2;
+                    faces = xrealloc(faces, 3 * capacity * sizeof(*faces));
+                }
+
+                size_t corners[3] = {0, k - 1, k};
+                for (size_t c = 0; c < 3; c++)
+                {
+                    const unsigned char *item = items + corners[c] * item_size;
+                    double index = ply_read(item, property->type);
+                    if (index < 0 || index > UINT32_MAX)
+                    {
+                        free(faces);
+                        return NULL;
+                    }
+                    faces[3 * count + c] = index;
+                    if (faces[3 * count + c] > max)
+                        max = faces[3 * count + c];
+                }
+                count++;
+            }
+        }
+
+    *face_count = count;
+    *max_index = max;
+    return faces;
+}
+
+static void *ply_map(size_t *size, const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        warn("failed to open %s", filename);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+    {
+        warnx("%s: not a PLY file", filename);
+        close(fd);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    // the mapping is private and writable, so that the mesh can still be
+    // animated without touching the file
+    void *mapping
+        = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        warn("failed to map %s", filename);
+        return NULL;
+    }
+    return mapping;
+}
+
+int load_ply(struct scene *scene, const char *filename)
+{
+    if (!host_is_little_endian())
+    {
+        warnx("%s: PLY files can only be loaded on little endian machines",
+              filename);
+        return -1;
+    }
+
+    size_t size;
+    unsigned char *mapping = ply_map(&size, filename);
+    if (mapping == NULL)
+        return -1;
+
+    struct ply_header header;
+    size_t vertex_i;
+    size_t face_i;
+    const struct ply_element *vertex_element;
+    const struct ply_element *face_element;
+    if (ply_parse_header(&header, (const char *)mapping, size, filename))
+        goto fail_unmap;
+
+    vertex_element = ply_find_element(&header, "vertex", &vertex_i);
+    face_element = ply_find_element(&header, "face", &face_i);
+    if (vertex_element == NULL || face_element == NULL)
+    {
+        warnx("%s: PLY files must have vertex and face elements", filename);
+        goto fail_unmap;
+    }
+
+    const unsigned char *end = mapping + size;
+    const unsigned char *p = mapping + header.body_offset;
+    float *vertices = NULL;
+    bool vertices_in_place = false;
+    uint32_t *faces = NULL;
+    size_t face_count = 0;
+    uint32_t max_index = 0;
+    for (size_t i = 0; p && i < header.element_count; i++)
+    {
+        const struct ply_element *element = &header.elements[i];
+        if (!ply_element_fits(element, p, end))
+        {
+            p = NULL;
+            break;
+        }
+        if (i == vertex_i)
+        {
+            vertices = ply_read_vertices(element, p, end, &vertices_in_place);
+            if (vertices == NULL)
+                break;
+        }
+        else if (i == face_i)
+        {
+            faces = ply_read_faces(element, p, end, &face_count, &max_index);
+            if (faces == NULL)
+                break;
+        }
+        p = ply_skip_element(element, p, end);
+    }
+
+    if (p == NULL || vertices == NULL || faces == NULL
+        || (face_count && max_index >= vertex_element->count))
+    {
+        warnx("%s: invalid PLY file", filename);
+        if (!vertices_in_place)
+            free(vertices);
+        free(faces);
+        goto fail_unmap;
+    }
+
+    struct mesh *mesh = mesh_create();
+    if (vertices_in_place)
+        mesh_set_mapping(mesh, mapping, size);
+    else
+        munmap(mapping, size);
+
+    // PLY files have no materials
+    static const float diffuse[3] = {0.8, 0.8, 0.8};
+    struct material *material = mesh_loader_material(scene, diffuse);
+    mesh_add_material(mesh, material);
+    material_put(material);
+
+    uint32_t *face_materials = xcalloc(face_count, sizeof(*face_materials));
+    mesh_set_geometry(mesh, vertices, vertex_element->count, faces,
+                      face_materials, face_count);
+    mesh_loader_build(scene, mesh, filename);
+
+    struct transform identity;
+    transform_identity(&identity);
+    mesh_loader_add_instance(scene, mesh, &identity);
+    mesh_put(mesh);
+    return 0;
+
+fail_unmap:
+    munmap(mapping, size);
+    return -1;
+}
@@ -0,0 +1,152 @@
+#include "qbvh.h"
+#include "utils/alloc.h"
+#include "utils/static_assert.h"
+
+#include <stdlib.h>
+
+STATIC_ASSERT(qbvh_node_size, sizeof(struct qbvh_node) == 36);
+// leaf sizes must fit in 4 bits, and not be mistaken for empty children
+STATIC_ASSERT(qbvh_leaf_size, BVH_MAX_LEAF_SIZE < QBVH_EMPTY_CHILD);
+
+/*
+** Picks the smallest power of two grid step able to span extent
+** in 255 steps.
+*/
+static int quantize_exponent(double extent)
+{
+    int exponent = QBVH_MIN_EXPONENT;
+    if (extent > 0)
+    {
+        frexp(extent / 255, &exponent);
+        if (exponent < QBVH_MIN_EXPONENT)
+            exponent = QBVH_MIN_EXPONENT;
+    }
+    return exponent;
+}
+
+/*
+** Quantizes the bounds of a child along an axis, rounding outwards so that
+** the decoded bounds always contain the original ones.
+*/
+static void quantize_bounds(uint8_t *lo, uint8_t *hi, float origin,
+                            int exponent, float min, float max)
+{
+    double scale = qbvh_scale(exponent);
+    double q_lo = floor((min - (double)origin) / scale);
+    double q_hi = ceil((max - (double)origin) / scale);
+
+    // decoding happens in single precision, which may round inwards
+    while (q_lo > 0 && (float)(origin + (float)(q_lo * scale)) > min)
+        q_lo--;
+    while (q_hi < 255 && (float)(origin + (float)(q_hi * scale)) < max)
+        q_hi++;
+
+    *lo = q_lo < 0 ? 0 : q_lo;
+    *hi = q_hi > 255 ? 255 : q_hi;
+}
+
+static void set_child(struct qbvh_node *qnode, size_t child,
+                      const struct bvh_node *node, uint32_t index)
+{
+    for (size_t axis = 0; axis < 3; axis++)
+        quantize_bounds(&qnode->lo[3 * child + axis],
+                        &qnode->hi[3 * child + axis], qnode->origin[axis],
+                        qnode->exponent[axis], node->min[axis],
+                        node->max[axis]);
+
+    unsigned count = node->count;
+    if (count)
+        index = node->offset;
+    qnode->meta |= count << (4 * child);
+    qnode->child[child] = index;
+}
+
+static void set_empty_child(struct qbvh_node *qnode, size_t child)
+{
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        qnode->lo[3 * child + axis] = 255;
+        qnode->hi[3 * child + axis] = 0;
+    }
+    qnode->meta |= QBVH_EMPTY_CHILD << (4 * child);
+    qnode->child[child] = 0;
+}
+
+/*
+** Sets up the grid of a compressed node so that it spans the bounds of
+** the given binary node.
+*/
+static void init_node(struct qbvh_node *qnode, const struct bvh_node *node)
+{
+    qnode->meta = 0;
+    for (size_t axis = 0; axis < 3; axis++)
+    {
+        qnode->origin[axis] = node->min[axis];
+        double extent = (double)node->max[axis] - node->min[axis];
+        qnode->exponent[axis] = quantize_exponent(extent);
+    }
+}
+
+struct convert_ctx
+{
+    const struct bvh *bvh;
+    struct qbvh *qbvh;
+};
+
+// converts the inner node node_i into compressed node qnode_i
+static void convert_node(struct convert_ctx *ctx, uint32_t node_i,
+                         uint32_t qnode_i)
+{
+    const struct bvh_node *node = &ctx->bvh->nodes[node_i];
+    struct qbvh_node *qnode = &ctx->qbvh->nodes[qnode_i];
+    init_node(qnode, node);
+
+    uint32_t qchild[2];
+    for (size_t i = 0; i < 2; i++)
+    {
+        const struct bvh_node *child = &ctx->bvh->nodes[node->offset + i];
+        qchild[i] = child->count ? 0 : ctx->qbvh->node_count++;
+        set_child(qnode, i, child, qchild[i]);
+    }
+
+    // children are converted after both slots of their parent are set,
+    // so that siblings are stored next to each other
+    for (size_t i = 0; i < 2; i++)
+        if (qbvh_child_count(qnode, i) == 0)
+            convert_node(ctx, node->offset + i, qchild[i]);
+}
+
+void qbvh_build(struct qbvh *qbvh, const struct bvh *bvh)
+{
+    qbvh_destroy(qbvh);
+    qbvh_init(qbvh);
+    if (bvh->node_count == 0)
+        return;
+
+    const struct bvh_node *root = &bvh->nodes[0];
+    bvh_node_get_bounds(&qbvh->root_box, root);
+
+    // there is one compressed node per inner node, and leaves are stored
+    // in their parent
+    size_t inner_count = bvh->node_count / 2;
+    qbvh->nodes = xcalloc(inner_count ? inner_count : 1, sizeof(*qbvh->nodes));
+    qbvh->node_count = 1;
+
+    if (root->count)
+    {
+        // a lone leaf still needs a node to hold its bounds
+        init_node(&qbvh->nodes[0], root);
+        set_child(&qbvh->nodes[0], 0, root, 0);
+        set_empty_child(&qbvh->nodes[0], 1);
+        return;
+    }
+
+    struct convert_ctx ctx = {.bvh = bvh, .qbvh = qbvh};
+    convert_node(&ctx, 0, 0);
+}
+
+void qbvh_destroy(struct qbvh *qbvh)
+{
+    if (!qbvh->mapped)
+        free(qbvh->nodes);
+}
@@ -0,0 +1,274 @@
+#include "sampler.h"
+#include "utils/alloc.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// the side of the square blue noise mask, which is tiled over the image
+#define BLUE_NOISE_SIZE 64
+
+// the standard deviation of the gaussian filter the energy of the mask is
+// measured with, and how far the filter goes, in pixels
+#define BLUE_NOISE_SIGMA 1.9
+#define BLUE_NOISE_RADIUS 6
+
+static uint32_t hash_u32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+    return seed ^ (v + (seed << 6) + (seed >> 2));
+}
+
+static uint32_t pixel_seed(uint32_t x, uint32_t y)
+{
+    return hash_u32(x ^ hash_u32(y));
+}
+
+static uint32_t reverse_bits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+    x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// converts 32 bits of fixed point to [0, 1)
+static double unorm32(uint32_t x)
+{
+    return x * (1. / 4294967296.);
+}
+
+/*
+** A permutation of [0, l), picked by p, which can be computed for a single
+** element (Kensler, 2013).
+*/
+static uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    // cycle walk until the permuted index is in range
+    do
+    {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+// a random number in [0, 1), picked by i and p
+static double randfloat(uint32_t i, uint32_t p)
+{
+    i ^= p;
+    i ^= i >> 17;
+    i ^= i >> 10;
+    i *= 0xb36534e5;
+    i ^= i >> 12;
+    i ^= i >> 21;
+    i *= 0x93fc4795;
+    i ^= 0xdf6e307f;
+    i ^= i >> 17;
+    i *= 1 | p >> 18;
+    return i * (1. / 4294967808.);
+}
+
+/*
+** Samples are laid out on a grid of m by n cells, with m * n >= count.
+** Within each cell, samples are offset so that they also fall in distinct
+** columns and rows of a finer grid, and the whole pattern is shuffled
+** differently for each pixel.
+*/
+static void stratified_sample(double res[2], const struct sampler *sampler,
+                              uint32_t x, uint32_t y, uint32_t i)
+{
+    uint32_t count = sampler->count;
+    uint32_t m = sqrt(count);
+    uint32_t n = (count + m - 1) / m;
+    uint32_t p = pixel_seed(x, y);
+
+    uint32_t s = permute(i, count, p * 0x51633e2d);
+    uint32_t sx = permute(s % m, m, p * 0xa511e9b3);
+    uint32_t sy = permute(s / m, n, p * 0x63d83595);
+    double jx = randfloat(s, p * 0xa399d265);
+    double jy = randfloat(s, p * 0x711ad6a5);
+    res[0] = (s % m + (sy + jx) / n) / m;
+    res[1] = (s / m + (sx + jy) / m) / n;
+}
+
+// the first two dimensions of the Sobol sequence, as 32 bits fixed point
+static uint32_t sobol_0(uint32_t i)
+{
+    return reverse_bits(i);
+}
+
+static uint32_t sobol_1(uint32_t i)
+{
+    uint32_t res = 0;
+    for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1)
+        if (i & 1)
+            res ^= v;
+    return res;
+}
+
+/*
+** An Owen scramble of the bits of x: each bit is flipped depending on the
+** ones above it, which keeps the stratification of Sobol points.
+*/
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return reverse_bits(x);
+}
+
+static void sobol_sample(double res[2], const struct sampler *sampler,
+                         uint32_t x, uint32_t y, uint32_t i)
+{
+    (void)sampler;
+    uint32_t seed = pixel_seed(x, y);
+    uint32_t index = nested_uniform_scramble(i, seed);
+    res[0] = unorm32(
+        nested_uniform_scramble(sobol_0(index), hash_combine(seed, 0)));
+    res[1] = unorm32(
+        nested_uniform_scramble(sobol_1(index), hash_combine(seed, 1)));
+}
+
+static double blue_noise_value(const struct sampler *sampler, uint32_t x,
+                               uint32_t y)
+{
+    size_t i = (y % BLUE_NOISE_SIZE) * BLUE_NOISE_SIZE + x % BLUE_NOISE_SIZE;
+    return (sampler->mask[i] + 0.5) / (BLUE_NOISE_SIZE * BLUE_NOISE_SIZE);
+}
+
+static void blue_noise_sample(double res[2], const struct sampler *sampler,
+                              uint32_t x, uint32_t y, uint32_t i)
+{
+    // the second coordinate uses the mask transposed and shifted by half,
+    // which is about as good as an independent mask
+    double shift_x = blue_noise_value(sampler, x, y);
+    double shift_y = blue_noise_value(sampler, y + BLUE_NOISE_SIZE / 2,
+                                      x + BLUE_NOISE_SIZE / 2);
+    double u = unorm32(sobol_0(i)) + shift_x;
+    double v = unorm32(sobol_1(i)) + shift_y;
+    res[0] = u - floor(u);
+    res[1] = v - floor(v);
+}
+
+/*
+** Builds a blue noise mask using the second phase of the void and cluster
+** method (Ulichney, 1993): pixels are ranked one at a time, by picking the
+** largest void left between the pixels ranked so far. Voids are found by
+** filtering ranked pixels with a gaussian, wrapping around the edges so
+** that the mask tiles.
+*/
+static uint16_t *blue_noise_mask(void)
+{
+    const size_t size = BLUE_NOISE_SIZE;
+    const int radius = BLUE_NOISE_RADIUS;
+    double kernel[2 * BLUE_NOISE_RADIUS + 1][2 * BLUE_NOISE_RADIUS + 1];
+    for (int dy = -radius; dy <= radius; dy++)
+        for (int dx = -radius; dx <= radius; dx++)
+        {
+            double dist2 = dx * dx + dy * dy;
+            kernel[dy + radius][dx + radius]
+                = exp(-dist2 / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+        }
+
+    size_t count = size * size;
+    double *energy = xcalloc(count, sizeof(*energy));
+    bool *ranked = xcalloc(count, sizeof(*ranked));
+    uint16_t *mask = xcalloc(count, sizeof(*mask));
+    for (size_t rank = 0; rank < count; rank++)
+    {
+        // ties are broken by a tiny amount of noise, so that the first
+        // pixels don't end up on a regular grid
+        size_t best = 0;
+        double best_energy = INFINITY;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (ranked[i])
+                continue;
+            double e = energy[i] + unorm32(hash_u32(i)) * 1e-9;
+            if (e < best_energy)
+            {
+                best_energy = e;
+                best = i;
+            }
+        }
+
+        ranked[best] = true;
+        mask[best] = rank;
+        size_t best_x = best % size;
+        size_t best_y = best / size;
+        for (int dy = -radius; dy <= radius; dy++)
+            for (int dx = -radius; dx <= radius; dx++)
+            {
+                size_t x = (best_x + size + dx) % size;
+                size_t y = (best_y + size + dy) % size;
+                energy[y * size + x] += kernel[dy + radius][dx + radius];
+            }
+    }
+
+    free(energy);
+    free(ranked);
+    return mask;
+}
+
+void sampler_init(struct sampler *sampler, enum sampler_type type,
+                  uint32_t count)
+{
+    sampler->count = count;
+    sampler->mask = NULL;
+    switch (type)
+    {
+    case SAMPLER_SOBOL:
+        sampler->sample = sobol_sample;
+        break;
+    case SAMPLER_BLUE_NOISE:
+        sampler->sample = blue_noise_sample;
+        sampler->mask = blue_noise_mask();
+        break;
+    case SAMPLER_STRATIFIED:
+    default:
+        sampler->sample = stratified_sample;
+        break;
+    }
+}
+
+void sampler_destroy(struct sampler *sampler)
+{
+    free(sampler->mask);
+}
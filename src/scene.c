@@ -1,4 +1,189 @@
 #include "scene.h"
+#include "sphere.h"
+#include "utils/alloc.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+static double scene_object_intersect(struct object_hit *hit,
+                                     struct scene *scene, uint32_t obj_i,
+                                     const struct ray *ray)
+{
+    struct object *obj = object_vect_get(&scene->objects, obj_i);
+    double dist = obj->intersect(hit, obj, ray);
+    hit->object = obj;
+    hit->object_id = obj_i;
+    return dist;
+}
+
+#define BVH_TRAVERSE_NAME scene_traverse
+#define BVH_TRAVERSE_CTX struct scene *
+#define BVH_TRAVERSE_PRIM scene_object_intersect
+#include "bvh_traverse.defs"
+#undef BVH_TRAVERSE_NAME
+#undef BVH_TRAVERSE_CTX
+#undef BVH_TRAVERSE_PRIM
+
+#define GRID_TRAVERSE_NAME scene_traverse_grid
+#define GRID_TRAVERSE_CTX struct scene *
+#define GRID_TRAVERSE_PRIM scene_object_intersect
+#include "grid_traverse.defs"
+#undef GRID_TRAVERSE_NAME
+#undef GRID_TRAVERSE_CTX
+#undef GRID_TRAVERSE_PRIM
+
+// the references of the acceleration structure in use
+static const uint32_t *scene_refs(const struct scene *scene)
+{
+    return scene->use_grid ? scene->grid.prims : scene->bvh.prims;
+}
+
+static double scene_sphere_range(struct object_hit *hit, struct scene *scene,
+                                 size_t begin, size_t count,
+                                 const struct ray *ray)
+{
+    double dist;
+    size_t ref
+        = sphere_batch_intersect(&dist, &scene->spheres, begin, count, ray);
+    if (ref == SIZE_MAX)
+        return INFINITY;
+
+    uint32_t obj_i = scene_refs(scene)[ref];
+    hit->object = object_vect_get(&scene->objects, obj_i);
+    hit->object_id = obj_i;
+    hit->prim = 0;
+    return dist;
+}
+
+#define BVH_TRAVERSE_NAME scene_traverse_spheres
+#define BVH_TRAVERSE_CTX struct scene *
+#define BVH_TRAVERSE_RANGE scene_sphere_range
+#include "bvh_traverse.defs"
+#undef BVH_TRAVERSE_NAME
+#undef BVH_TRAVERSE_CTX
+#undef BVH_TRAVERSE_RANGE
+
+#define GRID_TRAVERSE_NAME scene_traverse_grid_spheres
+#define GRID_TRAVERSE_CTX struct scene *
+#define GRID_TRAVERSE_RANGE scene_sphere_range
+#include "grid_traverse.defs"
+#undef GRID_TRAVERSE_NAME
+#undef GRID_TRAVERSE_CTX
+#undef GRID_TRAVERSE_RANGE
+
+/*
+** Copies spheres in the order of the references of the acceleration
+** structure, when all objects are spheres.
+*/
+static void scene_build_spheres(struct scene *scene)
+{
+    size_t count = object_vect_size(&scene->objects);
+    scene->only_spheres = count > 0;
+    for (size_t i = 0; i < count && scene->only_spheres; i++)
+        scene->only_spheres
+            = object_is_sphere(object_vect_get(&scene->objects, i));
+
+    if (!scene->only_spheres)
+    {
+        sphere_batch_destroy(&scene->spheres);
+        sphere_batch_init(&scene->spheres);
+        return;
+    }
+
+    const uint32_t *refs = scene_refs(scene);
+    size_t ref_count
+        = scene->use_grid ? scene->grid.prim_count : scene->bvh.prim_count;
+    sphere_batch_resize(&scene->spheres, ref_count);
+    for (size_t i = 0; i < ref_count; i++)
+    {
+        struct object *obj = object_vect_get(&scene->objects, refs[i]);
+        sphere_batch_set(&scene->spheres, i, (const struct sphere *)obj);
+    }
+}
+
+static void scene_object_bounds(struct aabb *box, const void *ctx,
+                                uint32_t obj_i)
+{
+    // the vector getter takes a mutable vector, but doesn't modify it
+    struct scene *scene = (struct scene *)ctx;
+    struct object *obj = object_vect_get(&scene->objects, obj_i);
+    obj->bounds(box, obj);
+}
+
+void scene_build_accel(struct scene *scene)
+{
+    size_t count = object_vect_size(&scene->objects);
+    struct aabb *bounds = xcalloc(count, sizeof(*bounds));
+    aabb_init(&scene->bounds);
+    for (size_t i = 0; i < count; i++)
+    {
+        scene_object_bounds(&bounds[i], scene, i);
+        aabb_extend(&scene->bounds, &bounds[i]);
+    }
+
+    scene->use_grid = grid_suits(bounds, count);
+    if (scene->use_grid)
+    {
+        bvh_destroy(&scene->bvh);
+        bvh_init(&scene->bvh);
+        grid_build(&scene->grid, bounds, count);
+    }
+    else
+    {
+        grid_destroy(&scene->grid);
+        grid_init(&scene->grid);
+        bvh_build(&scene->bvh, bounds, count);
+    }
+    free(bounds);
+    scene_build_spheres(scene);
+}
+
+void scene_refit(struct scene *scene)
+{
+    // grids build in linear time, and have nothing to refit
+    if (scene->use_grid)
+    {
+        scene_build_accel(scene);
+        return;
+    }
+
+    double degradation = bvh_refit(&scene->bvh, scene_object_bounds, scene);
+    if (degradation > BVH_REFIT_MAX_DEGRADATION)
+    {
+        scene_build_accel(scene);
+        return;
+    }
+
+    aabb_init(&scene->bounds);
+    if (scene->bvh.node_count)
+        bvh_node_get_bounds(&scene->bounds, &scene->bvh.nodes[0]);
+    scene_build_spheres(scene);
+}
+
+double scene_closest_hit(struct object_hit *hit, struct scene *scene,
+                         const struct ray *ray)
+{
+    if (scene->only_spheres)
+    {
+        if (scene->use_grid)
+            return scene_traverse_grid_spheres(hit, &scene->grid, scene, ray);
+        return scene_traverse_spheres(hit, &scene->bvh, scene, ray);
+    }
+
+    if (scene->use_grid)
+        return scene_traverse_grid(hit, &scene->grid, scene, ray);
+    return scene_traverse(hit, &scene->bvh, scene, ray);
+}
+
+double scene_intersect_ray(struct object_intersection *closest_intersection,
+                           struct scene *scene, const struct ray *ray)
+{
+    struct object_hit hit;
+    double dist = scene_closest_hit(&hit, scene, ray);
+    if (!isinf(dist))
+        object_finalize_hit(closest_intersection, &hit, ray, dist);
+    return dist;
+}
 
 void scene_destroy(struct scene *scene)
 {
@@ -10,4 +195,7 @@ void scene_destroy(struct scene *scene)
     }
 
     object_vect_destroy(&scene->objects);
+    grid_destroy(&scene->grid);
+    bvh_destroy(&scene->bvh);
+    sphere_batch_destroy(&scene->spheres);
 }
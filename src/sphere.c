@@ -1,50 +1,65 @@
 #include "sphere.h"
+#include "utils/simd.h"
 
+#include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-static double sphere_ray_intersect(struct intersection *intersection,
-                                   const struct sphere *sphere,
-                                   const struct ray *ray)
+/*
+** Intersects a ray with a sphere, using the discriminant of the quadratic
+** equation, which only takes a single square root. Spheres whose center is
+** behind the ray source are ignored, as well as intersections outside the
+** interval of the ray.
+*/
+static double sphere_ray_distance(const struct sphere *sphere,
+                                  const struct ray *ray)
 {
-    struct vec3 hypothenuse = vec3_sub(&sphere->center, &ray->source);
-    double hyp_len = vec3_length(&hypothenuse);
-    double projection = vec3_dot(&hypothenuse, &ray->direction);
+    struct vec3 to_center = vec3_sub(&sphere->center, &ray->source);
+    double projection = vec3_dot(&to_center, &ray->direction);
     if (projection < 0)
         return INFINITY;
 
-    double d = sqrt(hyp_len * hyp_len - projection * projection);
-    if (d > sphere->radius)
+    // the squared distance between the center and the ray
+    double center_dist2
+        = vec3_dot(&to_center, &to_center) - projection * projection;
+    double discriminant = sphere->radius * sphere->radius - center_dist2;
+    if (discriminant < 0)
         return INFINITY;
 
-    double radius = sphere->radius;
-    double m = sqrt(radius * radius - d * d);
-    double t0 = projection - m;
-    double t1 = projection + m;
-
-    double t = t0;
-    if (t < 0.)
-        t = t1;
-
-    // intersection point = ray->source + ray->direction * t
-    struct vec3 point_offset = vec3_mul(&ray->direction, t);
-    intersection->point = vec3_add(&ray->source, &point_offset);
-    intersection->normal = vec3_sub(&intersection->point, &sphere->center);
-    vec3_normalize(&intersection->normal);
-    // compute intersection coord / normal
-    return t;
+    double m = sqrt(discriminant);
+    double t = projection - m;
+    if (t < ray->tmin)
+        t = projection + m;
+    return ray_in_range(ray, t) ? t : INFINITY;
 }
 
-double object_sphere_ray_intersect(struct object_intersection *inter,
+double object_sphere_ray_intersect(struct object_hit *hit,
                                    const struct object *obj,
                                    const struct ray *ray)
 {
-    const struct sphere *sphere = (const struct sphere *)obj;
-    double inter_dis = sphere_ray_intersect(&inter->location, sphere, ray);
-    if (isinf(inter_dis))
-        return inter_dis;
+    hit->prim = 0;
+    return sphere_ray_distance((const struct sphere *)obj, ray);
+}
 
+void sphere_finalize_hit(struct object_intersection *inter,
+                         const struct object_hit *hit, const struct ray *ray,
+                         double dist)
+{
+    const struct sphere *sphere = (const struct sphere *)hit->object;
+    inter->location.point = ray_point(ray, dist);
+    inter->location.normal
+        = vec3_sub(&inter->location.point, &sphere->center);
+    vec3_normalize(&inter->location.normal);
     inter->material = sphere->material;
-    return inter_dis;
+}
+
+void sphere_bounds(struct aabb *box, const struct object *obj)
+{
+    const struct sphere *sphere = (const struct sphere *)obj;
+    struct vec3 radius = {sphere->radius, sphere->radius, sphere->radius};
+    box->min = vec3_sub(&sphere->center, &radius);
+    box->max = vec3_add(&sphere->center, &radius);
 }
 
 void sphere_free(struct object *obj)
@@ -53,3 +68,89 @@ void sphere_free(struct object *obj)
     material_put(sphere->material);
     free(sphere);
 }
+
+void sphere_batch_resize(struct sphere_batch *batch, size_t count)
+{
+    // batches may read up to a full batch width past the last sphere,
+    // though these lanes are ignored
+    size_t size = (count + SPHERE_BATCH_WIDTH - 1) * sizeof(double);
+    batch->count = count;
+    batch->x = xrealloc(batch->x, size);
+    batch->y = xrealloc(batch->y, size);
+    batch->z = xrealloc(batch->z, size);
+    batch->radius2 = xrealloc(batch->radius2, size);
+    for (size_t i = count; i < count + SPHERE_BATCH_WIDTH - 1; i++)
+    {
+        batch->x[i] = 0;
+        batch->y[i] = 0;
+        batch->z[i] = 0;
+        batch->radius2[i] = -1;
+    }
+}
+
+void sphere_batch_destroy(struct sphere_batch *batch)
+{
+    free(batch->x);
+    free(batch->y);
+    free(batch->z);
+    free(batch->radius2);
+}
+
+size_t sphere_batch_intersect(double *dist, const struct sphere_batch *batch,
+                              size_t begin, size_t count,
+                              const struct ray *ray)
+{
+    const v4d source_x = V4D_BROADCAST(ray->source.x);
+    const v4d source_y = V4D_BROADCAST(ray->source.y);
+    const v4d source_z = V4D_BROADCAST(ray->source.z);
+    const v4d dir_x = V4D_BROADCAST(ray->direction.x);
+    const v4d dir_y = V4D_BROADCAST(ray->direction.y);
+    const v4d dir_z = V4D_BROADCAST(ray->direction.z);
+
+    size_t res = SIZE_MAX;
+    double closest = ray->tmax;
+    for (size_t i = 0; i < count; i += SPHERE_BATCH_WIDTH)
+    {
+        v4d x;
+        v4d y;
+        v4d z;
+        v4d radius2;
+        memcpy(&x, &batch->x[begin + i], sizeof(x));
+        memcpy(&y, &batch->y[begin + i], sizeof(y));
+        memcpy(&z, &batch->z[begin + i], sizeof(z));
+        memcpy(&radius2, &batch->radius2[begin + i], sizeof(radius2));
+
+        // the same steps as sphere_ray_distance, on all lanes at once
+        v4d to_x = x - source_x;
+        v4d to_y = y - source_y;
+        v4d to_z = z - source_z;
+        v4d projection = to_x * dir_x + to_y * dir_y + to_z * dir_z;
+        v4d center_dist2 = (to_x * to_x + to_y * to_y + to_z * to_z)
+                           - projection * projection;
+        v4d discriminant = radius2 - center_dist2;
+
+        // most lanes miss: only take square roots for the ones which hit.
+        // the last batch may extend past the range
+        size_t width = count - i;
+        if (width > SPHERE_BATCH_WIDTH)
+            width = SPHERE_BATCH_WIDTH;
+        for (size_t k = 0; k < width; k++)
+        {
+            if (projection[k] < 0 || discriminant[k] < 0)
+                continue;
+
+            double m = sqrt(discriminant[k]);
+            double t = projection[k] - m;
+            if (t < ray->tmin)
+                t = projection[k] + m;
+            if (!(t >= ray->tmin && t < closest))
+                continue;
+
+            closest = t;
+            res = begin + i + k;
+        }
+    }
+
+    *dist = closest;
+    return res;
+}
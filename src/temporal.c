@@ -0,0 +1,188 @@
+#include "temporal.h"
+#include "utils/alloc.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// how far the depth of a reprojected point can be from the depth the
+// previous frame saw, relative to the depth of the point
+#define TEMPORAL_DEPTH_TOLERANCE 0.05
+
+// the minimum cosine between the normals of a reprojected point and what
+// the previous frame saw
+#define TEMPORAL_NORMAL_THRESHOLD 0.9
+
+// the distance the background is reprojected from
+#define TEMPORAL_BACKGROUND_DIST 1e9
+
+// reprojections are rejected when the pixels which saw the same surface
+// have less than this much of the interpolation weight
+#define TEMPORAL_MIN_WEIGHT 0.25
+
+// accumulated colors are weighted as if they held at most this many samples
+#define TEMPORAL_MAX_SAMPLES 16
+
+static void temporal_frame_clear(struct temporal_frame *frame, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        frame->pixels[i] = (struct temporal_pixel){.dist = INFINITY};
+}
+
+void temporal_init(struct temporal *temporal, size_t width, size_t height)
+{
+    temporal->width = width;
+    temporal->height = height;
+    temporal->current = 0;
+    for (size_t i = 0; i < 2; i++)
+    {
+        struct temporal_frame *frame = &temporal->frames[i];
+        frame->pixels = xcalloc(width * height, sizeof(*frame->pixels));
+        temporal_frame_clear(frame, width * height);
+    }
+}
+
+void temporal_destroy(struct temporal *temporal)
+{
+    for (size_t i = 0; i < 2; i++)
+        free(temporal->frames[i].pixels);
+}
+
+void temporal_begin_frame(struct temporal *temporal,
+                          const struct camera_basis *camera)
+{
+    temporal->current = !temporal->current;
+    struct temporal_frame *frame = &temporal->frames[temporal->current];
+    frame->camera = *camera;
+    temporal_frame_clear(frame, temporal->width * temporal->height);
+}
+
+void temporal_pixel_set_hit(struct temporal_pixel *pixel, uint32_t object_id,
+                            double dist, const struct vec3 *normal)
+{
+    pixel->object_id = object_id;
+    pixel->dist = dist;
+    pixel->normal[0] = normal->x;
+    pixel->normal[1] = normal->y;
+    pixel->normal[2] = normal->z;
+}
+
+/*
+** Whether a pixel of the previous frame saw the same surface as a sample
+** of the current frame. Background samples have no normal.
+*/
+static bool same_surface(const struct temporal_pixel *pixel, double dist,
+                         uint32_t object_id, const struct vec3 *normal)
+{
+    if (pixel->samples == 0 || pixel->object_id != object_id)
+        return false;
+    if (object_id == 0)
+        return true;
+
+    if (!(fabs(pixel->dist - dist) <= TEMPORAL_DEPTH_TOLERANCE * dist))
+        return false;
+
+    struct vec3 prev_normal = {pixel->normal[0], pixel->normal[1],
+                               pixel->normal[2]};
+    return vec3_dot(&prev_normal, normal) >= TEMPORAL_NORMAL_THRESHOLD;
+}
+
+bool temporal_reproject(struct temporal_pixel *res,
+                        const struct temporal *temporal,
+                        const struct vec3 *point, uint32_t object_id,
+                        const struct vec3 *normal)
+{
+    const struct temporal_frame *prev = &temporal->frames[!temporal->current];
+    double cam_x;
+    double cam_y;
+    double dist;
+    if (!camera_basis_project(&cam_x, &cam_y, &dist, &prev->camera, point))
+        return false;
+
+    // pixel centers are at half integer coordinates
+    double x = (cam_x + 0.5) * temporal->width - 0.5;
+    double y = (cam_y + 0.5) * temporal->height - 0.5;
+    // comparisons are written so that NaNs are rejected
+    if (!(x > -1 && x < temporal->width && y > -1 && y < temporal->height))
+        return false;
+
+    double x_0 = floor(x);
+    double y_0 = floor(y);
+    double total_weight = 0;
+    double samples = 0;
+    double color[3] = {0};
+    for (int dy = 0; dy < 2; dy++)
+        for (int dx = 0; dx < 2; dx++)
+        {
+            double tap_x = x_0 + dx;
+            double tap_y = y_0 + dy;
+            if (tap_x < 0 || tap_x >= temporal->width || tap_y < 0
+                || tap_y >= temporal->height)
+                continue;
+
+            const struct temporal_pixel *pixel
+                = &prev->pixels[(size_t)tap_y * temporal->width
+                                + (size_t)tap_x];
+            if (!same_surface(pixel, dist, object_id, normal))
+                continue;
+
+            double weight = (dx ? x - x_0 : 1 - (x - x_0))
+                            * (dy ? y - y_0 : 1 - (y - y_0));
+            total_weight += weight;
+            samples += weight * pixel->samples;
+            color[0] += weight * pixel->color.r;
+            color[1] += weight * pixel->color.g;
+            color[2] += weight * pixel->color.b;
+        }
+
+    if (total_weight < TEMPORAL_MIN_WEIGHT)
+        return false;
+
+    res->color.r = color[0] / total_weight;
+    res->color.g = color[1] / total_weight;
+    res->color.b = color[2] / total_weight;
+    res->samples = samples / total_weight;
+    return true;
+}
+
+bool temporal_reproject_background(struct temporal_pixel *res,
+                                   const struct temporal *temporal,
+                                   const struct ray *ray)
+{
+    // the background is infinitely far: only the direction of rays matters
+    struct vec3 point = ray_point(ray, TEMPORAL_BACKGROUND_DIST);
+    return temporal_reproject(res, temporal, &point, 0, NULL);
+}
+
+static float clamp_channel(float value, double min, double max)
+{
+    if (value < min)
+        return min;
+    if (value > max)
+        return max;
+    return value;
+}
+
+void temporal_clamp(struct temporal_pixel *history, const struct vec3 *min,
+                    const struct vec3 *max)
+{
+    history->color.r = clamp_channel(history->color.r, min->x, max->x);
+    history->color.g = clamp_channel(history->color.g, min->y, max->y);
+    history->color.b = clamp_channel(history->color.b, min->z, max->z);
+}
+
+void temporal_accumulate(struct temporal_pixel *pixel,
+                         const struct temporal_pixel *history,
+                         const struct vec3 *sample)
+{
+    uint32_t samples = history->samples;
+    if (samples > TEMPORAL_MAX_SAMPLES)
+        samples = TEMPORAL_MAX_SAMPLES;
+
+    // a running average of the last samples
+    float weight = 1.f / (samples + 1);
+    pixel->color.r = history->color.r + (sample->x - history->color.r) * weight;
+    pixel->color.g = history->color.g + (sample->y - history->color.g) * weight;
+    pixel->color.b = history->color.b + (sample->z - history->color.b) * weight;
+    pixel->samples = history->samples + 1;
+}
@@ -0,0 +1,78 @@
+#include "transform.h"
+
+#include <math.h>
+#include <stddef.h>
+
+void transform_compose(struct transform *res, const struct transform *a,
+                       const struct transform *b)
+{
+    struct transform tmp;
+    for (size_t i = 0; i < 3; i++)
+    {
+        for (size_t j = 0; j < 4; j++)
+        {
+            double sum = j == 3 ? a->m[i][3] : 0;
+            for (size_t k = 0; k < 3; k++)
+                sum += a->m[i][k] * b->m[k][j];
+            tmp.m[i][j] = sum;
+        }
+    }
+    *res = tmp;
+}
+
+int transform_inverse(struct transform *res, const struct transform *xf)
+{
+    const double(*m)[4] = xf->m;
+
+    // the inverse of the linear part is its adjugate over its determinant
+    double cof[3][3] = {
+        {m[1][1] * m[2][2] - m[1][2] * m[2][1],
+         m[0][2] * m[2][1] - m[0][1] * m[2][2],
+         m[0][1] * m[1][2] - m[0][2] * m[1][1]},
+        {m[1][2] * m[2][0] - m[1][0] * m[2][2],
+         m[0][0] * m[2][2] - m[0][2] * m[2][0],
+         m[0][2] * m[1][0] - m[0][0] * m[1][2]},
+        {m[1][0] * m[2][1] - m[1][1] * m[2][0],
+         m[0][1] * m[2][0] - m[0][0] * m[2][1],
+         m[0][0] * m[1][1] - m[0][1] * m[1][0]},
+    };
+
+    double det = m[0][0] * cof[0][0] + m[0][1] * cof[1][0]
+                 + m[0][2] * cof[2][0];
+    if (det == 0 || !isfinite(det))
+        return -1;
+
+    struct transform tmp;
+    for (size_t i = 0; i < 3; i++)
+        for (size_t j = 0; j < 3; j++)
+            tmp.m[i][j] = cof[i][j] / det;
+
+    // the inverse translation is -inv(linear) * translation
+    struct vec3 translation = {-m[0][3], -m[1][3], -m[2][3]};
+    tmp.m[0][3] = 0;
+    tmp.m[1][3] = 0;
+    tmp.m[2][3] = 0;
+    struct vec3 inv_translation = transform_vector(&tmp, &translation);
+    tmp.m[0][3] = inv_translation.x;
+    tmp.m[1][3] = inv_translation.y;
+    tmp.m[2][3] = inv_translation.z;
+
+    *res = tmp;
+    return 0;
+}
+
+void transform_aabb(struct aabb *res, const struct transform *xf,
+                    const struct aabb *box)
+{
+    aabb_init(res);
+    for (size_t i = 0; i < 8; i++)
+    {
+        struct vec3 corner = {
+            (i & 1) ? box->max.x : box->min.x,
+            (i & 2) ? box->max.y : box->min.y,
+            (i & 4) ? box->max.z : box->min.z,
+        };
+        corner = transform_point(xf, &corner);
+        aabb_extend_point(res, &corner);
+    }
+}
@@ -0,0 +1,73 @@
+#include "utils/parallel.h"
+#include "utils/alloc.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct parallel_task
+{
+    pthread_t thread_id;
+    parallel_range_f fn;
+    void *ctx;
+    size_t begin;
+    size_t end;
+};
+
+static void *parallel_task_start(void *arg)
+{
+    struct parallel_task *task = arg;
+    task->fn(task->ctx, task->begin, task->end);
+    return NULL;
+}
+
+size_t parallel_thread_count(void)
+{
+    long res = sysconf(_SC_NPROCESSORS_ONLN);
+    return res < 1 ? 1 : res;
+}
+
+void parallel_for(size_t count, size_t grain, parallel_range_f fn, void *ctx)
+{
+    if (count == 0)
+        return;
+
+    if (grain == 0)
+        grain = 1;
+
+    size_t num_threads = parallel_thread_count();
+    size_t max_tasks = (count + grain - 1) / grain;
+    if (num_threads > max_tasks)
+        num_threads = max_tasks;
+
+    // not worth starting threads
+    if (num_threads == 1)
+    {
+        fn(ctx, 0, count);
+        return;
+    }
+
+    struct parallel_task *tasks = xcalloc(num_threads, sizeof(*tasks));
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        tasks[i].fn = fn;
+        tasks[i].ctx = ctx;
+        tasks[i].begin = i * count / num_threads;
+        tasks[i].end = (i + 1) * count / num_threads;
+    }
+
+    // the calling thread handles the first range itself
+    for (size_t i = 1; i < num_threads; i++)
+        if (pthread_create(&tasks[i].thread_id, NULL, parallel_task_start,
+                           &tasks[i]))
+            errx(42, "pthread_create error, exiting...");
+
+    fn(ctx, tasks[0].begin, tasks[0].end);
+
+    for (size_t i = 1; i < num_threads; i++)
+        if (pthread_join(tasks[i].thread_id, NULL))
+            errx(42, "pthread_join error, exiting...");
+
+    free(tasks);
+}